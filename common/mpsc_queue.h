@@ -0,0 +1,74 @@
+// Copyright (c) 2015, Baidu.com, Inc. All Rights Reserved
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef COMMON_MPSC_QUEUE_H_
+#define COMMON_MPSC_QUEUE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+
+namespace ins_common {
+
+// 多生产者单消费者的无锁队列(Vyukov)，Push可以被任意线程并发调用，
+// Pop只能由一个消费者线程调用
+template <typename T>
+class MpscQueue {
+ public:
+  MpscQueue() : head_(new Node()), tail_(head_.load()), size_(0) {}
+  ~MpscQueue() {
+    T item;
+    while (Pop(&item)) {
+    }
+    delete tail_;
+  }
+
+  // 返回push之前队列是否为空，调用者据此决定是否唤醒消费者
+  bool Push(const T& item) {
+    bool was_empty = (size_.fetch_add(1, std::memory_order_acq_rel) == 0);
+    Node* node = new Node(item);
+    Node* prev = head_.exchange(node, std::memory_order_acq_rel);
+    prev->next.store(node, std::memory_order_release);
+    return was_empty;
+  }
+
+  // 生产者还没有链接好节点时也可能返回false，此时Size() > 0
+  bool Pop(T* item) {
+    Node* tail = tail_;
+    Node* next = tail->next.load(std::memory_order_acquire);
+    if (next == NULL) {
+      return false;
+    }
+    *item = next->value;
+    next->value = T();
+    tail_ = next;
+    delete tail;
+    size_.fetch_sub(1, std::memory_order_acq_rel);
+    return true;
+  }
+
+  int64_t Size() const { return size_.load(std::memory_order_acquire); }
+  bool Empty() const { return Size() == 0; }
+
+ private:
+  struct Node {
+    std::atomic<Node*> next;
+    T value;
+    Node() : next(NULL) {}
+    explicit Node(const T& v) : next(NULL), value(v) {}
+  };
+
+  std::atomic<Node*> head_;  // producers push here
+  Node* tail_;               // consumer pops here, always a stub node
+  std::atomic<int64_t> size_;
+
+  MpscQueue(const MpscQueue&);
+  void operator=(const MpscQueue&);
+};
+
+}  // namespace ins_common
+
+using ins_common::MpscQueue;
+
+#endif  // COMMON_MPSC_QUEUE_H_
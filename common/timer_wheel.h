@@ -0,0 +1,110 @@
+// Copyright (c) 2015, Baidu.com, Inc. All Rights Reserved
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef COMMON_TIMER_WHEEL_H_
+#define COMMON_TIMER_WHEEL_H_
+
+#include <stdint.h>
+#include <vector>
+
+namespace ins_common {
+
+// 分层时间轮，每层kSlots个槽，第i层一个槽跨越kSlots^i个tick。
+// Add是O(1)的，Advance逐个tick推进，低层转完一圈时把高层对应的槽
+// 下放到低层。到期时间超出最高层范围的定时器会提前返回，调用者需要
+// 自己检查真正的到期时间并重新Add。不是线程安全的，由调用者加锁
+template <typename K>
+class TimerWheel {
+ public:
+  // tick和时间的单位由调用者决定，只要一致即可
+  TimerWheel(int64_t tick, int64_t now)
+      : tick_(tick), current_(now / tick), size_(0) {}
+
+  // 不早于deadline(按tick向上取整)时由Advance返回
+  void Add(const K& key, int64_t deadline) {
+    Insert(key, (deadline + tick_ - 1) / tick_);
+    size_++;
+  }
+
+  // 推进到now，把到期的key追加到due
+  void Advance(int64_t now, std::vector<K>* due) {
+    int64_t target = now / tick_;
+    if (size_ == 0) {
+      if (target > current_) {
+        current_ = target;
+      }
+      return;
+    }
+    while (current_ < target) {
+      current_++;
+      for (int level = 1; level < kLevels; level++) {
+        if ((current_ & ((int64_t(1) << (kBits * level)) - 1)) != 0) {
+          break;
+        }
+        std::vector<Entry> entries;
+        entries.swap(wheels_[level][(current_ >> (kBits * level)) & kMask]);
+        for (size_t i = 0; i < entries.size(); i++) {
+          if (entries[i].expire <= current_) {  // 本tick到期，下面马上返回
+            wheels_[0][current_ & kMask].push_back(entries[i]);
+          } else {
+            Insert(entries[i].key, entries[i].expire);
+          }
+        }
+      }
+      std::vector<Entry>& slot = wheels_[0][current_ & kMask];
+      for (size_t i = 0; i < slot.size(); i++) {
+        due->push_back(slot[i].key);
+      }
+      size_ -= slot.size();
+      slot.clear();
+    }
+  }
+
+  int64_t Size() const { return size_; }
+
+ private:
+  static const int kBits = 6;
+  static const int kSlots = 1 << kBits;
+  static const int64_t kMask = kSlots - 1;
+  static const int kLevels = 4;
+
+  struct Entry {
+    K key;
+    int64_t expire;  // in ticks
+  };
+
+  void Insert(const K& key, int64_t expire) {
+    if (expire <= current_) {
+      expire = current_ + 1;  // 已经过期的在下一个tick返回
+    }
+    int64_t delta = expire - current_;
+    const int64_t max_delta = (int64_t(1) << (kBits * kLevels)) - 1;
+    if (delta > max_delta) {
+      expire = current_ + max_delta;
+      delta = max_delta;
+    }
+    int level = 0;
+    while (delta >= (int64_t(1) << (kBits * (level + 1)))) {
+      level++;
+    }
+    Entry entry;
+    entry.key = key;
+    entry.expire = expire;
+    wheels_[level][(expire >> (kBits * level)) & kMask].push_back(entry);
+  }
+
+  int64_t tick_;
+  int64_t current_;  // ticks already processed
+  int64_t size_;
+  std::vector<Entry> wheels_[kLevels][kSlots];
+
+  TimerWheel(const TimerWheel&);
+  void operator=(const TimerWheel&);
+};
+
+}  // namespace ins_common
+
+using ins_common::TimerWheel;
+
+#endif  // COMMON_TIMER_WHEEL_H_
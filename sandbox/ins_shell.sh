@@ -50,6 +50,9 @@ do
 	"whoami")
 		sh ./test_whoami.sh
 	;;
+	"transfer")
+		sh ./transfer_leader.sh $arg1
+	;;
 	"quit")
 		exit 0
 	;;
@@ -65,6 +68,7 @@ do
 		echo "  lock (key) [lock on specific key]"
 		echo "  register (username) (password) [register a new user]"
 		echo "  login (username) (password) [login and open a new session]"
+		echo "  transfer (server) [hand leadership over to a caught-up follower]"
 		echo "  quit to exit shell"
 	;;
 
@@ -0,0 +1,2 @@
+#!/bin/bash
+../output/bin/ins_cli --ins_cmd=transfer --flagfile=ins.flag --ins_transfer_target=$1
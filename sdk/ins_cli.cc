@@ -21,6 +21,7 @@ DECLARE_string(ins_start_key);
 DECLARE_string(ins_end_key);
 DECLARE_string(ins_rm_binlog_server_id);
 DECLARE_int64(ins_rm_binlog_index);
+DECLARE_string(ins_transfer_target);
 
 using namespace galaxy::ins::sdk;
 
@@ -68,6 +69,8 @@ void reset_flags() {
   } else if (FLAGS_ins_cmd == "clean") {
     FLAGS_ins_rm_binlog_server_id = commands[1];
     FLAGS_ins_rm_binlog_index = boost::lexical_cast<int>(commands[2]);
+  } else if (FLAGS_ins_cmd == "transfer") {
+    FLAGS_ins_transfer_target = commands[1];
   } else {
     // "show" command - do nothing
   }
@@ -98,6 +101,25 @@ int main(int argc, char* argv[]) {
             boost::lexical_cast<std::string>(it->last_applied).c_str());
       }
       std::cout << cprinter.ToString();
+      for (it = cluster_info.begin(); it != cluster_info.end(); it++) {
+        if (it->followers.empty()) {
+          continue;
+        }
+        TPrinter fprinter(6);
+        fprinter.AddRow(6, "follower", "next_index", "match_index", "inflight",
+                        "credit", "stall_ms");
+        std::vector<FollowerInfo>::iterator ft;
+        for (ft = it->followers.begin(); ft != it->followers.end(); ft++) {
+          fprinter.AddRow(
+              6, ft->server_id.c_str(),
+              boost::lexical_cast<std::string>(ft->next_index).c_str(),
+              boost::lexical_cast<std::string>(ft->match_index).c_str(),
+              boost::lexical_cast<std::string>(ft->inflight).c_str(),
+              boost::lexical_cast<std::string>(ft->credit).c_str(),
+              boost::lexical_cast<std::string>(ft->stall_ms).c_str());
+        }
+        std::cout << fprinter.ToString();
+      }
     } else if (FLAGS_ins_cmd == "put") {
       std::string key = FLAGS_ins_key;
       std::string value = FLAGS_ins_value;
@@ -195,6 +217,15 @@ int main(int argc, char* argv[]) {
         return 1;
       }
       fprintf(stderr, "clean ok\n");
+    } else if (FLAGS_ins_cmd == "transfer") {
+      std::string target_id = FLAGS_ins_transfer_target;
+      bool ret = sdk.TransferLeader(target_id, &ins_err);
+      if (!ret) {
+        fprintf(stderr, "transfer fail: %s\n",
+                InsSDK::ErrorToString(ins_err).c_str());
+        return 1;
+      }
+      fprintf(stderr, "transfer ok, leader is %s now\n", target_id.c_str());
     } else if (FLAGS_ins_cmd == "stat") {
       TPrinter sprinter(11);
       sprinter.AddRow(11, "server id", "status", "kind", "Put", "Get", "Delete",
@@ -28,7 +28,9 @@
 DECLARE_string(cluster_members);
 DECLARE_int32(ins_watch_timeout);
 DECLARE_int32(ins_backup_watch_timeout);
+DECLARE_int32(ins_lock_wait_timeout);
 DECLARE_int64(ins_sdk_session_timeout);
+DECLARE_bool(ins_sdk_follower_read);
 DECLARE_string(ins_log_file);
 DECLARE_int32(ins_log_size);
 DECLARE_int32(ins_log_total_size);
@@ -67,6 +69,7 @@ void InsSDK::Init(const std::vector<std::string>& members) {
   session_timeout_ctx_ = NULL;
   loggin_expired_ = false;
   watch_task_id_ = 0;
+  read_server_seq_ = 0;
   last_succ_alive_timestamp_ = ins_common::timer::get_micros();
   // sofa::pbrpc::set_log_handler(ins_common::RpcLogHandler);
   if (members.size() < 1) {
@@ -118,6 +121,19 @@ void InsSDK::PrepareServerList(std::vector<std::string>& server_list) {
   std::copy(members_.begin(), members_.end(), std::back_inserter(server_list));
 }
 
+void InsSDK::PrepareReadServerList(std::vector<std::string>& server_list) {
+  if (!FLAGS_ins_sdk_follower_read) {
+    PrepareServerList(server_list);
+    return;
+  }
+  // 不优先发给leader，读请求才能分散到所有节点上
+  MutexLock lock(mu_);
+  const size_t start = read_server_seq_++ % members_.size();
+  for (size_t i = 0; i < members_.size(); i++) {
+    server_list.push_back(members_[(start + i) % members_.size()]);
+  }
+}
+
 bool InsSDK::ShowCluster(std::vector<ClusterNodeInfo>* cluster_info) {
   if (cluster_info == NULL) {
     return true;
@@ -147,6 +163,17 @@ bool InsSDK::ShowCluster(std::vector<ClusterNodeInfo>* cluster_info) {
       node_info.last_log_term = response.last_log_term();
       node_info.commit_index = response.commit_index();
       node_info.last_applied = response.last_applied();
+      for (int i = 0; i < response.followers_size(); i++) {
+        const ::galaxy::ins::FollowerStatus& status = response.followers(i);
+        FollowerInfo follower;
+        follower.server_id = status.server_id();
+        follower.next_index = status.next_index();
+        follower.match_index = status.match_index();
+        follower.inflight = status.inflight();
+        follower.credit = status.credit();
+        follower.stall_ms = status.stall_ms();
+        node_info.followers.push_back(follower);
+      }
     }
     cluster_info->push_back(node_info);
   }
@@ -282,7 +309,7 @@ bool InsSDK::Put(const std::string& key, const std::string& value,
 
 bool InsSDK::Get(const std::string& key, std::string* value, SDKError* error) {
   std::vector<std::string> server_list;
-  PrepareServerList(server_list);
+  PrepareReadServerList(server_list);
   SDKError err_temp = kOK;
   if (error == NULL) {
     error = &err_temp;
@@ -311,7 +338,9 @@ bool InsSDK::Get(const std::string& key, std::string* value, SDKError* error) {
     if (response.success() || response.uuid_expired()) {
       {
         MutexLock lock(mu_);
-        leader_id_ = server_id;
+        // follower read时应答里带回真正的leader
+        leader_id_ = response.leader_id().empty() ? server_id
+                                                  : response.leader_id();
       }
       *value = response.value();
       if (response.uuid_expired()) {
@@ -342,7 +371,8 @@ bool InsSDK::Get(const std::string& key, std::string* value, SDKError* error) {
         if (ok && (response.success() || response.uuid_expired())) {
           {
             MutexLock lock(mu_);
-            leader_id_ = server_id;
+            leader_id_ = response.leader_id().empty() ? server_id
+                                                      : response.leader_id();
           }
           *value = response.value();
           if (response.uuid_expired()) {
@@ -382,7 +412,7 @@ bool InsSDK::ScanOnce(const std::string& start_key, const std::string& end_key,
     return false;
   }
   std::vector<std::string> server_list;
-  PrepareServerList(server_list);
+  PrepareReadServerList(server_list);
   std::vector<std::string>::const_iterator it;
   for (it = server_list.begin(); it != server_list.end(); it++) {
     std::string server_id = *it;
@@ -409,7 +439,9 @@ bool InsSDK::ScanOnce(const std::string& start_key, const std::string& end_key,
     if (response.success() || response.uuid_expired()) {
       {
         MutexLock lock(mu_);
-        leader_id_ = server_id;
+        // follower read时应答里带回真正的leader
+        leader_id_ = response.leader_id().empty() ? server_id
+                                                  : response.leader_id();
       }
       if (response.uuid_expired()) {
         LOG(WARNING) << "uuid is expired before scan: [" << start_key << ", "
@@ -440,7 +472,8 @@ bool InsSDK::ScanOnce(const std::string& start_key, const std::string& end_key,
         if (ok && (response.success() || response.uuid_expired())) {
           {
             MutexLock lock(mu_);
-            leader_id_ = server_id;
+            leader_id_ = response.leader_id().empty() ? server_id
+                                                      : response.leader_id();
           }
           if (response.uuid_expired()) {
             LOG(WARNING) << "uuid is expired before scan: [" << start_key
@@ -844,12 +877,18 @@ bool InsSDK::Lock(const std::string& key, SDKError* error) {
   if (error == NULL) {
     error = &err_temp;
   }
-  while (!TryLock(key, error)) {
+  // 锁被占用时在leader上排队，锁释放后立即返回
+  int64_t start_timestamp = ins_common::timer::get_micros();
+  while (!DoLock(key, true, error)) {
     if (*error == kUnknownUser) {
       break;
     }
     LOG(INFO) << "try lock again on: " << key;
-    ThisThread::Sleep(1000);
+    // 没有排队就失败了(比如正在选主)，稍等再重试
+    if (ins_common::timer::get_micros() - start_timestamp < 1000000) {
+      ThisThread::Sleep(1000);
+    }
+    start_timestamp = ins_common::timer::get_micros();
     {
       MutexLock lock(mu_);
       if (stop_) {
@@ -861,6 +900,10 @@ bool InsSDK::Lock(const std::string& key, SDKError* error) {
 }
 
 bool InsSDK::TryLock(const std::string& key, SDKError* error) {
+  return DoLock(key, false, error);
+}
+
+bool InsSDK::DoLock(const std::string& key, bool wait, SDKError* error) {
   {
     MutexLock lock(mu_);
     if (!is_keep_alive_bg_) {
@@ -876,6 +919,12 @@ bool InsSDK::TryLock(const std::string& key, SDKError* error) {
   }
   std::vector<std::string>::const_iterator it;
   for (it = server_list.begin(); it != server_list.end(); it++) {
+    {
+      MutexLock lock(mu_);
+      if (stop_) {
+        break;
+      }
+    }
     std::string server_id = *it;
     LOG(INFO) << "rpc to " << server_id;
     galaxy::ins::InsNode_Stub* stub, *stub2;
@@ -889,8 +938,14 @@ bool InsSDK::TryLock(const std::string& key, SDKError* error) {
     }
     request.set_key(key);
     request.set_session_id(GetSessionID());
+    int rpc_timeout = 2;
+    if (wait) {
+      request.set_wait(true);
+      request.set_wait_timeout(FLAGS_ins_lock_wait_timeout * 1000);
+      rpc_timeout += FLAGS_ins_lock_wait_timeout;
+    }
     bool ok = rpc_client_->SendRequest(stub, &InsNode_Stub::Lock, &request,
-                                       &response, 2, 1);
+                                       &response, rpc_timeout, 1);
     if (!ok) {
       LOG(ERROR) << "failed to rpc " << server_id;
       continue;
@@ -902,7 +957,7 @@ bool InsSDK::TryLock(const std::string& key, SDKError* error) {
       rpc_client_->GetStub(server_id, &stub2);
       std::unique_ptr<galaxy::ins::InsNode_Stub> stub_guard2(stub2);
       ok = rpc_client_->SendRequest(stub2, &InsNode_Stub::Lock, &request,
-                                    &response, 2, 1);
+                                    &response, rpc_timeout, 1);
       if (!ok) {
         continue;
       }
@@ -927,6 +982,11 @@ bool InsSDK::TryLock(const std::string& key, SDKError* error) {
       *error = kOK;
       return true;
     }
+    if (wait && response.leader_id().empty()) {
+      // leader已经让我们排过队了，换一个节点只会被转发回来重新等待，
+      // 还会丢掉排队的位置
+      break;
+    }
   }
   *error = kLockFail;
   return false;
@@ -1309,6 +1369,58 @@ bool InsSDK::CleanBinlog(const std::string& server_id, int64_t end_index,
   return true;
 }
 
+bool InsSDK::TransferLeader(const std::string& target_id, SDKError* error) {
+  std::vector<std::string> server_list;
+  PrepareServerList(server_list);
+  SDKError err_temp = kOK;
+  if (error == NULL) {
+    error = &err_temp;
+  }
+  galaxy::ins::TransferLeaderRequest request;
+  request.set_target_id(target_id);
+  for (auto it = server_list.begin(); it != server_list.end(); it++) {
+    std::string server_id = *it;
+    galaxy::ins::TransferLeaderResponse response;
+    galaxy::ins::InsNode_Stub* stub;
+    rpc_client_->GetStub(server_id, &stub);
+    std::unique_ptr<galaxy::ins::InsNode_Stub> stub_guard(stub);
+    bool ok = rpc_client_->SendRequest(stub, &InsNode_Stub::TransferLeader,
+                                       &request, &response, 5, 1);
+    if (!ok) {
+      LOG(ERROR) << "failed to send TransferLeader rpc to " << server_id;
+      continue;
+    }
+    if (!response.success() && !response.leader_id().empty() &&
+        response.leader_id() != server_id) {
+      server_id = response.leader_id();
+      LOG(INFO) << "redirect to leader: " << server_id;
+      galaxy::ins::InsNode_Stub* stub2;
+      rpc_client_->GetStub(server_id, &stub2);
+      std::unique_ptr<galaxy::ins::InsNode_Stub> stub_guard2(stub2);
+      ok = rpc_client_->SendRequest(stub2, &InsNode_Stub::TransferLeader,
+                                    &request, &response, 5, 1);
+      if (!ok) {
+        continue;
+      }
+    }
+    if (response.success()) {
+      MutexLock lock(mu_);
+      leader_id_ = response.leader_id();
+      *error = kOK;
+      return true;
+    }
+    if (response.leader_id() == server_id) {
+      // 找到了leader但是移交失败
+      LOG(ERROR) << "leader " << server_id << " failed to transfer to "
+                 << target_id;
+      *error = kTimeout;
+      return false;
+    }
+  }
+  *error = kClusterDown;
+  return false;
+}
+
 bool InsSDK::ShowStatistics(std::vector<NodeStatInfo>* statistics) {
   if (statistics == NULL) {
     return true;
@@ -38,6 +38,15 @@ enum SDKError {
   kUnknownUser = 9
 };
 
+struct FollowerInfo {
+  std::string server_id;
+  int64_t next_index;
+  int64_t match_index;
+  int32_t inflight;
+  int64_t credit;
+  int64_t stall_ms;
+};
+
 struct ClusterNodeInfo {
   std::string server_id;
   int32_t status;
@@ -46,6 +55,7 @@ struct ClusterNodeInfo {
   int64_t last_log_term;
   int64_t commit_index;
   int64_t last_applied;
+  std::vector<FollowerInfo> followers;  // replication state seen by leader
 };
 
 struct StatInfo {
@@ -103,6 +113,8 @@ class InsSDK {
                 SDKError* error);
   bool CleanBinlog(const std::string& server_id, int64_t end_index,
                    SDKError* error);
+  // 让当前leader把leadership移交给target_id
+  bool TransferLeader(const std::string& target_id, SDKError* error);
   bool ShowStatistics(std::vector<NodeStatInfo>* statistics);
   std::string GetSessionID();
   std::string GetCurrentUserID();
@@ -114,10 +126,14 @@ class InsSDK {
  private:
   void Init(const std::vector<std::string>& members);
   void PrepareServerList(std::vector<std::string>& server_list);
+  // Get/Scan用，开启follower read时轮流从不同的节点开始
+  void PrepareReadServerList(std::vector<std::string>& server_list);
   void KeepAliveTask();
   void KeepWatchTask(const std::string& key, const std::string& old_value,
                      bool key_exist, std::string session_id, int64_t watch_id);
   void MakeSessionID();
+  // wait为true时锁被占用会在leader上排队
+  bool DoLock(const std::string& key, bool wait, SDKError* error);
   void KeepWatchCallback(const galaxy::ins::WatchRequest* request,
                          galaxy::ins::WatchResponse* response, bool failed,
                          int error, std::string server_id, int64_t watch_id);
@@ -143,6 +159,7 @@ class InsSDK {
   void* session_timeout_ctx_;
   int64_t last_succ_alive_timestamp_;
   int64_t watch_task_id_;
+  size_t read_server_seq_;
   std::set<int64_t> pending_watches_;
   bool loggin_expired_;
 };
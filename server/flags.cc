@@ -8,18 +8,66 @@ DEFINE_string(ins_data_dir, "data",
 DEFINE_string(ins_binlog_dir, "binlog", "write-ahead log directory path");
 DEFINE_int32(max_cluster_size, 10, "maximum size of ins cluster");
 DEFINE_int32(log_rep_batch_max, 500, "maximum batch size of log replication");
+DEFINE_int32(log_rep_batch_size, 4096,
+             "maximum bytes(KB) of a log replication batch");
+DEFINE_int32(log_rep_latency_target, 50,
+             "replication batches shrink when their rtt(ms) exceeds this");
+DEFINE_bool(log_rep_compress, true,
+            "snappy compress large replication batches for followers "
+            "that support it");
+DEFINE_int32(log_rep_compress_threshold, 64,
+             "minimum bytes(KB) of a replication batch to be compressed");
+DEFINE_int32(replication_max_inflight, 4,
+             "maximum outstanding AppendEntries batches per follower");
 DEFINE_int32(replication_retry_timespan, 2000,
              "when replication fail, sleep a while before retry");
+DEFINE_int32(ins_heartbeat_interval, 50,
+             "leader sends a heartbeat(ms) to followers without other traffic");
 DEFINE_int64(elect_timeout_min, 150, "mininum timeout to make a new election");
 DEFINE_int32(elect_timeout_max, 300, "maximum timeout to make a new election");
+DEFINE_int32(transfer_leader_timeout, 2000,
+             "give up a leadership transfer(ms) if the target does not take "
+             "over in time");
+DEFINE_bool(ins_pre_vote, false,
+            "run a PreVote round before increasing term to start an election, "
+            "enable only after every node is upgraded: older nodes take a "
+            "PreVote as a real vote");
+DEFINE_bool(ins_leader_lease, true,
+            "serve reads on leader without quorum confirmation while the "
+            "leader lease is valid");
+DEFINE_int64(leader_lease_timeout, 120,
+             "leader lease length (ms), must be less than elect_timeout_min");
+DEFINE_bool(ins_follower_read, false,
+            "followers serve Get/Scan after confirming read index with leader, "
+            "enable only after every node is upgraded: the leader must "
+            "support the ReadIndex rpc");
 DEFINE_int64(session_expire_timeout, 6000000,
              "timeout for session expiration, 6 seconds in default");
+DEFINE_int32(session_check_interval, 100,
+             "granularity(ms) of session expiration checks");
+DEFINE_int32(session_sync_interval, 500,
+             "leader sends refreshed sessions to followers every interval(ms)");
 DEFINE_int32(max_write_pending, 10000, "max write pending size of Put");
 DEFINE_int32(max_commit_pending, 10000, "max commit pending size");
+DEFINE_int32(max_lock_wait_timeout, 60,
+             "upper bound of the wait time a blocking Lock may ask "
+             "for(seconds)");
+DEFINE_int32(ins_apply_batch_size, 1000,
+             "max number of committed entries applied in one write batch");
 DEFINE_bool(ins_data_compress, true,
             "enable snappy compression on leveldb storage");
 DEFINE_bool(ins_binlog_compress, true, "enable snappy compression on binlog");
 DEFINE_int32(ins_gc_interval, 60, "binlog clean interval (seconds)");
+DEFINE_int64(ins_binlog_retain_entries, 100000,
+             "binlog entries kept before the majority applied index for "
+             "lagging followers, older ones need a snapshot to catch up");
+DEFINE_int32(ins_binlog_retain_size, 256,
+             "max size of binlog kept before the majority applied index, MB");
+DEFINE_int32(ins_snapshot_chunk_size, 1024,
+             "max size of one InstallSnapshot chunk, KB");
+DEFINE_int32(ins_snapshot_rate_limit, 20,
+             "max bandwidth of sending a snapshot to one follower, MB/s, "
+             "non-positive means unlimited");
 DEFINE_int32(ins_max_throughput_in, -1, "max input throughput, MB");
 DEFINE_int32(ins_max_throughput_out, -1, "max output throughput, MB");
 DEFINE_int32(ins_data_block_size, 4, "for data, leveldb block_size, KB");
@@ -28,6 +76,17 @@ DEFINE_int32(ins_data_write_buffer_size, 4,
              "for data, leveldb write_buffer_size, MB");
 DEFINE_int32(ins_binlog_write_buffer_size, 4,
              "for binlog, leveldb write_buffer_size, MB");
+DEFINE_int32(ins_binlog_cache_size, 64,
+             "for binlog, memory budget of the recent entries cache, MB");
+DEFINE_string(ins_binlog_backend, "leveldb",
+              "binlog storage backend: leveldb or segment");
+DEFINE_int32(ins_binlog_segment_size, 64,
+             "for segment binlog, preallocated size of one segment file, MB");
+DEFINE_string(ins_binlog_sync_mode, "none",
+              "binlog durability: none, batch (fsync every write batch) or "
+              "timed (fsync every ins_binlog_sync_interval ms)");
+DEFINE_int32(ins_binlog_sync_interval, 10,
+             "for timed binlog sync, interval between two fsyncs, ms");
 DEFINE_int32(performance_interval, 1000,
              "milliseconds of the interval of performance counter ticktock");
 DEFINE_int32(
@@ -44,7 +103,14 @@ DEFINE_string(ins_value, "v123", "");
 DEFINE_int64(ins_rm_binlog_index, 0, "end index of binlog clean operation");
 DEFINE_string(ins_rm_binlog_server_id, "",
               "servier id of binlog clean operation");
+DEFINE_string(ins_transfer_target, "",
+              "server id to take over leadership in transfer operation");
 DEFINE_int32(ins_watch_timeout, 120, "wath timeout(seconds)");
 DEFINE_int32(ins_backup_watch_timeout, 115, "backup watch timeout(seconds)");
+DEFINE_int32(ins_lock_wait_timeout, 10,
+             "how long a blocking Lock waits in the leader's queue(seconds)");
 DEFINE_int64(ins_sdk_session_timeout, 6000000,
              "timeout for session expiration in sdk side");
+DEFINE_bool(ins_sdk_follower_read, false,
+            "sdk spreads Get/Scan over all members instead of the leader, "
+            "enable together with --ins_follower_read on the servers");
@@ -10,6 +10,7 @@
 #include <boost/algorithm/string/replace.hpp>
 #include <boost/bind.hpp>
 #include <boost/function.hpp>
+#include <functional>
 #include <limits>
 #include <vector>
 #include "common/this_thread.h"
@@ -21,18 +22,42 @@ DECLARE_string(ins_data_dir);
 DECLARE_string(ins_binlog_dir);
 DECLARE_int32(max_cluster_size);
 DECLARE_int32(log_rep_batch_max);
+DECLARE_int32(log_rep_batch_size);
+DECLARE_int32(log_rep_latency_target);
+DECLARE_bool(log_rep_compress);
+DECLARE_int32(ins_heartbeat_interval);
+DECLARE_bool(ins_pre_vote);
+DECLARE_int32(transfer_leader_timeout);
+DECLARE_int32(session_sync_interval);
+DECLARE_int32(session_check_interval);
+DECLARE_int32(log_rep_compress_threshold);
+DECLARE_int32(replication_max_inflight);
 DECLARE_int32(replication_retry_timespan);
 DECLARE_int64(elect_timeout_min);
 DECLARE_int32(elect_timeout_max);
+DECLARE_bool(ins_leader_lease);
+DECLARE_int64(leader_lease_timeout);
+DECLARE_bool(ins_follower_read);
 DECLARE_int64(session_expire_timeout);
 DECLARE_int32(ins_gc_interval);
+DECLARE_int64(ins_binlog_retain_entries);
+DECLARE_int32(ins_binlog_retain_size);
+DECLARE_int32(ins_snapshot_chunk_size);
+DECLARE_int32(ins_snapshot_rate_limit);
 DECLARE_int32(max_write_pending);
 DECLARE_int32(max_commit_pending);
 DECLARE_bool(ins_binlog_compress);
 DECLARE_int32(ins_binlog_block_size);
 DECLARE_int32(ins_binlog_write_buffer_size);
+DECLARE_int32(ins_binlog_cache_size);
+DECLARE_string(ins_binlog_backend);
+DECLARE_int32(ins_binlog_segment_size);
+DECLARE_string(ins_binlog_sync_mode);
+DECLARE_int32(ins_binlog_sync_interval);
+DECLARE_int32(ins_apply_batch_size);
 DECLARE_int32(performance_buffer_size);
 DECLARE_int32(ins_trace_ratio);
+DECLARE_int32(max_lock_wait_timeout);
 
 const std::string tag_last_applied_index = "#TAG_LAST_APPLIED_INDEX#";
 
@@ -41,42 +66,94 @@ namespace ins {
 
 const static size_t sMaxPBSize = (26 << 20);
 
+// leader用raw_entries发送binlog原始记录，entries只为兼容保留
+static int EntriesSize(const ::galaxy::ins::AppendEntriesRequest* request) {
+  if (request->has_compressed_entries()) {
+    return request->compressed_count();
+  }
+  return request->raw_entries_size() > 0 ? request->raw_entries_size()
+                                         : request->entries_size();
+}
+
+static int64_t EntryTerm(const ::galaxy::ins::AppendEntriesRequest* request,
+                         int i) {
+  return request->raw_entries_size() > 0
+             ? LogEntry::LoadTerm(request->raw_entries(i))
+             : request->entries(i).term();
+}
+
 InsNodeImpl::InsNodeImpl(std::string& server,
                          const std::vector<std::string>& members)
     : members_(members),
       stop_(false),
       self_id_(server),
       current_term_(0),
+      pre_vote_term_(-1),
+      pre_vote_grant_(0),
       status_(kFollower),
       heartbeat_count_(0),
       meta_(NULL),
       binlogger_(NULL),
       user_manager_(NULL),
       replicatter_(FLAGS_max_cluster_size),
+      write_cond_(NULL),
+      writer_stop_(false),
+      log_writer_(1),
+      binlog_syncer_(1),
       heartbeat_read_timestamp_(0),
+      lease_expire_timestamp_(0),
+      lease_resume_timestamp_(0),
+      transfer_deadline_(0),
+      transfer_notified_(false),
+      transfer_response_(NULL),
+      transfer_done_(NULL),
       in_safe_mode_(true),
       server_start_timestamp_(0),
+      sessions_(FLAGS_session_expire_timeout,
+                FLAGS_session_check_interval * 1000),
+      sessions_valid_timestamp_(0),
       commit_index_(-1),
       last_applied_index_(-1),
+      snapshot_store_(NULL),
+      snapshot_id_(-1),
+      snapshot_next_chunk_(0),
+      snapshot_with_logged_users_(false),
+      follower_appender_(1),
+      verified_log_index_(-1),
+      leader_contact_timestamp_(0),
+      session_contact_timestamp_(0),
       single_node_mode_(false),
       last_safe_clean_index_(-1),
+      retain_start_index_(-1),
+      retain_bytes_(0),
       perform_(FLAGS_performance_buffer_size) {
   Init();
 
   LOG(INFO) << "=================Init node imple done========================";
   committer_.AddTask(std::bind(&InsNodeImpl::CommitIndexObserv, this));
+  log_writer_.AddTask(std::bind(&InsNodeImpl::LogWriterLoop, this));
   MutexLock lock(&mu_);
   CheckLeaderCrash();
   session_checker_.AddTask(
       std::bind(&InsNodeImpl::RemoveExpiredSessions, this));
+  session_checker_.AddTask(std::bind(&InsNodeImpl::SyncSessions, this));
   binlog_cleaner_.AddTask(std::bind(&InsNodeImpl::GarbageClean, this));
+  if (FLAGS_ins_binlog_sync_mode == "timed") {
+    binlog_syncer_.AddTask(std::bind(&InsNodeImpl::SyncBinlog, this));
+  }
 }
 
 void InsNodeImpl::Init() {
   srand(time(NULL));
   replication_cond_ = new CondVar(&mu_);
   commit_cond_ = new CondVar(&mu_);
+  write_cond_ = new CondVar(&write_mu_);
   server_start_timestamp_ = ins_common::timer::get_micros();
+  // 刚启动时不知道哪些session还活着，等到session都汇报过一轮
+  // 或者从leader收到全量的session
+  sessions_valid_timestamp_ =
+      server_start_timestamp_ + FLAGS_session_expire_timeout;
+  session_contact_timestamp_ = server_start_timestamp_;
 
   InitMembers();
   InitStorage();
@@ -116,10 +193,26 @@ void InsNodeImpl::InitStorage() {
   std::string sub_dir = self_id_;
   boost::replace_all(sub_dir, ":", "_");
   meta_ = new Meta(FLAGS_ins_data_dir + "/" + sub_dir);
+  BinLogBackend binlog_backend = kLevelDBBinLog;
+  if (FLAGS_ins_binlog_backend == "segment") {
+    binlog_backend = kSegmentBinLog;
+  } else if (FLAGS_ins_binlog_backend != "leveldb") {
+    LOG(FATAL) << "unknown binlog backend: " << FLAGS_ins_binlog_backend;
+  }
   binlogger_ = new BinLogger(FLAGS_ins_binlog_dir + "/" + sub_dir,
                              FLAGS_ins_binlog_compress,
                              FLAGS_ins_binlog_block_size * 1024,
-                             FLAGS_ins_binlog_write_buffer_size * 1024 * 1024);
+                             FLAGS_ins_binlog_write_buffer_size * 1024 * 1024,
+                             FLAGS_ins_binlog_cache_size * 1024LL * 1024,
+                             binlog_backend,
+                             FLAGS_ins_binlog_segment_size * 1024LL * 1024);
+  if (FLAGS_ins_binlog_sync_mode == "batch") {
+    binlogger_->SetSyncMode(kSyncBatch);
+  } else if (FLAGS_ins_binlog_sync_mode == "timed") {
+    binlogger_->SetSyncMode(kSyncTimed);
+  } else if (FLAGS_ins_binlog_sync_mode != "none") {
+    LOG(FATAL) << "unknown binlog sync mode: " << FLAGS_ins_binlog_sync_mode;
+  }
   current_term_ = meta_->ReadCurrentTerm();
   meta_->ReadVotedFor(voted_for_);
 
@@ -127,6 +220,7 @@ void InsNodeImpl::InitStorage() {
   data_store_ = new StorageManager(data_store_path);
   UserInfo root = meta_->ReadRootInfo();
   user_manager_ = new UserManager(data_store_path, root);
+  snapshot_dir_ = FLAGS_ins_data_dir + "/" + sub_dir + "/snapshot";
 
   std::string tag_value;
   Status status = data_store_->Get(StorageManager::anonymous_user,
@@ -143,6 +237,13 @@ InsNodeImpl::~InsNodeImpl() {
     commit_cond_->Signal();
     replication_cond_->Broadcast();
   }
+  {
+    MutexLock lock(&write_mu_);
+    writer_stop_ = true;
+    write_cond_->Signal();
+  }
+  log_writer_.Stop(true);
+  binlog_syncer_.Stop(true);
   replicatter_.Stop(true);
   committer_.Stop(true);
   leader_crash_checker_.Stop(true);
@@ -156,6 +257,7 @@ InsNodeImpl::~InsNodeImpl() {
     delete binlogger_;
     delete user_manager_;
     delete data_store_;
+    delete snapshot_store_;
   }
 }
 
@@ -195,6 +297,27 @@ void InsNodeImpl::ShowStatus(::google::protobuf::RpcController* controller,
     response->set_last_log_term(last_log_term);
     response->set_commit_index(commit_index_);
     response->set_last_applied(last_applied_index_);
+    if (status_ == kLeader) {
+      const int64_t now_timestamp = ins_common::timer::get_micros();
+      for (auto& server : others_) {
+        const ReplicationWindow& window = replication_window_[server];
+        int64_t stall_micros = window.stall_micros;
+        if (window.stall_timestamp > 0) {
+          stall_micros += now_timestamp - window.stall_timestamp;
+        }
+        galaxy::ins::FollowerStatus* follower = response->add_followers();
+        follower->set_server_id(server);
+        follower->set_next_index(next_index_[server]);
+        follower->set_match_index(match_index_[server]);
+        follower->set_inflight(window.inflight);
+        follower->set_credit(window.credit_limit < 0
+                                 ? -1
+                                 : std::max<int64_t>(
+                                       0, window.credit_limit -
+                                              next_index_[server]));
+        follower->set_stall_ms(stall_micros / 1000);
+      }
+    }
   }
   done->Run();
   LOG(INFO) << "ShowStatus done";
@@ -204,11 +327,25 @@ void InsNodeImpl::TransToFollower(const char* msg, int64_t new_term) {
   mu_.AssertHeld();
   LOG(INFO) << msg << ", my term is outdated(" << current_term_ << " < "
             << new_term << "), trans to follower";
-  status_ = kFollower;
+  StepDown();
   current_term_ = new_term;
+  verified_log_index_ = -1;
   meta_->WriteCurrentTerm(current_term_);
 }
 
+// 所有变回follower的路径都经过这里，清理leader/candidate的状态
+void InsNodeImpl::StepDown() {
+  mu_.AssertHeld();
+  if (status_ == kLeader) {  // 直到现在session都由自己维护
+    session_contact_timestamp_ = ins_common::timer::get_micros();
+  }
+  status_ = kFollower;
+  lease_expire_timestamp_ = 0;
+  replication_batches_.clear();
+  FailLockWaiters();
+  // 进行中的leader移交由CheckLeaderTransfer在知道新leader后结束
+}
+
 inline std::string InsNodeImpl::BindKeyAndUser(const std::string& user,
                                                const std::string& key) {
   return user + "::" + key;
@@ -230,13 +367,29 @@ void InsNodeImpl::CommitIndexObserv() {
     if (stop_) {
       return;
     }
+    // 和InstallSnapshot互斥，apply_mu_要在mu_之前获取
+    mu_.Unlock();
+    MutexLock apply_lock(&apply_mu_);
+    mu_.Lock();
+    if (stop_) {
+      return;
+    }
+    if (commit_index_ <= last_applied_index_) {
+      continue;
+    }
     int64_t from_idx = last_applied_index_;
-    int64_t to_idx = commit_index_;
-    bool nop_committed = false;
+    int64_t to_idx = std::min(commit_index_,
+                              from_idx + FLAGS_ins_apply_batch_size);
     mu_.Unlock();
 
     LOG(INFO) << "wait back, begin to process index from " << from_idx << " to "
               << to_idx;
+    // 一段已提交的日志合并成一个batch写入，每个用户数据库写一次
+    StorageManager::WriteBatch batch;
+    std::vector<std::function<void()> > triggers;
+    std::map<int64_t, std::pair<Status, std::string> > user_results;
+    std::vector<int64_t> nop_terms;
+    std::vector<std::pair<std::string, std::string> > released_locks;
     for (int64_t i = from_idx + 1; i <= to_idx; i++) {
       LogEntry log_entry;
       bool slot_ok = binlogger_->ReadSlot(i, &log_entry);
@@ -253,18 +406,12 @@ void InsNodeImpl::CommitIndexObserv() {
                     << ", user: " << log_entry.user;
           type_and_value.append(1, static_cast<char>(log_entry.op));
           type_and_value.append(log_entry.value);
-          s = data_store_->Put(log_entry.user, log_entry.key, type_and_value);
-          if (s == kUnknownUser) {
-            if (data_store_->OpenDatabase(log_entry.user)) {
-              s = data_store_->Put(log_entry.user, log_entry.key,
-                                   type_and_value);
-            }
-          }
+          batch.Put(log_entry.user, log_entry.key, type_and_value);
           if (log_entry.op == kLock) {
             TouchParentKey(log_entry.user, log_entry.key, log_entry.value,
-                           "lock");
+                           "lock", &batch);
           }
-          event_trigger_.AddTask(
+          triggers.push_back(
               std::bind(&InsNodeImpl::TriggerEventWithParent, this,
                         BindKeyAndUser(log_entry.user, log_entry.key),
                         log_entry.value, false));
@@ -272,32 +419,20 @@ void InsNodeImpl::CommitIndexObserv() {
             MutexLock lock_sk(&session_locks_mu_);
             session_locks_[log_entry.value].insert(log_entry.key);
           }
-          assert(s == kOk);
           break;
         case kDel:
           LOG(INFO) << "Delete from data_store_, key: " << log_entry.key;
-          s = data_store_->Delete(log_entry.user, log_entry.key);
-          if (s == kUnknownUser) {
-            if (data_store_->OpenDatabase(log_entry.user)) {
-              s = data_store_->Delete(log_entry.user, log_entry.key);
-            }
-          }
-          assert(s == kOk);
-          event_trigger_.AddTask(
+          batch.Delete(log_entry.user, log_entry.key);
+          released_locks.push_back(
+              std::make_pair(log_entry.user, log_entry.key));
+          triggers.push_back(
               std::bind(&InsNodeImpl::TriggerEventWithParent, this,
                         BindKeyAndUser(log_entry.user, log_entry.key),
                         log_entry.value, true));
           break;
         case kNop:
           LOG(INFO) << "kNop got, do nothing, key: " << log_entry.key;
-          {
-            MutexLock locker(&mu_);
-            if (log_entry.term == current_term_) {
-              nop_committed = true;
-            }
-            LOG(INFO) << "nop term: " << log_entry.term
-                      << ", cur term: " << current_term_;
-          }
+          nop_terms.push_back(log_entry.term);
           break;
         case kUnLock: {
           LOG(INFO) << "Unlock, user: " << log_entry.user
@@ -305,25 +440,20 @@ void InsNodeImpl::CommitIndexObserv() {
           const std::string& key = log_entry.key;
           const std::string& old_session = log_entry.value;
           std::string value;
-          s = data_store_->Get(log_entry.user, key, &value);
+          s = data_store_->Get(log_entry.user, key, &value, batch);
           if (s == kOk) {
             std::string cur_session;
             LogOperation op;
             ParseValue(value, op, cur_session);
             if (op == kLock && cur_session == old_session) {  // DeleteIf
-              s = data_store_->Delete(log_entry.user, key);
-              if (s == kUnknownUser) {
-                if (data_store_->OpenDatabase(log_entry.user)) {
-                  s = data_store_->Delete(log_entry.user, key);
-                }
-              }
-              assert(s == kOk);
+              batch.Delete(log_entry.user, key);
               LOG(INFO) << "unlock on " << key;
               TouchParentKey(log_entry.user, log_entry.key, cur_session,
-                             "unlock");
-              event_trigger_.AddTask(std::bind(
+                             "unlock", &batch);
+              triggers.push_back(std::bind(
                   &InsNodeImpl::TriggerEventWithParent, this,
                   BindKeyAndUser(log_entry.user, key), old_session, true));
+              released_locks.push_back(std::make_pair(log_entry.user, key));
             }
           }
         } break;
@@ -337,90 +467,112 @@ void InsNodeImpl::CommitIndexObserv() {
             new_uuid = log_entry.user;
             data_store_->OpenDatabase(log_entry.key);
           }
+          user_results[i] = std::make_pair(log_status, new_uuid);
           break;
         case kLogout:
           LOG(INFO) << "Logout, user: " << log_entry.user;
           log_status = user_manager_->Logout(log_entry.user);
+          user_results[i] = std::make_pair(log_status, new_uuid);
           break;
         case kRegister:
           LOG(INFO) << "Register, key: " << log_entry.key
                     << ", value: " << log_entry.value;
           log_status = user_manager_->Register(log_entry.key, log_entry.value);
+          user_results[i] = std::make_pair(log_status, new_uuid);
           break;
         default:
           LOG(WARNING) << "Unknown op: " << static_cast<int>(log_entry.op);
       }
-      mu_.Lock();
-      if (status_ == kLeader && nop_committed) {
+    }
+    // last applied index和匿名用户的数据在同一个leveldb batch里
+    batch.Put(StorageManager::anonymous_user, tag_last_applied_index,
+              BinLogger::IntToString(to_idx));
+    Status sw = data_store_->Write(&batch);
+    assert(sw == kOk);
+    for (auto& trigger : triggers) {
+      event_trigger_.AddTask(trigger);
+    }
+
+    mu_.Lock();
+    for (auto term : nop_terms) {
+      LOG(INFO) << "nop term: " << term << ", cur term: " << current_term_;
+      if (status_ == kLeader && term == current_term_ && in_safe_mode_) {
         in_safe_mode_ = false;
         LOG(INFO) << "Leave safe mode now";
       }
-      if (status_ == kLeader && client_ack_.find(i) != client_ack_.end()) {
-        ClientAck& ack = client_ack_[i];
-        if (ack.response) {
-          ack.response->set_success(true);
-          ack.response->set_leader_id("");
-          ack.done->Run();  // client put ok;
-        }
-        if (ack.del_response) {
-          ack.del_response->set_success(true);
-          ack.del_response->set_leader_id("");
-          ack.done->Run();  // client del ok;
-        }
-        if (ack.lock_response) {
-          ack.lock_response->set_success(true);
-          ack.lock_response->set_leader_id("");
-          ack.done->Run();  // client lock ok;
-        }
-        if (ack.unlock_response) {
-          ack.unlock_response->set_success(true);
-          ack.unlock_response->set_leader_id("");
-          ack.done->Run();  // client unlock ok;
-        }
-        if (ack.login_response) {
-          ack.login_response->set_status(log_status);
-          ack.login_response->set_uuid(new_uuid);
-          ack.login_response->set_leader_id("");
-          ack.done->Run();
-        }
-        if (ack.logout_response) {
-          ack.logout_response->set_status(log_status);
-          ack.logout_response->set_leader_id("");
-          ack.done->Run();
+    }
+    if (status_ == kLeader) {
+      for (int64_t i = from_idx + 1; i <= to_idx; i++) {
+        auto it = client_ack_.find(i);
+        if (it == client_ack_.end()) {
+          continue;
         }
-        if (ack.register_response) {
-          ack.register_response->set_status(log_status);
-          ack.register_response->set_leader_id("");
-          ack.done->Run();
+        auto rt = user_results.find(i);
+        if (rt == user_results.end()) {
+          ReplyClientAck(it->second, kOk, "");
+        } else {
+          ReplyClientAck(it->second, rt->second.first, rt->second.second);
         }
-        client_ack_.erase(i);
+        client_ack_.erase(it);
+      }
+      for (auto& released : released_locks) {
+        WakeLockWaiters(released.first, released.second);
       }
-      last_applied_index_ += 1;
-      Status sp = data_store_->Put(StorageManager::anonymous_user,
-                                   tag_last_applied_index,
-                                   BinLogger::IntToString(last_applied_index_));
-      assert(sp == kOk);
-      mu_.Unlock();
     }
+    last_applied_index_ = to_idx;
+    std::vector<std::shared_ptr<ClientReadAck> > ready_reads;
+    CollectAppliedReads(&ready_reads);
+    mu_.Unlock();
+    ReplyReads(ready_reads, true);
     mu_.Lock();
   }
 }
 
-void InsNodeImpl::ForwardKeepAliveCallback(
-    const ::galaxy::ins::KeepAliveRequest* request,
-    ::galaxy::ins::KeepAliveResponse* response, bool /*failed*/,
-    int /*error*/) {
-  LOG(INFO) << "recv ForwardKeepAliveCallback: [" << request->ShortDebugString()
-            << "] <=> [" << response->ShortDebugString() << "]";
-  std::unique_ptr<const galaxy::ins::KeepAliveRequest> request_ptr(request);
-  std::unique_ptr<galaxy::ins::KeepAliveResponse> response_ptr(response);
-  LOG(INFO) << "heartbeat from clients forwarded";
+void InsNodeImpl::ReplyClientAck(ClientAck& ack, Status log_status,
+                                 const std::string& new_uuid) {
+  mu_.AssertHeld();
+  if (ack.response) {
+    ack.response->set_success(true);
+    ack.response->set_leader_id("");
+    ack.done->Run();  // client put ok;
+  }
+  if (ack.del_response) {
+    ack.del_response->set_success(true);
+    ack.del_response->set_leader_id("");
+    ack.done->Run();  // client del ok;
+  }
+  if (ack.lock_response) {
+    ack.lock_response->set_success(true);
+    ack.lock_response->set_leader_id("");
+    ack.done->Run();  // client lock ok;
+  }
+  if (ack.unlock_response) {
+    ack.unlock_response->set_success(true);
+    ack.unlock_response->set_leader_id("");
+    ack.done->Run();  // client unlock ok;
+  }
+  if (ack.login_response) {
+    ack.login_response->set_status(log_status);
+    ack.login_response->set_uuid(new_uuid);
+    ack.login_response->set_leader_id("");
+    ack.done->Run();
+  }
+  if (ack.logout_response) {
+    ack.logout_response->set_status(log_status);
+    ack.logout_response->set_leader_id("");
+    ack.done->Run();
+  }
+  if (ack.register_response) {
+    ack.register_response->set_status(log_status);
+    ack.register_response->set_leader_id("");
+    ack.done->Run();
+  }
 }
 
 void InsNodeImpl::HeartbeatCallback(
     const ::galaxy::ins::AppendEntriesRequest* request,
-    ::galaxy::ins::AppendEntriesResponse* response, bool failed,
-    int /*error*/) {
+    ::galaxy::ins::AppendEntriesResponse* response, bool failed, int /*error*/,
+    std::string follower_id, int64_t send_timestamp) {
   // LOG(INFO) << "recv HeartbeatCallback: [" << request->ShortDebugString()
   //          << "] <=> [" << response->ShortDebugString() << "]";
   MutexLock lock(&mu_);
@@ -434,8 +586,16 @@ void InsNodeImpl::HeartbeatCallback(
     if (response_ptr->current_term() > current_term_) {
       TransToFollower("InsNodeImpl::HeartbeatCallback",
                       response_ptr->current_term());
-    } else {
+    } else if (request->term() == current_term_) {
       // LOG(INFO) << "I am the leader at term: " << current_term_;
+      ExtendLeaderLease(follower_id, send_timestamp);
+      UpdateFollowerProgress(follower_id, response);
+      // timed sync时follower落盘的进度通过heartbeat带回
+      if (response->success() && response->has_durable_index() &&
+          response->durable_index() > match_index_[follower_id]) {
+        match_index_[follower_id] = response->durable_index();
+        UpdateCommitIndex();
+      }
     }
   }
 }
@@ -443,83 +603,227 @@ void InsNodeImpl::HeartbeatCallback(
 void InsNodeImpl::HeartbeatForReadCallback(
     const ::galaxy::ins::AppendEntriesRequest* request,
     ::galaxy::ins::AppendEntriesResponse* response, bool failed, int /*error*/,
-    std::shared_ptr<ClientReadAck> context) {
+    std::shared_ptr<ReadIndexBatch> batch) {
   LOG(INFO) << "recv HeartbeatForReadCallback: [" << request->ShortDebugString()
             << "] <=> [" << response->ShortDebugString() << "]";
-  MutexLock lock(&mu_);
   std::unique_ptr<const galaxy::ins::AppendEntriesRequest> request_ptr(request);
   std::unique_ptr<galaxy::ins::AppendEntriesResponse> response_ptr(response);
-  if (context->triggered) {
-    return;
+  std::vector<std::shared_ptr<ClientReadAck> > ready_reads;
+  {
+    MutexLock lock(&mu_);
+    if (batch->triggered) {
+      return;
+    }
+    if (status_ != kLeader) {
+      LOG(INFO) << "outdated HearBeatCallbackForRead, I am no longer leader now";
+      FinishReadIndexRound(batch, false, &ready_reads);
+      return;
+    }
+    if (!failed) {
+      if (response_ptr->current_term() > current_term_) {
+        TransToFollower("InsNodeImpl::HeartbeatCallbackForRead",
+                        response_ptr->current_term());
+        FinishReadIndexRound(batch, false, &ready_reads);
+        return;
+      } else {
+        batch->succ_count += 1;
+      }
+    } else {
+      batch->err_count += 1;
+    }
+    if (batch->succ_count > members_.size() / 2) {
+      heartbeat_read_timestamp_ = ins_common::timer::get_micros();
+      FinishReadIndexRound(batch, true, &ready_reads);
+    } else if (batch->err_count > members_.size() - members_.size() / 2 - 1) {
+      // 剩下的节点全部成功也凑不够多数派了
+      FinishReadIndexRound(batch, false, &ready_reads);
+    }
   }
+  ReplyReads(ready_reads, true);
+}
+
+void InsNodeImpl::StartReadIndexRound() {
+  mu_.AssertHeld();
+  auto batch = std::make_shared<ReadIndexBatch>();
+  batch->read_index = commit_index_;
+  batch->succ_count = 1;  // self Get success;
+  batch->reads.swap(pending_reads_);
+  read_batch_inflight_ = batch;
   if (status_ != kLeader) {
-    LOG(INFO) << "outdated HearBeatCallbackForRead, I am no longer leader now";
-    context->response->set_success(false);
-    context->response->set_hit(false);
-    context->response->set_leader_id("");
-    context->done->Run();
-    context->triggered = true;
+    // follower: 向leader要read index，本地apply到该位置后再读
+    LOG(INFO) << "ask " << current_leader_
+              << " for read index, batch size: " << batch->reads.size();
+    std::unique_ptr<galaxy::ins::InsNode_Stub> stub(GetStub(current_leader_));
+    auto request = new ::galaxy::ins::ReadIndexRequest();
+    auto response = new ::galaxy::ins::ReadIndexResponse();
+    request->set_follower_id(self_id_);
+    boost::function<void(const ::galaxy::ins::ReadIndexRequest*,
+                         ::galaxy::ins::ReadIndexResponse*, bool, int)>
+        callback = boost::bind(&InsNodeImpl::ReadIndexCallback, this, _1, _2,
+                               _3, _4, batch);
+    rpc_client_.AsyncRequest(stub.get(), &InsNode_Stub::ReadIndex, request,
+                             response, callback);
     return;
   }
-  if (!failed) {
-    if (response_ptr->current_term() > current_term_) {
-      TransToFollower("InsNodeImpl::HeartbeatCallbackForRead",
-                      response_ptr->current_term());
-      context->response->set_success(false);
-      context->response->set_hit(false);
-      context->response->set_leader_id("");
-      context->done->Run();
-      context->triggered = true;
+  LOG(INFO) << "broadcast for read, read_index: " << batch->read_index
+            << ", batch size: " << batch->reads.size();
+  boost::function<void(const ::galaxy::ins::AppendEntriesRequest*,
+                       ::galaxy::ins::AppendEntriesResponse*, bool, int)>
+      callback;
+  for (auto& server : others_) {
+    std::unique_ptr<galaxy::ins::InsNode_Stub> stub(GetStub(server));
+    auto request = new ::galaxy::ins::AppendEntriesRequest();
+    auto response = new ::galaxy::ins::AppendEntriesResponse();
+    request->set_term(current_term_);
+    request->set_leader_id(self_id_);
+    request->set_leader_commit_index(commit_index_);
+    LOG(INFO) << "Send AppendEntriesRequest to " << server
+              << ", current_term: " << current_term_ << ", self: " << self_id_
+              << ", commit_index: " << commit_index_;
+    callback = boost::bind(&InsNodeImpl::HeartbeatForReadCallback, this, _1,
+                           _2, _3, _4, batch);
+    rpc_client_.AsyncRequest(stub.get(), &InsNode_Stub::AppendEntries, request,
+                             response, callback);
+  }
+}
+
+void InsNodeImpl::FinishReadIndexRound(
+    std::shared_ptr<ReadIndexBatch> batch, bool confirmed,
+    std::vector<std::shared_ptr<ClientReadAck> >* ready) {
+  mu_.AssertHeld();
+  batch->triggered = true;
+  if (confirmed) {
+    // leader身份已确认，等状态机apply到read_index之后再读
+    for (auto& read : batch->reads) {
+      if (read->index_response) {  // follower只需要read index
+        read->index_response->set_success(true);
+        read->index_response->set_read_index(batch->read_index);
+        read->index_response->set_leader_id("");
+        read->done->Run();
+      } else if (last_applied_index_ >= batch->read_index) {
+        ready->push_back(read);
+      } else {
+        read_waiters_.insert(std::make_pair(batch->read_index, read));
+      }
+    }
+  } else {
+    ReplyReads(batch->reads, false);
+  }
+  if (read_batch_inflight_ == batch) {
+    read_batch_inflight_.reset();
+  }
+  if (!pending_reads_.empty() && !read_batch_inflight_) {
+    if (status_ == kLeader || CanServeFollowerRead()) {
+      StartReadIndexRound();
+    } else {
+      ReplyReads(pending_reads_, false);
+      pending_reads_.clear();
+    }
+  }
+}
+
+void InsNodeImpl::ReadIndexCallback(
+    const ::galaxy::ins::ReadIndexRequest* request,
+    ::galaxy::ins::ReadIndexResponse* response, bool failed, int /*error*/,
+    std::shared_ptr<ReadIndexBatch> batch) {
+  std::unique_ptr<const galaxy::ins::ReadIndexRequest> request_ptr(request);
+  std::unique_ptr<galaxy::ins::ReadIndexResponse> response_ptr(response);
+  std::vector<std::shared_ptr<ClientReadAck> > ready_reads;
+  {
+    MutexLock lock(&mu_);
+    if (batch->triggered) {
       return;
+    }
+    if (failed || !response->success()) {
+      LOG(WARNING) << "failed to get read index from leader: "
+                   << response->ShortDebugString();
+      FinishReadIndexRound(batch, false, &ready_reads);
     } else {
-      context->succ_count += 1;
+      LOG(INFO) << "got read index: " << response->read_index()
+                << ", last_applied_index: " << last_applied_index_;
+      batch->read_index = response->read_index();
+      FinishReadIndexRound(batch, true, &ready_reads);
     }
-  } else {
-    context->err_count += 1;
   }
-  if (context->succ_count > members_.size() / 2) {
-    const std::string& key = context->request->key();
-    const std::string& uuid = context->request->uuid();
-    LOG(INFO) << "client get key: " << key;
-    Status s;
-    std::string value;
-    s = data_store_->Get(user_manager_->GetUsernameFromUuid(uuid), key, &value);
-    std::string real_value;
-    LogOperation op;
-    ParseValue(value, op, real_value);
-    if (s == kOk) {
-      if (op == kLock) {
-        if (IsExpiredSession(real_value)) {
-          context->response->set_hit(false);
-          context->response->set_success(true);
-          context->response->set_leader_id("");
-        } else {
-          context->response->set_hit(true);
-          context->response->set_success(true);
-          context->response->set_value(real_value);
-          context->response->set_leader_id("");
-        }
+  ReplyReads(ready_reads, true);
+}
+
+bool InsNodeImpl::CanServeFollowerRead() {
+  mu_.AssertHeld();
+  return FLAGS_ins_follower_read && status_ == kFollower &&
+         !current_leader_.empty();
+}
+
+void InsNodeImpl::CollectAppliedReads(
+    std::vector<std::shared_ptr<ClientReadAck> >* reads) {
+  mu_.AssertHeld();
+  auto end = read_waiters_.upper_bound(last_applied_index_);
+  for (auto it = read_waiters_.begin(); it != end; ++it) {
+    reads->push_back(it->second);
+  }
+  read_waiters_.erase(read_waiters_.begin(), end);
+}
+
+void InsNodeImpl::ReplyReads(
+    const std::vector<std::shared_ptr<ClientReadAck> >& reads, bool success) {
+  for (auto& read : reads) {
+    if (read->index_response) {
+      read->index_response->set_success(success);
+      read->index_response->set_leader_id("");
+    } else if (read->scan_response) {
+      if (success) {
+        ScanFromStore(read->scan_request, read->scan_response);
       } else {
-        context->response->set_hit(true);
-        context->response->set_success(true);
-        context->response->set_value(real_value);
-        context->response->set_leader_id("");
+        read->scan_response->set_success(false);
       }
+      read->scan_response->set_leader_id(read->leader_id);
     } else {
-      context->response->set_hit(false);
-      context->response->set_success(true);
-      context->response->set_leader_id("");
+      if (success) {
+        ReadFromStore(read->request, read->response);
+      } else {
+        read->response->set_success(false);
+        read->response->set_hit(false);
+      }
+      read->response->set_leader_id(read->leader_id);
     }
-    context->done->Run();
-    context->triggered = true;
-    heartbeat_read_timestamp_ = ins_common::timer::get_micros();
+    read->done->Run();
   }
-  if (context->err_count > members_.size() / 2) {
-    context->response->set_success(false);
-    context->response->set_hit(false);
-    context->response->set_leader_id("");
-    context->done->Run();
-    context->triggered = true;
+}
+
+void InsNodeImpl::ReadFromStore(const ::galaxy::ins::GetRequest* request,
+                                ::galaxy::ins::GetResponse* response) {
+  const std::string& key = request->key();
+  const std::string& uuid = request->uuid();
+  LOG(INFO) << "client get key: " << key;
+  Status s;
+  std::string value;
+  s = data_store_->Get(user_manager_->GetUsernameFromUuid(uuid), key, &value);
+  std::string real_value;
+  LogOperation op;
+  ParseValue(value, op, real_value);
+  if (s == kOk) {
+    if (op == kLock) {
+      if (IsExpiredSession(real_value)) {
+        response->set_hit(false);
+        response->set_success(true);
+        response->set_leader_id("");
+      } else {
+        response->set_hit(true);
+        response->set_success(true);
+        response->set_value(real_value);
+        response->set_leader_id("");
+      }
+    } else {
+      response->set_hit(true);
+      response->set_success(true);
+      response->set_value(real_value);
+      // LOG(INFO) << "get value: " << real_value;
+      response->set_leader_id("");
+    }
+  } else {
+    response->set_hit(false);
+    response->set_success(true);
+    response->set_leader_id("");
   }
 }
 
@@ -535,25 +839,115 @@ void InsNodeImpl::BroadCastHeartbeat() {
   boost::function<void(const ::galaxy::ins::AppendEntriesRequest*,
                        ::galaxy::ins::AppendEntriesResponse*, bool, int)>
       callback;
+  const int64_t now_timestamp = ins_common::timer::get_micros();
   for (auto& server : others_) {
+    // 一个心跳周期内发过AppendEntries且commit index没有变化时，
+    // 复制请求已经起到了heartbeat的作用
+    ReplicationWindow& window = replication_window_[server];
+    if (now_timestamp - window.send_timestamp <
+            FLAGS_ins_heartbeat_interval * 1000L &&
+        window.sent_commit_index == commit_index_) {
+      continue;
+    }
+    window.send_timestamp = now_timestamp;
+    window.sent_commit_index = commit_index_;
     std::unique_ptr<galaxy::ins::InsNode_Stub> stub(GetStub(server));
     auto request = new ::galaxy::ins::AppendEntriesRequest();
     auto response = new ::galaxy::ins::AppendEntriesResponse();
     request->set_term(current_term_);
     request->set_leader_id(self_id_);
     request->set_leader_commit_index(commit_index_);
+    // 带上prev log，follower据此确认日志前缀一致后才能推进commit index
+    const int64_t prev_index = next_index_[server] - 1;
+    LogEntry prev_log_entry;
+    if (prev_index < 0 || binlogger_->ReadSlot(prev_index, &prev_log_entry)) {
+      request->set_prev_log_index(prev_index);
+      request->set_prev_log_term(prev_index < 0 ? -1 : prev_log_entry.term);
+    }
     // LOG(INFO) << "Send Heartbeat to " << server
     //          << ", current_term: " << current_term_ << ", self: " << self_id_
     //          << ", commit_index: " << commit_index_;
-    callback =
-        boost::bind(&InsNodeImpl::HeartbeatCallback, this, _1, _2, _3, _4);
+    callback = boost::bind(&InsNodeImpl::HeartbeatCallback, this, _1, _2, _3,
+                           _4, server, now_timestamp);
     rpc_client_.AsyncRequest(stub.get(), &InsNode_Stub::AppendEntries, request,
                              response, callback);
   }
-  heart_beat_pool_.DelayTask(50,
+  heart_beat_pool_.DelayTask(FLAGS_ins_heartbeat_interval,
                              std::bind(&InsNodeImpl::BroadCastHeartbeat, this));
 }
 
+void InsNodeImpl::SetFollowerProgress(
+    ::galaxy::ins::AppendEntriesResponse* response) {
+  mu_.AssertHeld();
+  const int64_t length = binlogger_->GetLength();
+  // 已经追加但还没有apply的日志都会变成apply的积压
+  int64_t pending = length - 1 - last_applied_index_;
+  response->set_log_length(length);
+  response->set_credit(
+      std::max<int64_t>(0, FLAGS_max_commit_pending - pending));
+  response->set_accept_compressed(FLAGS_log_rep_compress);
+  response->set_accept_raw(true);
+  response->set_sessions_valid(SessionsValid());
+}
+
+void InsNodeImpl::UpdateFollowerProgress(
+    const std::string& follower_id,
+    const ::galaxy::ins::AppendEntriesResponse* response) {
+  mu_.AssertHeld();
+  ReplicationWindow& window = replication_window_[follower_id];
+  window.accept_compressed = response->accept_compressed();
+  window.accept_raw = response->accept_raw();
+  if (response->has_sessions_valid() && !response->sessions_valid() &&
+      !window.session_dumping && SessionsValid()) {
+    window.session_dumping = true;
+    session_checker_.AddTask(std::bind(&InsNodeImpl::SendSessionDump, this,
+                                       follower_id, current_term_));
+  }
+  if (!response->has_credit() || !response->has_log_length()) {
+    return;
+  }
+  const int64_t credit_limit = response->log_length() + response->credit();
+  if (credit_limit != window.credit_limit) {
+    window.credit_limit = credit_limit;
+    replication_cond_->Broadcast();
+  }
+}
+
+void InsNodeImpl::ExtendLeaderLease(const std::string& follower_id,
+                                    int64_t send_timestamp) {
+  mu_.AssertHeld();
+  if (send_timestamp < lease_resume_timestamp_) {
+    return;
+  }
+  int64_t& ack_timestamp = heartbeat_ack_timestamp_[follower_id];
+  ack_timestamp = std::max(ack_timestamp, send_timestamp);
+  // 多数派(含自己)在send_timestamp之后都认可了我的leader身份，
+  // 它们在elect_timeout_min内不会投票给别人，所以lease从该时刻开始计算
+  std::vector<int64_t> acks;
+  for (auto& server : others_) {
+    auto it = heartbeat_ack_timestamp_.find(server);
+    if (it != heartbeat_ack_timestamp_.end()) {
+      acks.push_back(it->second);
+    }
+  }
+  const size_t quorum = members_.size() / 2;
+  if (quorum == 0 || acks.size() < quorum) {
+    return;
+  }
+  std::sort(acks.begin(), acks.end(), std::greater<int64_t>());
+  const int64_t lease_timeout =
+      std::min(FLAGS_leader_lease_timeout, FLAGS_elect_timeout_min);
+  lease_expire_timestamp_ = std::max(lease_expire_timestamp_,
+                                     acks[quorum - 1] + lease_timeout * 1000);
+}
+
+bool InsNodeImpl::InLeaderLease() {
+  mu_.AssertHeld();
+  return FLAGS_ins_leader_lease && status_ == kLeader &&
+         transfer_target_.empty() &&
+         ins_common::timer::get_micros() < lease_expire_timestamp_;
+}
+
 void InsNodeImpl::StartReplicateLog() {
   mu_.AssertHeld();
   LOG(INFO) << "Start replicate log to followers";
@@ -567,6 +961,14 @@ void InsNodeImpl::StartReplicateLog() {
     LOG(INFO) << "Start replicate log to follower: " << uuid;
     next_index_[uuid] = binlogger_->GetLength();
     match_index_[uuid] = -1;
+    ReplicationWindow& window = replication_window_[uuid];
+    window.seq++;
+    window.inflight = 0;
+    window.retry_timestamp = 0;
+    window.batch_limit = FLAGS_log_rep_batch_max;
+    window.rtt_micros = 0;
+    window.credit_limit = -1;
+    window.stall_timestamp = 0;
     replicatter_.AddTask(std::bind(&InsNodeImpl::ReplicateLog, this, uuid));
   }
   LogEntry log_entry;
@@ -574,7 +976,7 @@ void InsNodeImpl::StartReplicateLog() {
   log_entry.value = "";
   log_entry.term = current_term_;
   log_entry.op = kNop;
-  binlogger_->AppendEntry(log_entry);
+  SubmitClientWrite(log_entry, ClientAck());
 }
 
 void InsNodeImpl::TransToLeader() {
@@ -582,6 +984,22 @@ void InsNodeImpl::TransToLeader() {
   in_safe_mode_ = true;
   status_ = kLeader;
   current_leader_ = self_id_;
+  if (!transfer_target_.empty()) {  // 卸任前发起的移交没有成功
+    FinishLeaderTransfer(false);
+  }
+  heartbeat_ack_timestamp_.clear();
+  lease_expire_timestamp_ = 0;
+  lease_resume_timestamp_ = 0;  // 之前term的移交选举已经结束
+  // 之前任期缓存的日志可能已经被截断
+  replication_batches_.clear();
+  // 被隔离太久时本地可能已经删除了仍然存活的session，不能直接
+  // 用来判断lock的持有者，等待session重新汇报
+  const int64_t now_timestamp = ins_common::timer::get_micros();
+  if (now_timestamp - session_contact_timestamp_ >
+      FLAGS_session_expire_timeout / 2) {
+    InvalidateSessions();
+  }
+  session_contact_timestamp_ = now_timestamp;
   LOG(INFO) << "I win the election, term: " << current_term_;
   heart_beat_pool_.AddTask(std::bind(&InsNodeImpl::BroadCastHeartbeat, this));
   // 开始复制binlog
@@ -653,6 +1071,19 @@ void InsNodeImpl::TryToBeLeader() {
     return;
   }
 
+  if (FLAGS_ins_pre_vote) {
+    StartPreVote();
+  } else {
+    StartElection(false);
+  }
+
+  // 是否可能下一次检查时vote还未结束？
+  // 非常可能，此时要加大间隔，不能一直这么频繁的发Vote Request
+  CheckLeaderCrash();
+}
+
+void InsNodeImpl::StartElection(bool leader_transfer) {
+  mu_.AssertHeld();
   LOG(INFO) << "Try to be leader, status_ " << NodeStatus_Name(status_)
             << ", broadcast vote";
   ++current_term_;
@@ -682,6 +1113,7 @@ void InsNodeImpl::TryToBeLeader() {
     request->set_term(current_term_);
     request->set_last_log_index(last_log_index);
     request->set_last_log_term(last_log_term);
+    request->set_leader_transfer(leader_transfer);
     LOG(INFO) << "Send VoteRequest to " << server
               << ", candidate_id: " << self_id_
               << ", current_term: " << current_term_
@@ -691,10 +1123,61 @@ void InsNodeImpl::TryToBeLeader() {
     rpc_client_.AsyncRequest(stub.get(), &InsNode_Stub::Vote, request, response,
                              callback);
   }
+}
 
-  // 是否可能下一次检查时vote还未结束？
-  // 非常可能，此时要加大间隔，不能一直这么频繁的发Vote Request
-  CheckLeaderCrash();
+// PreVote不改变term，只有多数派都会投票给自己时才发起真正的选举，
+// 避免被隔离后重新加入的节点用更大的term打断正常的leader
+void InsNodeImpl::StartPreVote() {
+  mu_.AssertHeld();
+  int64_t last_log_index;
+  int64_t last_log_term;
+  GetLastLogIndexAndTerm(&last_log_index, &last_log_term);
+  pre_vote_term_ = current_term_ + 1;
+  pre_vote_grant_ = 1;
+  LOG(INFO) << "Broadcast pre-vote request with term: " << pre_vote_term_
+            << ", status_ " << NodeStatus_Name(status_);
+  boost::function<void(const ::galaxy::ins::VoteRequest*,
+                       ::galaxy::ins::VoteResponse*, bool, int)> callback;
+  for (auto& server : others_) {
+    std::unique_ptr<galaxy::ins::InsNode_Stub> stub(GetStub(server));
+    auto request = new ::galaxy::ins::VoteRequest();
+    auto response = new ::galaxy::ins::VoteResponse();
+    request->set_candidate_id(self_id_);
+    request->set_term(pre_vote_term_);
+    request->set_last_log_index(last_log_index);
+    request->set_last_log_term(last_log_term);
+    request->set_pre_vote(true);
+    callback =
+        boost::bind(&InsNodeImpl::PreVoteCallback, this, _1, _2, _3, _4);
+    rpc_client_.AsyncRequest(stub.get(), &InsNode_Stub::Vote, request, response,
+                             callback);
+  }
+}
+
+void InsNodeImpl::PreVoteCallback(const ::galaxy::ins::VoteRequest* request,
+                                  ::galaxy::ins::VoteResponse* response,
+                                  bool failed, int /*error*/) {
+  LOG(INFO) << "recv PreVoteCallback: [" << request->ShortDebugString()
+            << "] <=> [" << response->ShortDebugString() << "]";
+  MutexLock lock(&mu_);
+  std::unique_ptr<const galaxy::ins::VoteRequest> request_ptr(request);
+  std::unique_ptr<galaxy::ins::VoteResponse> response_ptr(response);
+  if (failed) {
+    return;
+  }
+  if (response->term() > current_term_) {
+    TransToFollower("InsNodeImpl::PreVoteCallback", response->term());
+    return;
+  }
+  // 这一轮PreVote已经过期，或者期间又收到了leader的消息
+  if (status_ == kLeader || request->term() != pre_vote_term_ ||
+      current_term_ + 1 != pre_vote_term_ || heartbeat_count_ > 0) {
+    return;
+  }
+  if (response->vote_granted() && 2 * (++pre_vote_grant_) > members_.size()) {
+    pre_vote_term_ = -1;
+    StartElection(false);
+  }
 }
 
 void InsNodeImpl::DoAppendEntries(
@@ -702,12 +1185,42 @@ void InsNodeImpl::DoAppendEntries(
     ::galaxy::ins::AppendEntriesResponse* response,
     ::google::protobuf::Closure* done) {
   LOG(INFO) << "recv AppendEntries: [" << request->ShortDebugString() << "]";
+  // 压缩的batch先解压成raw_entries，之后和未压缩的请求一样处理
+  ::galaxy::ins::AppendEntriesRequest uncompressed;
+  if (request->has_compressed_entries()) {
+    uncompressed.CopyFrom(*request);
+    uncompressed.clear_compressed_entries();
+    uncompressed.clear_compressed_count();
+    if (!BinLogger::UncompressRawEntries(request->compressed_entries(),
+                                         uncompressed.mutable_raw_entries()) ||
+        uncompressed.raw_entries_size() != request->compressed_count()) {
+      LOG(WARNING) << "[AppendEntries] bad compressed entries from "
+                   << request->leader_id();
+      MutexLock lock(&mu_);
+      // 按busy回复，leader从同一个位置改用不压缩的batch重发，
+      // 而不是当成日志不匹配回退next_index
+      response->set_current_term(current_term_);
+      response->set_success(false);
+      SetFollowerProgress(response);
+      response->set_is_busy(true);
+      response->set_accept_compressed(false);
+      done->Run();
+      return;
+    }
+    request = &uncompressed;
+  }
+  // 带entries的请求会改写binlog，和leader的log writer互斥
+  const int entries_size = EntriesSize(request);
+  std::unique_ptr<MutexLock> io_lock;
+  if (entries_size > 0) {
+    io_lock.reset(new MutexLock(&log_io_mu_));
+  }
   MutexLock lock(&mu_);
   if (request->term() < current_term_) {
     LOG(INFO) << "[AppendEntries] term is outdated";
     response->set_current_term(current_term_);
     response->set_success(false);
-    response->set_log_length(binlogger_->GetLength());
+    SetFollowerProgress(response);
     done->Run();
     return;
   }
@@ -715,78 +1228,141 @@ void InsNodeImpl::DoAppendEntries(
   if (status_ != kFollower) {
     LOG(INFO) << "Update current status from " << NodeStatus_Name(status_)
               << " to " << NodeStatus_Name(kFollower);
-    status_ = kFollower;
+    StepDown();
   }
   if (request->term() > current_term_) {
     LOG(INFO) << "Update current term from " << current_term_ << " to "
               << request->term();
     current_term_ = request->term();
+    verified_log_index_ = -1;
     meta_->WriteCurrentTerm(request->term());
   }
 
   current_leader_ = request->leader_id();
+  leader_contact_timestamp_ = ins_common::timer::get_micros();
   ++heartbeat_count_;
-  if (request->entries_size() > 0) {
+  if (entries_size > 0) {
     if (request->prev_log_index() >= binlogger_->GetLength()) {
       response->set_current_term(current_term_);
       response->set_success(false);
-      response->set_log_length(binlogger_->GetLength());
+      SetFollowerProgress(response);
+      response->set_conflict_term(-1);
+      response->set_conflict_index(binlogger_->GetLength());
       LOG(INFO) << "[AppendEntries] prev log is beyond";
       done->Run();
       return;
     }
 
-    // 要求对应index位置的term相等
+    // 要求对应index位置的term相等，已经被gc的日志都已经apply，一定一致
+    const int64_t first_index = binlogger_->GetFirstIndex();
     int64_t prev_log_term = -1;
     if (request->prev_log_index() >= 0) {
       LogEntry prev_log_entry;
-      bool slot_ok =
-          binlogger_->ReadSlot(request->prev_log_index(), &prev_log_entry);
-      assert(slot_ok);
-      prev_log_term = prev_log_entry.term;
+      if (request->prev_log_index() < first_index) {
+        prev_log_term = request->prev_log_term();
+      } else {
+        bool slot_ok =
+            binlogger_->ReadSlot(request->prev_log_index(), &prev_log_entry);
+        assert(slot_ok);
+        prev_log_term = prev_log_entry.term;
+      }
     }
     if (prev_log_term != request->prev_log_term()) {
+      // 不在这里截断，冲突的日志在追加时才被覆盖；告诉leader冲突term的
+      // 起始位置，leader一次回退一整个term
+      int64_t conflict_index = binlogger_->FindFirstIndexOfTerm(
+          prev_log_term, request->prev_log_index());
       LOG(INFO) << "[AppendEntries] term not match, index: "
                 << request->prev_log_index() << ", term: " << prev_log_term
-                << ", " << request->prev_log_term();
-      // 数据不一致，需要退一步
-      binlogger_->Truncate(request->prev_log_index() - 1);
+                << ", " << request->prev_log_term()
+                << ", conflict index: " << conflict_index;
       response->set_current_term(current_term_);
       response->set_success(false);
-      response->set_log_length(binlogger_->GetLength());
+      SetFollowerProgress(response);
+      response->set_conflict_term(prev_log_term);
+      response->set_conflict_index(conflict_index);
       done->Run();
       return;
     }
     if (commit_index_ - last_applied_index_ > FLAGS_max_commit_pending) {
       response->set_current_term(current_term_);
       response->set_success(false);
-      response->set_log_length(binlogger_->GetLength());
+      SetFollowerProgress(response);
       response->set_is_busy(true);
       LOG(INFO) << "[AppendEntries] speed too fast, "
                 << request->prev_log_index() << " > " << last_applied_index_;
       done->Run();
       return;
     }
-    if (binlogger_->GetLength() > request->prev_log_index() + 1) {
-      const int64_t old_length = binlogger_->GetLength();
-      binlogger_->Truncate(request->prev_log_index());
-      LOG(INFO) << "[AppendEntries] log length alignment, truncate from: "
-                << old_length << " to " << request->prev_log_index();
+    // leader会流水线式地发送多个batch，重复或乱序到达的entry不能截断
+    // 已经匹配的日志，只在出现term冲突的位置截断
+    int append_from = 0;
+    const int64_t old_length = binlogger_->GetLength();
+    for (; append_from < entries_size; append_from++) {
+      const int64_t idx = request->prev_log_index() + 1 + append_from;
+      if (idx >= old_length) {
+        break;
+      }
+      if (idx < first_index) {
+        continue;
+      }
+      LogEntry log_entry;
+      bool slot_ok = binlogger_->ReadSlot(idx, &log_entry);
+      assert(slot_ok);
+      if (log_entry.term != EntryTerm(request, append_from)) {
+        binlogger_->Truncate(idx - 1);
+        LOG(INFO) << "[AppendEntries] conflict at " << idx
+                  << ", truncate from: " << old_length << " to " << idx;
+        break;
+      }
+    }
+    if (append_from < entries_size) {
+      mu_.Unlock();
+      if (request->raw_entries_size() > 0) {
+        binlogger_->AppendRawEntryList(request->raw_entries(), append_from);
+      } else if (append_from == 0) {
+        binlogger_->AppendEntryList(request->entries());
+      } else {
+        ::google::protobuf::RepeatedPtrField< ::galaxy::ins::Entry> rest(
+            request->entries().begin() + append_from,
+            request->entries().end());
+        binlogger_->AppendEntryList(rest);
+      }
+      mu_.Lock();
+    }
+    if (request->term() == current_term_) {
+      verified_log_index_ =
+          std::max(verified_log_index_,
+                   request->prev_log_index() + entries_size);
+    }
+  } else if (request->has_prev_log_index() &&
+             request->prev_log_index() < binlogger_->GetLength()) {
+    // heartbeat: prev log一致则说明此前的日志都和leader相同
+    int64_t prev_log_term = -1;
+    LogEntry prev_log_entry;
+    if (request->prev_log_index() < 0 ||
+        binlogger_->ReadSlot(request->prev_log_index(), &prev_log_entry)) {
+      prev_log_term = request->prev_log_index() < 0 ? -1 : prev_log_entry.term;
+      if (prev_log_term == request->prev_log_term()) {
+        verified_log_index_ =
+            std::max(verified_log_index_, request->prev_log_index());
+      }
     }
-    mu_.Unlock();
-    binlogger_->AppendEntryList(request->entries());
-    mu_.Lock();
   }
+  // 只提交和当前leader确认过一致的日志
   int64_t old_commit_index = commit_index_;
-  commit_index_ =
-      std::min(binlogger_->GetLastLogIndex(), request->leader_commit_index());
+  commit_index_ = std::max(
+      old_commit_index,
+      std::min(verified_log_index_, request->leader_commit_index()));
   if (commit_index_ > old_commit_index) {
     commit_cond_->Signal();
     LOG(INFO) << "follower: update my commit index to: " << commit_index_;
   }
   response->set_current_term(current_term_);
   response->set_success(true);
-  response->set_log_length(binlogger_->GetLength());
+  SetFollowerProgress(response);
+  response->set_durable_index(
+      std::min(binlogger_->GetDurableLength() - 1, verified_log_index_));
   done->Run();
 
   return;
@@ -799,11 +1375,33 @@ void InsNodeImpl::AppendEntries(
     ::galaxy::ins::AppendEntriesResponse* response,
     ::google::protobuf::Closure* done) {
   SampleAccessLog(controller, "AppendEntries");
-  // 交给thread pool处理
-  follower_worker_.AddTask(
-      std::bind(&InsNodeImpl::DoAppendEntries, this, request, response, done));
-  return;
-}
+  {
+    // 收到即重置选举计时，带entries的请求可能在磁盘写后面排队较久，
+    // leader不会再为这段时间单独发heartbeat
+    MutexLock lock(&mu_);
+    if (request->term() >= current_term_) {
+      const int64_t now_timestamp = ins_common::timer::get_micros();
+      // 和leader失联太久，期间转发的KeepAlive丢失，session表不再可信
+      if (now_timestamp - session_contact_timestamp_ >
+          FLAGS_session_expire_timeout / 2) {
+        InvalidateSessions();
+      }
+      leader_contact_timestamp_ = now_timestamp;
+      session_contact_timestamp_ = now_timestamp;
+      ++heartbeat_count_;
+    }
+  }
+  // 交给thread pool处理，带entries的请求由单线程按到达顺序处理，
+  // 避免流水线发送的batch乱序；heartbeat不必排在磁盘写之后
+  if (EntriesSize(request) > 0) {
+    follower_appender_.AddTask(std::bind(&InsNodeImpl::DoAppendEntries, this,
+                                         request, response, done));
+  } else {
+    follower_worker_.AddTask(std::bind(&InsNodeImpl::DoAppendEntries, this,
+                                       request, response, done));
+  }
+  return;
+}
 
 void InsNodeImpl::Vote(::google::protobuf::RpcController* controller,
                        const ::galaxy::ins::VoteRequest* request,
@@ -820,6 +1418,28 @@ void InsNodeImpl::Vote(::google::protobuf::RpcController* controller,
     done->Run();
     return;
   }
+  if (request->pre_vote()) {
+    PreVote(request, response);
+    done->Run();
+    return;
+  }
+  // lease模式下，最近还能联系上leader时不投票，保证leader lease期间
+  // 不会有新的leader产生
+  if (FLAGS_ins_leader_lease && request->term() > current_term_ &&
+      !request->leader_transfer()) {
+    const int64_t now_timestamp = ins_common::timer::get_micros();
+    if (InLeaderLease() ||
+        (status_ == kFollower && !current_leader_.empty() &&
+         now_timestamp - leader_contact_timestamp_ <
+             FLAGS_elect_timeout_min * 1000)) {
+      LOG(INFO) << "reject vote from " << request->candidate_id()
+                << ", leader " << current_leader_ << " is still alive";
+      response->set_vote_granted(false);
+      response->set_term(current_term_);
+      done->Run();
+      return;
+    }
+  }
   int64_t last_log_index;
   int64_t last_log_term;
   GetLastLogIndexAndTerm(&last_log_index, &last_log_term);
@@ -870,19 +1490,70 @@ void InsNodeImpl::Vote(::google::protobuf::RpcController* controller,
   return;
 }
 
-void InsNodeImpl::UpdateCommitIndex(int64_t a_index) {
+// 只回答是否会投票，不改变term和投票记录
+void InsNodeImpl::PreVote(const ::galaxy::ins::VoteRequest* request,
+                          ::galaxy::ins::VoteResponse* response) {
   mu_.AssertHeld();
-  uint32_t match_count = 0;
-  for (auto& server : members_) {
-    if (match_index_[server] >= a_index) {
-      match_count += 1;
-    }
+  response->set_term(current_term_);
+  response->set_vote_granted(false);
+  const int64_t now_timestamp = ins_common::timer::get_micros();
+  if (request->term() <= current_term_ || InLeaderLease() ||
+      (status_ == kLeader) ||
+      (status_ == kFollower && !current_leader_.empty() &&
+       now_timestamp - leader_contact_timestamp_ <
+           FLAGS_elect_timeout_min * 1000)) {
+    LOG(INFO) << "reject pre-vote from " << request->candidate_id()
+              << ", leader " << current_leader_ << " is still alive";
+    return;
   }
-  if (match_count >= match_index_.size() / 2 && a_index > commit_index_) {
-    commit_index_ = a_index;
-    LOG(INFO) << "update to new commit index: " << commit_index_;
-    commit_cond_->Signal();
+  int64_t last_log_index;
+  int64_t last_log_term;
+  GetLastLogIndexAndTerm(&last_log_index, &last_log_term);
+  if (request->last_log_term() < last_log_term ||
+      (request->last_log_term() == last_log_term &&
+       request->last_log_index() < last_log_index)) {
+    return;
+  }
+  response->set_vote_granted(true);
+}
+
+// 取多数派都已经持有的最大index作为commit index，leader自己只计入
+// 按sync策略已经落盘的日志，并且只直接提交当前term的日志
+void InsNodeImpl::UpdateCommitIndex() {
+  mu_.AssertHeld();
+  if (status_ != kLeader) {
+    return;
+  }
+  std::vector<int64_t> matched;
+  matched.push_back(binlogger_->GetDurableLength() - 1);
+  for (auto& server : others_) {
+    auto it = match_index_.find(server);
+    matched.push_back(it == match_index_.end() ? -1 : it->second);
+  }
+  std::sort(matched.begin(), matched.end(), std::greater<int64_t>());
+  const int64_t a_index = matched[members_.size() / 2];
+  if (a_index <= commit_index_) {
+    return;
   }
+  LogEntry log_entry;
+  if (!binlogger_->ReadSlot(a_index, &log_entry) ||
+      log_entry.term != current_term_) {
+    return;
+  }
+  commit_index_ = a_index;
+  LOG(INFO) << "update to new commit index: " << commit_index_;
+  commit_cond_->Signal();
+}
+
+void InsNodeImpl::SyncBinlog() {
+  binlogger_->Sync();
+  MutexLock lock(&mu_);
+  if (stop_) {
+    return;
+  }
+  UpdateCommitIndex();
+  binlog_syncer_.DelayTask(FLAGS_ins_binlog_sync_interval,
+                           std::bind(&InsNodeImpl::SyncBinlog, this));
 }
 
 void InsNodeImpl::ReplicateLog(std::string follower_id) {
@@ -890,121 +1561,371 @@ void InsNodeImpl::ReplicateLog(std::string follower_id) {
   MutexLock lock(&mu_);
   replicating_.insert(follower_id);
 
-  bool latest_replicating_ok = true;
   while (!stop_ && status_ == kLeader) {
-    while (!stop_ && binlogger_->GetLength() <= next_index_[follower_id]) {
-      LOG(INFO) << "no new log entry for " << follower_id;
-      replication_cond_->TimeWait(2000);
-      if (status_ != kLeader) {
-        LOG(INFO) << "not longger leader, break";
-        break;
+    // 在途的batch达到窗口上限，或者处于重试等待期时不再发送
+    ReplicationWindow& window = replication_window_[follower_id];
+    const int64_t now_timestamp = ins_common::timer::get_micros();
+    // follower的credit用完后等待heartbeat或者响应带回新的credit
+    const bool no_credit = (window.credit_limit >= 0 &&
+                            window.credit_limit <= next_index_[follower_id]);
+    if (binlogger_->GetLength() > next_index_[follower_id] && no_credit) {
+      if (window.stall_timestamp == 0) {
+        window.stall_timestamp = now_timestamp;
       }
-    }
-    if (stop_) {
-      break;
-    }
-    if (status_ != kLeader) {
-      LOG(INFO) << "stop realicate log, no longger leader";
-      break;
+    } else if (window.stall_timestamp > 0) {
+      window.stall_micros += now_timestamp - window.stall_timestamp;
+      window.stall_timestamp = 0;
+    }
+    if (binlogger_->GetLength() <= next_index_[follower_id] || no_credit ||
+        window.inflight >= FLAGS_replication_max_inflight ||
+        now_timestamp < window.retry_timestamp) {
+      int32_t wait_ms = 2000;
+      if (now_timestamp < window.retry_timestamp) {
+        wait_ms = std::min(
+            wait_ms,
+            static_cast<int32_t>(
+                (window.retry_timestamp - now_timestamp) / 1000 + 1));
+      }
+      replication_cond_->TimeWait(wait_ms);
+      continue;
     }
     const int64_t index = next_index_[follower_id];
+    const int64_t seq = window.seq;
     int64_t cur_term = current_term_;
     int64_t prev_index = index - 1;
     int64_t prev_term = -1;
     int64_t cur_commit_index = commit_index_;
     int64_t batch_span = binlogger_->GetLength() - index;
-    batch_span =
-        std::min(batch_span, static_cast<int64_t>(FLAGS_log_rep_batch_max));
-    if (!latest_replicating_ok) {
-      batch_span = std::min(1L, batch_span);
+    batch_span = std::min(batch_span, window.batch_limit);
+    if (window.credit_limit >= 0) {
+      batch_span = std::min(batch_span, window.credit_limit - index);
     }
     std::string& leader_id = self_id_;
+    // 已经apply过的日志读不到说明已经被gc，只能给follower发送快照
+    const int64_t applied_index = last_applied_index_;
     LogEntry prev_log_entry;
     if (prev_index > -1) {
       if (!binlogger_->ReadSlot(prev_index, &prev_log_entry)) {
+        if (prev_index <= applied_index) {
+          if (!ReplicateSnapshot(follower_id, cur_term)) {
+            break;
+          }
+          continue;
+        }
         LOG(WARNING) << "bad slot [" << prev_index << "], can't replicate on "
                      << follower_id;
         break;
       }
       prev_term = prev_log_entry.term;
     }
+    std::shared_ptr<const ReplicationBatch> batch =
+        FindReplicationBatch(index, batch_span);
+    const bool batch_cached = (batch.get() != NULL);
+    const bool send_raw = window.accept_raw;
+    const bool compress = send_raw && FLAGS_log_rep_compress &&
+                          window.accept_compressed &&
+                          window.compress_failed_term != cur_term;
     mu_.Unlock();
 
-    std::unique_ptr<galaxy::ins::InsNode_Stub> stub(GetStub(follower_id));
-    galaxy::ins::AppendEntriesRequest request;
-    galaxy::ins::AppendEntriesResponse response;
-    request.set_term(cur_term);
-    request.set_leader_id(leader_id);
-    request.set_prev_log_index(prev_index);
-    request.set_prev_log_term(prev_term);
-    request.set_leader_commit_index(cur_commit_index);
+    auto request = new ::galaxy::ins::AppendEntriesRequest();
+    auto response = new ::galaxy::ins::AppendEntriesResponse();
+    request->set_term(cur_term);
+    request->set_leader_id(leader_id);
+    request->set_prev_log_index(prev_index);
+    request->set_prev_log_term(prev_term);
+    request->set_leader_commit_index(cur_commit_index);
 
     int64_t max_term = -1;
     bool has_bad_slot = false;
-    for (int64_t idx = index; idx < (index + batch_span); idx++) {
-      LogEntry log_entry;
-      bool slot_ok = binlogger_->ReadSlot(idx, &log_entry);
-      if (!slot_ok) {
-        LOG(INFO) << "bad slot at " << idx;
-        has_bad_slot = true;
-        break;
+    bool need_snapshot = false;
+    if (!batch_cached) {
+      // 直接发送binlog中的编码，不解码也不逐个字段拷贝
+      std::shared_ptr<ReplicationBatch> new_batch(new ReplicationBatch());
+      new_batch->start_index = index;
+      new_batch->raw_entries.reserve(batch_span);
+      new_batch->terms.reserve(batch_span);
+      int64_t batch_bytes = 0;
+      for (int64_t idx = index; idx < (index + batch_span); idx++) {
+        if (batch_bytes >= FLAGS_log_rep_batch_size * 1024L) {
+          new_batch->over_size = true;
+          break;
+        }
+        new_batch->raw_entries.push_back(std::string());
+        std::string& raw_entry = new_batch->raw_entries.back();
+        bool slot_ok = binlogger_->ReadSlotRaw(idx, &raw_entry);
+        if (!slot_ok) {
+          LOG(INFO) << "bad slot at " << idx;
+          has_bad_slot = true;
+          need_snapshot = (idx <= applied_index);
+          break;
+        }
+        new_batch->terms.push_back(LogEntry::LoadTerm(raw_entry));
+        batch_bytes += raw_entry.size();
+      }
+      batch = new_batch;
+    }
+    if (!has_bad_slot) {
+      batch_span =
+          std::min(batch_span, static_cast<int64_t>(batch->terms.size()));
+      int64_t batch_bytes = 0;
+      for (int64_t i = 0; i < batch_span; i++) {
+        if (send_raw) {
+          request->add_raw_entries(batch->raw_entries[i]);
+        } else {
+          // 老版本的follower会忽略raw_entries，只能解码后按entries发送
+          LogEntry log_entry;
+          log_entry.Load(batch->raw_entries[i]);
+          galaxy::ins::Entry* entry = request->add_entries();
+          entry->set_term(log_entry.term);
+          entry->set_key(log_entry.key);
+          entry->set_value(log_entry.value);
+          entry->set_op(log_entry.op);
+          entry->set_user(log_entry.user);
+        }
+        max_term = std::max(max_term, batch->terms[i]);
+        batch_bytes += batch->raw_entries[i].size();
       }
-      galaxy::ins::Entry* entry = request.add_entries();
-      entry->set_term(log_entry.term);
-      entry->set_key(log_entry.key);
-      entry->set_value(log_entry.value);
-      entry->set_op(log_entry.op);
-      entry->set_user(log_entry.user);
-      max_term = std::max(max_term, log_entry.term);
+      // 只压缩追赶日志时的大batch，不增加稳定状态下的延迟
+      if (compress && batch_bytes >= FLAGS_log_rep_compress_threshold * 1024L) {
+        std::string compressed;
+        BinLogger::CompressRawEntries(request->raw_entries(), &compressed);
+        if (static_cast<int64_t>(compressed.size()) < batch_bytes) {
+          request->mutable_compressed_entries()->swap(compressed);
+          request->set_compressed_count(batch_span);
+          request->clear_raw_entries();
+        }
+      }
+    }
+    mu_.Lock();
+    if (!has_bad_slot && !batch_cached && status_ == kLeader &&
+        current_term_ == cur_term) {
+      CacheReplicationBatch(batch);
     }
     if (has_bad_slot) {
+      delete request;
+      delete response;
+      if (need_snapshot) {
+        // 读binlog期间发生了回退则按新的next_index重试
+        if (window.seq == seq && !ReplicateSnapshot(follower_id, cur_term)) {
+          break;
+        }
+        continue;
+      }
       LOG(ERROR) << "bad slot, can't replicate on server: " << follower_id;
-      mu_.Lock();
       break;
     }
-    bool ok = rpc_client_.SendRequest(stub.get(), &InsNode_Stub::AppendEntries,
-                                      &request, &response, 60, 1);
-    mu_.Lock();
-    mu_.AssertHeld();
-    if (ok && response.current_term() > current_term_) {
-      TransToFollower("InsNodeImpl::ReplicateLog", response.current_term());
-    }
-    if (status_ != kLeader) {
+    if (status_ != kLeader || current_term_ != cur_term) {
       LOG(INFO) << "stop realicate log, no longger leader";
+      delete request;
+      delete response;
       break;
     }
-    if (ok) {
-      if (response.success()) {  // log replicated
-        next_index_[follower_id] = index + batch_span;
-        match_index_[follower_id] = index + batch_span - 1;
-        if (max_term == current_term_) {
-          UpdateCommitIndex(index + batch_span - 1);
-        }
-        latest_replicating_ok = true;
-      } else if (response.is_busy()) {
-        mu_.Unlock();
-        LOG(WARNING) << "delay replicate-rpc to " << follower_id << ", [busy]";
-        ThisThread::Sleep(FLAGS_replication_retry_timespan);
-        latest_replicating_ok = true;
-        mu_.Lock();
-      } else {  // (index, term ) miss match
-        next_index_[follower_id] =
-            std::min(next_index_[follower_id] - 1, response.log_length());
-        if (next_index_[follower_id] < 0) {
-          next_index_[follower_id] = 0;
+    if (window.seq != seq) {
+      // 读binlog期间发生了回退，按新的next_index重新组织batch
+      delete request;
+      delete response;
+      continue;
+    }
+    next_index_[follower_id] = index + batch_span;
+    window.inflight++;
+    window.send_timestamp = ins_common::timer::get_micros();
+    window.sent_commit_index = cur_commit_index;
+    std::unique_ptr<galaxy::ins::InsNode_Stub> stub(GetStub(follower_id));
+    boost::function<void(const ::galaxy::ins::AppendEntriesRequest*,
+                         ::galaxy::ins::AppendEntriesResponse*, bool, int)>
+        callback = boost::bind(&InsNodeImpl::ReplicateLogCallback, this, _1,
+                               _2, _3, _4, follower_id, seq, max_term,
+                               ins_common::timer::get_micros());
+    rpc_client_.AsyncRequest(stub.get(), &InsNode_Stub::AppendEntries, request,
+                             response, callback, 60, 1);
+  }
+  replicating_.erase(follower_id);
+}
+
+void InsNodeImpl::ReplicateLogCallback(
+    const ::galaxy::ins::AppendEntriesRequest* request,
+    ::galaxy::ins::AppendEntriesResponse* response, bool failed, int /*error*/,
+    std::string follower_id, int64_t seq, int64_t max_term,
+    int64_t send_timestamp) {
+  MutexLock lock(&mu_);
+  std::unique_ptr<const galaxy::ins::AppendEntriesRequest> request_ptr(request);
+  std::unique_ptr<galaxy::ins::AppendEntriesResponse> response_ptr(response);
+  if (!failed && status_ == kLeader && request->term() == current_term_ &&
+      response->current_term() == current_term_) {
+    ExtendLeaderLease(follower_id, send_timestamp);
+  }
+  ReplicationWindow& window = replication_window_[follower_id];
+  if (!failed && status_ == kLeader && request->term() == current_term_) {
+    UpdateFollowerProgress(follower_id, response);
+    if (request->has_compressed_entries() && response->is_busy() &&
+        !response->accept_compressed()) {
+      // follower解不开压缩的batch，这个term内不再给它发送压缩的batch
+      LOG(WARNING) << follower_id << " failed to decode compressed entries";
+      window.compress_failed_term = current_term_;
+    }
+  }
+  if (window.seq != seq) {
+    LOG(INFO) << "outdated replicate-rpc response from " << follower_id;
+    return;
+  }
+  window.inflight--;
+  replication_cond_->Broadcast();
+  if (!failed && response->current_term() > current_term_) {
+    TransToFollower("InsNodeImpl::ReplicateLogCallback",
+                    response->current_term());
+  }
+  if (status_ != kLeader || request->term() != current_term_) {
+    LOG(INFO) << "stop realicate log, no longger leader";
+    return;
+  }
+  const int64_t index = request->prev_log_index() + 1;
+  const int64_t batch_span = EntriesSize(request);
+  const int64_t now_timestamp = ins_common::timer::get_micros();
+  if (failed) {  // rpc error, 从这个batch开始重发
+    LOG(WARNING) << "faild to send replicate-rpc to " << follower_id;
+    window.seq++;
+    window.inflight = 0;
+    window.batch_limit = std::max<int64_t>(1, window.batch_limit / 2);
+    window.retry_timestamp =
+        now_timestamp + FLAGS_replication_retry_timespan * 1000L;
+    next_index_[follower_id] = std::min(next_index_[follower_id], index);
+    return;
+  }
+  if (response->success()) {  // log replicated
+    // follower只确认已经落盘的部分
+    int64_t last_index = index + batch_span - 1;
+    if (response->has_durable_index()) {
+      last_index = response->durable_index();
+    }
+    if (response->has_log_length()) {
+      // 不能超过follower实际持有的日志
+      last_index = std::min(last_index, response->log_length() - 1);
+    }
+    if (last_index > match_index_[follower_id]) {
+      match_index_[follower_id] = last_index;
+    }
+    UpdateCommitIndex();
+    AdjustBatchLimit(&window, batch_span, now_timestamp - send_timestamp);
+  } else if (response->is_busy()) {
+    LOG(WARNING) << "delay replicate-rpc to " << follower_id << ", [busy]";
+    window.seq++;
+    window.inflight = 0;
+    if (!response->has_credit()) {
+      // 不支持credit的follower只能等待固定的时间
+      window.retry_timestamp =
+          now_timestamp + FLAGS_replication_retry_timespan * 1000L;
+    }
+    next_index_[follower_id] = std::min(next_index_[follower_id], index);
+  } else {  // (index, term ) miss match, 丢弃在途的batch并回退
+    window.seq++;
+    window.inflight = 0;
+    int64_t next_index = std::min(index - 1, response->log_length());
+    if (response->has_conflict_index()) {
+      next_index = response->conflict_index();
+      if (response->conflict_term() >= 0) {
+        // 自己也有conflict term的日志时，从这个term的最后一条之后开始
+        int64_t last_index = binlogger_->FindFirstIndexOfTerm(
+                                 response->conflict_term() + 1, index) - 1;
+        LogEntry log_entry;
+        if (last_index >= 0 && binlogger_->ReadSlot(last_index, &log_entry) &&
+            log_entry.term == response->conflict_term()) {
+          next_index = last_index + 1;
         }
-        LOG(INFO) << "adjust next_index of " << follower_id << " to "
-                  << next_index_[follower_id];
       }
-    } else {  // rpc error;
-      mu_.Unlock();
-      LOG(WARNING) << "faild to send replicate-rpc to " << follower_id;
-      ThisThread::Sleep(FLAGS_replication_retry_timespan);
-      latest_replicating_ok = false;
-      mu_.Lock();
+      next_index = std::min(next_index, response->log_length());
     }
+    next_index_[follower_id] = next_index;
+    if (next_index_[follower_id] < 0) {
+      next_index_[follower_id] = 0;
+    }
+    LOG(INFO) << "adjust next_index of " << follower_id << " to "
+              << next_index_[follower_id];
   }
-  replicating_.erase(follower_id);
+}
+
+void InsNodeImpl::AdjustBatchLimit(ReplicationWindow* window,
+                                   int64_t batch_span, int64_t rtt_micros) {
+  // AIMD: 延迟超过目标或者明显变大时减半，batch被填满且延迟正常时线性增长
+  const int64_t last_rtt = window->rtt_micros;
+  window->rtt_micros =
+      (last_rtt == 0) ? rtt_micros : (last_rtt * 7 + rtt_micros) / 8;
+  if (rtt_micros > FLAGS_log_rep_latency_target * 1000L ||
+      (last_rtt > 0 && rtt_micros > last_rtt * 2)) {
+    window->batch_limit = std::max<int64_t>(1, window->batch_limit / 2);
+  } else if (batch_span >= window->batch_limit) {
+    const int64_t batch_max = FLAGS_log_rep_batch_max;
+    window->batch_limit = std::min(
+        batch_max, window->batch_limit + std::max<int64_t>(1, batch_max / 16));
+  }
+}
+
+std::shared_ptr<const ReplicationBatch> InsNodeImpl::FindReplicationBatch(
+    int64_t start_index, int64_t length) {
+  mu_.AssertHeld();
+  // 同一起点上不短于length的batch都可以复用，只发送前length条；
+  // 因为字节数超限而截短的batch也可以复用
+  auto it = replication_batches_.upper_bound(
+      std::make_pair(start_index, std::numeric_limits<int64_t>::max()));
+  if (it == replication_batches_.begin()) {
+    return std::shared_ptr<const ReplicationBatch>();
+  }
+  --it;
+  if (it->first.first != start_index ||
+      (it->first.second < length && !it->second->over_size)) {
+    return std::shared_ptr<const ReplicationBatch>();
+  }
+  return it->second;
+}
+
+void InsNodeImpl::CacheReplicationBatch(
+    const std::shared_ptr<const ReplicationBatch>& batch) {
+  mu_.AssertHeld();
+  if (batch->terms.empty()) {
+    return;
+  }
+  replication_batches_[std::make_pair(
+      batch->start_index, static_cast<int64_t>(batch->terms.size()))] = batch;
+  // 所有follower都已经越过的batch不会再被用到(回退时重新读binlog)
+  int64_t min_next_index = binlogger_->GetLength();
+  for (auto it = next_index_.begin(); it != next_index_.end(); ++it) {
+    min_next_index = std::min(min_next_index, it->second);
+  }
+  while (!replication_batches_.empty() &&
+         (replication_batches_.begin()->first.first < min_next_index ||
+          replication_batches_.size() > members_.size() * 2)) {
+    replication_batches_.erase(replication_batches_.begin());
+  }
+}
+
+bool InsNodeImpl::ReplicateSnapshot(const std::string& follower_id,
+                                    int64_t term) {
+  mu_.AssertHeld();
+  if (replication_window_[follower_id].inflight > 0) {
+    // 等在途的AppendEntries都返回之后再发送快照
+    replication_cond_->TimeWait(100);
+    return true;
+  }
+  LOG(INFO) << "[snapshot] log for " << follower_id
+            << " has been cleaned, send snapshot instead";
+  mu_.Unlock();
+  int64_t snapshot_index = -1;
+  bool ok = SendSnapshot(follower_id, term, &snapshot_index);
+  mu_.Lock();
+  if (stop_ || status_ != kLeader || current_term_ != term) {
+    return false;
+  }
+  ReplicationWindow& window = replication_window_[follower_id];
+  window.seq++;
+  window.inflight = 0;
+  if (ok) {
+    next_index_[follower_id] = snapshot_index + 1;
+    match_index_[follower_id] =
+        std::max(match_index_[follower_id], snapshot_index);
+  } else {
+    window.retry_timestamp = ins_common::timer::get_micros() +
+                             FLAGS_replication_retry_timespan * 1000L;
+  }
+  return true;
 }
 
 void InsNodeImpl::Get(::google::protobuf::RpcController* controller,
@@ -1016,6 +1937,29 @@ void InsNodeImpl::Get(::google::protobuf::RpcController* controller,
   SampleAccessLog(controller, "Get");
   perform_.Get();
   MutexLock lock(&mu_);
+  // session表不完整时无法判断lock的持有者是否过期，交给leader处理
+  if (CanServeFollowerRead() && SessionsValid()) {
+    const std::string& uuid = request->uuid();
+    if (!uuid.empty() && !user_manager_->IsLoggedIn(uuid)) {
+      response->set_hit(false);
+      response->set_leader_id(current_leader_);
+      response->set_success(false);
+      response->set_uuid_expired(true);
+      done->Run();
+      return;
+    }
+    auto context = std::make_shared<ClientReadAck>();
+    context->request = request;
+    context->response = response;
+    context->done = done;
+    context->leader_id = current_leader_;
+    pending_reads_.push_back(context);
+    if (!read_batch_inflight_) {
+      StartReadIndexRound();
+    }
+    return;
+  }
+
   if (status_ == kFollower) {
     response->set_hit(false);
     response->set_leader_id(current_leader_);
@@ -1052,65 +1996,22 @@ void InsNodeImpl::Get(::google::protobuf::RpcController* controller,
   }
 
   int64_t now_timestamp = ins_common::timer::get_micros();
-  if (members_.size() > 1 && (now_timestamp - heartbeat_read_timestamp_) >
-                                 1000 * FLAGS_elect_timeout_min) {
-    LOG(INFO) << "broadcast for read";
+  if (members_.size() > 1 && !InLeaderLease() &&
+      (now_timestamp - heartbeat_read_timestamp_) >
+          1000 * FLAGS_elect_timeout_min) {
+    // 需要向多数派确认leader身份，同一时间只有一轮确认在途，
+    // 期间到达的Get合并到下一轮
     auto context = std::make_shared<ClientReadAck>();
     context->request = request;
     context->response = response;
     context->done = done;
-    context->succ_count = 1;  // self Get success;
-    boost::function<void(const ::galaxy::ins::AppendEntriesRequest*,
-                         ::galaxy::ins::AppendEntriesResponse*, bool, int)>
-        callback;
-    for (auto& server : others_) {
-      std::unique_ptr<galaxy::ins::InsNode_Stub> stub(GetStub(server));
-      auto request = new ::galaxy::ins::AppendEntriesRequest();
-      auto response = new ::galaxy::ins::AppendEntriesResponse();
-      request->set_term(current_term_);
-      request->set_leader_id(self_id_);
-      request->set_leader_commit_index(commit_index_);
-      LOG(INFO) << "Send AppendEntriesRequest to " << server
-                << ", current_term: " << current_term_ << ", self: " << self_id_
-                << ", commit_index: " << commit_index_;
-      callback = boost::bind(&InsNodeImpl::HeartbeatForReadCallback, this, _1,
-                             _2, _3, _4, context);
-      rpc_client_.AsyncRequest(stub.get(), &InsNode_Stub::AppendEntries,
-                               request, response, callback);
+    pending_reads_.push_back(context);
+    if (!read_batch_inflight_) {
+      StartReadIndexRound();
     }
   } else {
     mu_.Unlock();
-    std::string key = request->key();
-    Status s;
-    std::string value;
-    s = data_store_->Get(user_manager_->GetUsernameFromUuid(uuid), key, &value);
-    std::string real_value;
-    LogOperation op;
-    ParseValue(value, op, real_value);
-    if (s == kOk) {
-      if (op == kLock) {
-        if (IsExpiredSession(real_value)) {
-          response->set_hit(false);
-          response->set_success(true);
-          response->set_leader_id("");
-        } else {
-          response->set_hit(true);
-          response->set_success(true);
-          response->set_value(real_value);
-          response->set_leader_id("");
-        }
-      } else {
-        response->set_hit(true);
-        response->set_success(true);
-        response->set_value(real_value);
-        // LOG(INFO) << "get value: " << real_value;
-        response->set_leader_id("");
-      }
-    } else {
-      response->set_hit(false);
-      response->set_success(true);
-      response->set_leader_id("");
-    }
+    ReadFromStore(request, response);
     done->Run();
     mu_.Lock();
   }
@@ -1139,6 +2040,15 @@ void InsNodeImpl::Delete(::google::protobuf::RpcController* controller,
     return;
   }
 
+  // 移交期间不再接受新的写请求，目标节点才能追上
+  if (!transfer_target_.empty()) {
+    LOG(INFO) << "leadership is being transferred, reject delete";
+    response->set_success(false);
+    response->set_leader_id("");
+    done->Run();
+    return;
+  }
+
   const std::string& uuid = request->uuid();
   if (!uuid.empty() && !user_manager_->IsLoggedIn(uuid)) {
     response->set_success(false);
@@ -1157,16 +2067,10 @@ void InsNodeImpl::Delete(::google::protobuf::RpcController* controller,
   log_entry.value = "";
   log_entry.term = current_term_;
   log_entry.op = kDel;
-  binlogger_->AppendEntry(log_entry);
-
-  int64_t cur_index = binlogger_->GetLastLogIndex();
-  ClientAck& ack = client_ack_[cur_index];
+  ClientAck ack;
   ack.done = done;
   ack.del_response = response;
-  replication_cond_->Broadcast();
-  if (single_node_mode_) {  // single node cluster
-    UpdateCommitIndex(binlogger_->GetLastLogIndex());
-  }
+  SubmitClientWrite(log_entry, ack);
   return;
 }
 
@@ -1192,8 +2096,18 @@ void InsNodeImpl::Put(::google::protobuf::RpcController* controller,
     return;
   }
 
-  if (client_ack_.size() > static_cast<size_t>(FLAGS_max_write_pending)) {
-    LOG(WARNING) << "too much pending write: " << client_ack_.size() << " > "
+  // 移交期间不再接受新的写请求，目标节点才能追上
+  if (!transfer_target_.empty()) {
+    LOG(INFO) << "leadership is being transferred, reject put";
+    response->set_success(false);
+    response->set_leader_id("");
+    done->Run();
+    return;
+  }
+
+  size_t write_pending = client_ack_.size() + write_queue_.Size();
+  if (write_pending > static_cast<size_t>(FLAGS_max_write_pending)) {
+    LOG(WARNING) << "too much pending write: " << write_pending << " > "
                  << FLAGS_max_write_pending;
     response->set_success(false);
     response->set_leader_id("");
@@ -1219,18 +2133,133 @@ void InsNodeImpl::Put(::google::protobuf::RpcController* controller,
   log_entry.value = value;
   log_entry.term = current_term_;
   log_entry.op = kPut;
-  binlogger_->AppendEntry(log_entry);
-
-  const int64_t cur_index = binlogger_->GetLastLogIndex();
-  ClientAck& ack = client_ack_[cur_index];
+  ClientAck ack;
   ack.done = done;
   ack.response = response;
-  replication_cond_->Broadcast();
+  SubmitClientWrite(log_entry, ack);
+  return;
+}
 
-  if (single_node_mode_) {  // single node cluster
-    UpdateCommitIndex(binlogger_->GetLastLogIndex());
+void InsNodeImpl::SubmitClientWrite(const LogEntry& log_entry,
+                                    const ClientAck& ack) {
+  PendingWrite write;
+  write.log_entry = log_entry;
+  write.ack = ack;
+  if (write_queue_.Push(write)) {
+    MutexLock lock(&write_mu_);
+    write_cond_->Signal();
+  }
+}
+
+// group commit: 把排队的写请求合并成一个WriteBatch写入binlog，
+// 写盘期间不持有mu_，只在分配index和发布结果时短暂加锁
+void InsNodeImpl::LogWriterLoop() {
+  while (true) {
+    {
+      MutexLock lock(&write_mu_);
+      while (!writer_stop_ && write_queue_.Empty()) {
+        write_cond_->Wait();
+      }
+      if (writer_stop_) {
+        return;
+      }
+    }
+    std::vector<PendingWrite> writes;
+    PendingWrite write;
+    while (write_queue_.Pop(&write)) {
+      writes.push_back(write);
+    }
+    if (writes.empty()) {  // producer has not linked its node yet
+      ThisThread::Yield();  // 让出cpu，避免和被抢占的producer空转
+      continue;
+    }
+
+    MutexLock io_lock(&log_io_mu_);
+    std::vector<LogEntry> entries;
+    entries.reserve(writes.size());
+    int64_t first_index = -1;
+    int64_t term = -1;
+    {
+      MutexLock lock(&mu_);
+      first_index = binlogger_->GetLength();
+      term = current_term_;
+      for (auto& w : writes) {
+        // 排队期间换了term或者不再是leader，这些写请求不能再追加；
+        // 移交开始前排队的客户端写请求也拒绝掉，内部产生的kUnLock/kLogout
+        // 等没有回复的日志照常追加，否则就再也不会写入了
+        if (status_ != kLeader || w.log_entry.term != current_term_ ||
+            (!transfer_target_.empty() && w.ack.done != NULL)) {
+          FailClientAck(w.ack);
+          continue;
+        }
+        if (w.ack.done) {
+          client_ack_[first_index + entries.size()] = w.ack;
+        }
+        entries.push_back(w.log_entry);
+      }
+    }
+    if (entries.empty()) {
+      continue;
+    }
+
+    binlogger_->AppendEntryList(entries);
+    const int64_t last_index = first_index + entries.size() - 1;
+    LOG(INFO) << "group commit " << entries.size()
+              << " entries, last log index: " << last_index;
+
+    MutexLock lock(&mu_);
+    if (status_ == kLeader && current_term_ == term) {
+      replication_cond_->Broadcast();
+      if (single_node_mode_) {  // single node cluster
+        UpdateCommitIndex();
+      }
+    } else {
+      // 写盘期间失去了leader身份，这些日志可能被新leader覆盖
+      for (int64_t i = first_index; i <= last_index; i++) {
+        auto it = client_ack_.find(i);
+        if (it != client_ack_.end()) {
+          FailClientAck(it->second);
+          client_ack_.erase(it);
+        }
+      }
+    }
+  }
+}
+
+void InsNodeImpl::FailClientAck(ClientAck& ack) {
+  mu_.AssertHeld();
+  const std::string leader_id = status_ == kFollower ? current_leader_ : "";
+  if (ack.response) {
+    ack.response->set_success(false);
+    ack.response->set_leader_id(leader_id);
+  }
+  if (ack.del_response) {
+    ack.del_response->set_success(false);
+    ack.del_response->set_leader_id(leader_id);
+  }
+  if (ack.lock_response) {
+    ack.lock_response->set_success(false);
+    ack.lock_response->set_leader_id(leader_id);
+  }
+  if (ack.unlock_response) {
+    ack.unlock_response->set_success(false);
+    ack.unlock_response->set_leader_id(leader_id);
+  }
+  if (ack.login_response) {
+    ack.login_response->set_status(kError);
+    ack.login_response->set_leader_id(leader_id);
+  }
+  if (ack.logout_response) {
+    ack.logout_response->set_status(kError);
+    ack.logout_response->set_leader_id(leader_id);
+  }
+  if (ack.register_response) {
+    ack.register_response->set_status(kError);
+    ack.register_response->set_leader_id(leader_id);
+  }
+  if (ack.done) {
+    ack.done->Run();
   }
-  return;
 }
 
 bool InsNodeImpl::LockIsAvailable(const std::string& user,
@@ -1244,25 +2273,17 @@ bool InsNodeImpl::LockIsAvailable(const std::string& user,
   ParseValue(value, op, old_locker_session);
   bool lock_is_available = false;
   if (s != kOk) {
-    MutexLock lock(&sessions_mu_);
-    SessionIDIndex& id_index = sessions_.get<0>();
-    auto self_it = id_index.find(session_id);
-    if (self_it != sessions_.end()) {
-      lock_is_available = true;
-    }
+    lock_is_available = sessions_.Find(session_id, NULL);
   } else {
     if (op != kLock) {
       lock_is_available = false;
     } else {
-      MutexLock lock(&sessions_mu_);
-      SessionIDIndex& id_index = sessions_.get<0>();
-      auto old_it = id_index.find(old_locker_session);
-      auto self_it = id_index.find(session_id);
-      if (old_it == sessions_.end()  // expired session
-          && self_it != sessions_.end()) {
+      bool old_alive = sessions_.Find(old_locker_session, NULL);
+      bool self_alive = sessions_.Find(session_id, NULL);
+      if (!old_alive  // expired session
+          && self_alive) {
         lock_is_available = true;
-      } else if (old_it != sessions_.end() &&
-                 old_it->session_id == session_id) {
+      } else if (old_alive && old_locker_session == session_id) {
         lock_is_available = true;  // allow reentry
       }
     }
@@ -1310,9 +2331,7 @@ void InsNodeImpl::Lock(::google::protobuf::RpcController* controller,
     return;
   }
 
-  int64_t tm_now = ins_common::timer::get_micros();
-  if (status_ == kLeader &&
-      (tm_now - server_start_timestamp_) < FLAGS_session_expire_timeout) {
+  if (status_ == kLeader && !SessionsValid()) {
     LOG(INFO) << "leader is still in safe mode for lock";
     response->set_leader_id("");
     response->set_success(false);
@@ -1320,32 +2339,50 @@ void InsNodeImpl::Lock(::google::protobuf::RpcController* controller,
     return;
   }
 
+  // 移交期间log writer会丢弃新的日志，不能提前写入data_store_
+  if (!transfer_target_.empty()) {
+    LOG(INFO) << "leadership is being transferred, reject lock";
+    response->set_leader_id("");
+    response->set_success(false);
+    done->Run();
+    return;
+  }
+
   const std::string& key = request->key();
   const std::string& session_id = request->session_id();
   const std::string& user = user_manager_->GetUsernameFromUuid(uuid);
-  LogEntry log_entry;
-  log_entry.user = user;
-  log_entry.key = key;
-  log_entry.value = session_id;
-  log_entry.term = current_term_;
-  log_entry.op = kLock;
-  bool lock_is_available = false;
-  lock_is_available = LockIsAvailable(user, key, session_id);
-  if (lock_is_available) {
-    LOG(INFO) << "lock key: " << key << ", session: " << session_id;
-    std::string type_and_value;
-    type_and_value.append(1, static_cast<char>(kLock));
-    type_and_value.append(session_id);
-    Status st = data_store_->Put(user, key, type_and_value);
-    assert(st == kOk);
-    binlogger_->AppendEntry(log_entry);
-    int64_t cur_index = binlogger_->GetLastLogIndex();
-    ClientAck& ack = client_ack_[cur_index];
-    ack.done = done;
-    ack.lock_response = response;
-    replication_cond_->Broadcast();
-    if (single_node_mode_) {  // single node cluster
-      UpdateCommitIndex(binlogger_->GetLastLogIndex());
+  // 先让排队的请求拿锁，新来的请求不能插队
+  WakeLockWaiters(user, key);
+  if (LockIsAvailable(user, key, session_id)) {
+    GrantLock(user, key, session_id, response, done);
+  } else if (request->wait() && request->wait_timeout() > 0) {
+    LOG(INFO) << "the lock " << key << " is hold by another session, "
+              << session_id << " waits in queue";
+    LockWaiter waiter;
+    waiter.user = user;
+    waiter.key = key;
+    waiter.session_id = session_id;
+    waiter.response = response;
+    waiter.done = done;
+    // 不相信客户端给的等待时间，最多等待max_lock_wait_timeout
+    const int64_t wait_timeout = std::min<int64_t>(
+        request->wait_timeout(), FLAGS_max_lock_wait_timeout * 1000L);
+    waiter.deadline = ins_common::timer::get_micros() + wait_timeout * 1000;
+    std::deque<LockWaiter>& waiters = lock_waiters_[BindKeyAndUser(user, key)];
+    auto it = waiters.begin();
+    for (; it != waiters.end(); ++it) {
+      if (it->session_id == session_id) {
+        break;
+      }
+    }
+    if (it == waiters.end()) {
+      waiters.push_back(waiter);
+    } else {
+      // 客户端重试，保留原来排队的位置
+      it->response->set_leader_id("");
+      it->response->set_success(false);
+      it->done->Run();
+      *it = waiter;
     }
   } else {
     LOG(INFO) << "the lock " << key << " is hold by another session";
@@ -1356,6 +2393,105 @@ void InsNodeImpl::Lock(::google::protobuf::RpcController* controller,
   return;
 }
 
+void InsNodeImpl::GrantLock(const std::string& user, const std::string& key,
+                            const std::string& session_id,
+                            ::galaxy::ins::LockResponse* response,
+                            ::google::protobuf::Closure* done) {
+  mu_.AssertHeld();
+  LOG(INFO) << "lock key: " << key << ", session: " << session_id;
+  std::string type_and_value;
+  type_and_value.append(1, static_cast<char>(kLock));
+  type_and_value.append(session_id);
+  Status st = data_store_->Put(user, key, type_and_value);
+  assert(st == kOk);
+  LogEntry log_entry;
+  log_entry.user = user;
+  log_entry.key = key;
+  log_entry.value = session_id;
+  log_entry.term = current_term_;
+  log_entry.op = kLock;
+  ClientAck ack;
+  ack.done = done;
+  ack.lock_response = response;
+  SubmitClientWrite(log_entry, ack);
+}
+
+void InsNodeImpl::WakeLockWaiters(const std::string& user,
+                                  const std::string& key) {
+  mu_.AssertHeld();
+  auto it = lock_waiters_.find(BindKeyAndUser(user, key));
+  if (it == lock_waiters_.end()) {
+    return;
+  }
+  if (status_ != kLeader || in_safe_mode_ || !SessionsValid() ||
+      !transfer_target_.empty()) {
+    return;
+  }
+  std::deque<LockWaiter>& waiters = it->second;
+  while (!waiters.empty()) {
+    LockWaiter& waiter = waiters.front();
+    if (IsExpiredSession(waiter.session_id)) {
+      waiter.response->set_leader_id("");
+      waiter.response->set_success(false);
+      waiter.done->Run();
+      waiters.pop_front();
+      continue;
+    }
+    if (LockIsAvailable(user, key, waiter.session_id)) {
+      LOG(INFO) << "hand over lock " << key << " to waiting session "
+                << waiter.session_id;
+      GrantLock(user, key, waiter.session_id, waiter.response, waiter.done);
+      waiters.pop_front();
+    }
+    break;
+  }
+  if (waiters.empty()) {
+    lock_waiters_.erase(it);
+  }
+}
+
+void InsNodeImpl::ExpireLockWaiters() {
+  mu_.AssertHeld();
+  const int64_t now_timestamp = ins_common::timer::get_micros();
+  std::vector<std::pair<std::string, std::string> > pending_keys;
+  for (auto it = lock_waiters_.begin(); it != lock_waiters_.end();) {
+    std::deque<LockWaiter>& waiters = it->second;
+    for (auto jt = waiters.begin(); jt != waiters.end();) {
+      if (jt->deadline <= now_timestamp || IsExpiredSession(jt->session_id)) {
+        jt->response->set_leader_id("");
+        jt->response->set_success(false);
+        jt->done->Run();
+        jt = waiters.erase(jt);
+      } else {
+        ++jt;
+      }
+    }
+    if (waiters.empty()) {
+      lock_waiters_.erase(it++);
+    } else {
+      pending_keys.push_back(
+          std::make_pair(waiters.front().user, waiters.front().key));
+      ++it;
+    }
+  }
+  // 锁在leader不能交接的时候(比如safe mode)被释放，这里补上
+  for (size_t i = 0; i < pending_keys.size(); i++) {
+    WakeLockWaiters(pending_keys[i].first, pending_keys[i].second);
+  }
+}
+
+void InsNodeImpl::FailLockWaiters() {
+  mu_.AssertHeld();
+  for (auto it = lock_waiters_.begin(); it != lock_waiters_.end(); ++it) {
+    for (auto& waiter : it->second) {
+      waiter.response->set_leader_id("");
+      waiter.response->set_success(false);
+      waiter.done->Run();
+    }
+  }
+  lock_waiters_.clear();
+}
+
 void InsNodeImpl::Scan(::google::protobuf::RpcController* controller,
                        const ::galaxy::ins::ScanRequest* request,
                        ::galaxy::ins::ScanResponse* response,
@@ -1367,6 +2503,27 @@ void InsNodeImpl::Scan(::google::protobuf::RpcController* controller,
   const std::string& uuid = request->uuid();
   {
     MutexLock lock(&mu_);
+    const bool sessions_valid = SessionsValid();
+    if (CanServeFollowerRead() && sessions_valid) {
+      if (!uuid.empty() && !user_manager_->IsLoggedIn(uuid)) {
+        response->set_success(false);
+        response->set_leader_id(current_leader_);
+        response->set_uuid_expired(true);
+        done->Run();
+        return;
+      }
+      auto context = std::make_shared<ClientReadAck>();
+      context->scan_request = request;
+      context->scan_response = response;
+      context->done = done;
+      context->leader_id = current_leader_;
+      pending_reads_.push_back(context);
+      if (!read_batch_inflight_) {
+        StartReadIndexRound();
+      }
+      return;
+    }
+
     if (status_ == kFollower) {
       response->set_leader_id(current_leader_);
       response->set_success(false);
@@ -1397,9 +2554,7 @@ void InsNodeImpl::Scan(::google::protobuf::RpcController* controller,
       return;
     }
 
-    int64_t tm_now = ins_common::timer::get_micros();
-    if (status_ == kLeader &&
-        (tm_now - server_start_timestamp_) < FLAGS_session_expire_timeout) {
+    if (status_ == kLeader && !sessions_valid) {
       LOG(INFO) << "leader is still in safe mode for scan";
       response->set_leader_id("");
       response->set_success(false);
@@ -1408,6 +2563,14 @@ void InsNodeImpl::Scan(::google::protobuf::RpcController* controller,
     }
   }
 
+  ScanFromStore(request, response);
+  done->Run();
+  return;
+}
+
+void InsNodeImpl::ScanFromStore(const ::galaxy::ins::ScanRequest* request,
+                                ::galaxy::ins::ScanResponse* response) {
+  const std::string& uuid = request->uuid();
   const std::string& start_key = request->start_key();
   const std::string& end_key = request->end_key();
   int32_t size_limit = request->size_limit();
@@ -1416,8 +2579,6 @@ void InsNodeImpl::Scan(::google::protobuf::RpcController* controller,
   if (it == NULL) {
     response->set_uuid_expired(true);
     response->set_success(true);
-    done->Run();
-    mu_.Lock();
     return;
   }
   bool has_more = false;
@@ -1457,9 +2618,7 @@ void InsNodeImpl::Scan(::google::protobuf::RpcController* controller,
   assert(it->status() == kOk);
   delete it;
   response->set_has_more(has_more);
-  response->set_success(true);
-  done->Run();
-  return;
+  response->set_success(true);
 }
 
 void InsNodeImpl::KeepAlive(::google::protobuf::RpcController* controller,
@@ -1490,16 +2649,8 @@ void InsNodeImpl::KeepAlive(::google::protobuf::RpcController* controller,
   session.session_id = request->session_id();
   session.last_report_time = ins_common::timer::get_micros();
   session.uuid = request->uuid();
-  {
-    MutexLock lock(&sessions_mu_);
-    SessionIDIndex& id_index = sessions_.get<0>();
-    auto it = id_index.find(session.session_id);
-    if (it == sessions_.end()) {
-      id_index.insert(session);
-    } else {
-      id_index.replace(it, session);
-    }
-  }
+  // leader定期把有变化的session批量同步给follower
+  sessions_.Refresh(session, !request->forward_from_leader());
   {
     MutexLock lock_sk(&session_locks_mu_);
     session_locks_[session.session_id].clear();
@@ -1510,36 +2661,9 @@ void InsNodeImpl::KeepAlive(::google::protobuf::RpcController* controller,
   response->set_success(true);
   response->set_leader_id("");
   LOG(INFO) << "recv session id: " << session.session_id;
-  // forward heartbeat of clients
-  ForwardKeepAlive(request, response);
   done->Run();
 }
 
-void InsNodeImpl::ForwardKeepAlive(
-    const ::galaxy::ins::KeepAliveRequest* request,
-    ::galaxy::ins::KeepAliveResponse* response) {
-  {
-    MutexLock lock(&mu_);
-    if (status_ != kLeader) {
-      return;
-    }
-  }
-  boost::function<void(const ::galaxy::ins::KeepAliveRequest*,
-                       ::galaxy::ins::KeepAliveResponse*, bool, int)> callback;
-  for (auto& server : others_) {
-    std::unique_ptr<galaxy::ins::InsNode_Stub> stub(GetStub(server));
-    auto forward_request = new ::galaxy::ins::KeepAliveRequest();
-    auto forward_response = new ::galaxy::ins::KeepAliveResponse();
-    forward_request->CopyFrom(*request);
-    forward_response->CopyFrom(*response);
-    forward_request->set_forward_from_leader(true);
-    callback = boost::bind(&InsNodeImpl::ForwardKeepAliveCallback, this, _1, _2,
-                           _3, _4);
-    rpc_client_.AsyncRequest(stub.get(), &InsNode_Stub::KeepAlive,
-                             forward_request, forward_response, callback);
-  }
-}
-
 void InsNodeImpl::RemoveExpiredSessions() {
   int64_t cur_term;
   NodeStatus cur_status;
@@ -1553,23 +2677,9 @@ void InsNodeImpl::RemoveExpiredSessions() {
   }
 
   std::vector<Session> expired_sessions;
-
-  {
-    MutexLock lock_session(&sessions_mu_);
-    SessionTimeIndex& time_index = sessions_.get<1>();
-    if (!sessions_.empty()) {
-      int64_t expired_line =
-          ins_common::timer::get_micros() - FLAGS_session_expire_timeout;
-      auto it = time_index.lower_bound(expired_line);
-      if (it != time_index.begin()) {
-        LOG(INFO) << "remove expired session";
-        for (auto dd = time_index.begin(); dd != it; dd++) {
-          expired_sessions.push_back(*dd);
-          LOG(INFO) << "remove session_id " << dd->session_id;
-        }
-        time_index.erase(time_index.begin(), it);
-      }
-    }
+  sessions_.RemoveExpired(ins_common::timer::get_micros(), &expired_sessions);
+  for (auto it = expired_sessions.begin(); it != expired_sessions.end(); ++it) {
+    LOG(INFO) << "remove session_id " << it->session_id;
   }
 
   {
@@ -1599,6 +2709,7 @@ void InsNodeImpl::RemoveExpiredSessions() {
   }
 
   if (cur_status == kLeader) {
+    std::vector<LogEntry> entries;
     for (size_t i = 0; i < unlock_keys.size(); i++) {
       const std::string& key = unlock_keys[i].first;
       const std::string& session_id = unlock_keys[i].second.session_id;
@@ -1609,7 +2720,7 @@ void InsNodeImpl::RemoveExpiredSessions() {
       log_entry.value = session_id;
       log_entry.term = cur_term;
       log_entry.op = kUnLock;
-      binlogger_->AppendEntry(log_entry);
+      entries.push_back(log_entry);
     }
     for (auto it = expired_sessions.begin(); it != expired_sessions.end();
          ++it) {
@@ -1619,16 +2730,27 @@ void InsNodeImpl::RemoveExpiredSessions() {
         log_entry.user = uuid;
         log_entry.term = cur_term;
         log_entry.op = kLogout;
-        binlogger_->AppendEntry(log_entry);
+        entries.push_back(log_entry);
       }
     }
-    if (single_node_mode_) {  // single node cluster
-      MutexLock lock(&mu_);
-      UpdateCommitIndex(binlogger_->GetLastLogIndex());
+    // 和客户端写请求一样交给log writer批量落盘
+    for (auto& log_entry : entries) {
+      SubmitClientWrite(log_entry, ClientAck());
+    }
+  }
+  {
+    MutexLock lock(&mu_);
+    // 持有者过期，不用等kUnLock提交就可以把锁交给排队的session
+    for (size_t i = 0; i < unlock_keys.size(); i++) {
+      const std::string& uuid = unlock_keys[i].second.uuid;
+      WakeLockWaiters(user_manager_->GetUsernameFromUuid(uuid),
+                      unlock_keys[i].first);
     }
+    ExpireLockWaiters();
   }
   session_checker_.DelayTask(
-      2000, std::bind(&InsNodeImpl::RemoveExpiredSessions, this));
+      FLAGS_session_check_interval,
+      std::bind(&InsNodeImpl::RemoveExpiredSessions, this));
 }
 
 void InsNodeImpl::ParseValue(const std::string& value, LogOperation& op,
@@ -1640,16 +2762,166 @@ void InsNodeImpl::ParseValue(const std::string& value, LogOperation& op,
 }
 
 bool InsNodeImpl::IsExpiredSession(const std::string& session_id) {
-  bool expired_session = false;
+  return !sessions_.Find(session_id, NULL);
+}
+
+bool InsNodeImpl::SessionsValid() {
+  MutexLock lock(&sessions_mu_);
+  return ins_common::timer::get_micros() >= sessions_valid_timestamp_;
+}
+
+void InsNodeImpl::InvalidateSessions() {
+  MutexLock lock(&sessions_mu_);
+  sessions_valid_timestamp_ =
+      std::max(sessions_valid_timestamp_,
+               ins_common::timer::get_micros() + FLAGS_session_expire_timeout);
+}
+
+void InsNodeImpl::CollectSessions(bool full,
+                                  ::galaxy::ins::SessionSyncRequest* request) {
+  request->set_full(full);
+  std::vector<Session> sessions;
+  if (full) {
+    sessions_.Dump(&sessions);
+  } else {
+    sessions_.TakeDirty(&sessions);
+  }
+  // 各节点的时钟不一定一致，只发送距离上次汇报的时间
+  const int64_t now_timestamp = ins_common::timer::get_micros();
+  for (auto it = sessions.begin(); it != sessions.end(); ++it) {
+    ::galaxy::ins::SessionInfo* info = request->add_sessions();
+    info->set_session_id(it->session_id);
+    info->set_uuid(it->uuid);
+    info->set_report_age(now_timestamp - it->last_report_time);
+  }
+  MutexLock lock(&session_locks_mu_);
+  for (int i = 0; i < request->sessions_size(); i++) {
+    ::galaxy::ins::SessionInfo* info = request->mutable_sessions(i);
+    auto it = session_locks_.find(info->session_id());
+    if (it != session_locks_.end()) {
+      for (auto& key : it->second) {
+        info->add_locks(key);
+      }
+    }
+  }
+}
+
+void InsNodeImpl::SyncSessions() {
+  int64_t term = -1;
+  {
+    MutexLock lock(&mu_);
+    if (stop_) {
+      return;
+    }
+    term = (status_ == kLeader) ? current_term_ : -1;
+  }
+  if (term < 0) {
+    // 不是leader时丢弃积累的变化，成为follower之后由新leader同步
+    std::vector<Session> discarded;
+    sessions_.TakeDirty(&discarded);
+  } else {
+    ::galaxy::ins::SessionSyncRequest batch;
+    batch.set_term(term);
+    batch.set_leader_id(self_id_);
+    CollectSessions(false, &batch);
+    if (batch.sessions_size() > 0) {
+      boost::function<void(const ::galaxy::ins::SessionSyncRequest*,
+                           ::galaxy::ins::SessionSyncResponse*, bool, int)>
+          callback;
+      for (auto& server : others_) {
+        std::unique_ptr<galaxy::ins::InsNode_Stub> stub(GetStub(server));
+        auto request = new ::galaxy::ins::SessionSyncRequest(batch);
+        auto response = new ::galaxy::ins::SessionSyncResponse();
+        callback = boost::bind(&InsNodeImpl::SessionSyncCallback, this, _1, _2,
+                               _3, _4, server);
+        rpc_client_.AsyncRequest(stub.get(), &InsNode_Stub::SessionSync,
+                                 request, response, callback, 2, 1);
+      }
+    }
+  }
+  session_checker_.DelayTask(FLAGS_session_sync_interval,
+                             std::bind(&InsNodeImpl::SyncSessions, this));
+}
+
+void InsNodeImpl::SessionSyncCallback(
+    const ::galaxy::ins::SessionSyncRequest* request,
+    ::galaxy::ins::SessionSyncResponse* response, bool failed, int /*error*/,
+    std::string follower_id) {
+  std::unique_ptr<const galaxy::ins::SessionSyncRequest> request_ptr(request);
+  std::unique_ptr<galaxy::ins::SessionSyncResponse> response_ptr(response);
+  if (!failed && response->success()) {
+    return;
+  }
+  // 丢失了一批变化，follower可能错误地认为session已经过期，补发一次全量
+  MutexLock lock(&mu_);
+  LOG(WARNING) << "SessionSync to " << follower_id << " failed";
+  ReplicationWindow& window = replication_window_[follower_id];
+  if (status_ == kLeader && request->term() == current_term_ &&
+      !window.session_dumping) {
+    window.session_dumping = true;
+    session_checker_.AddTask(std::bind(&InsNodeImpl::SendSessionDump, this,
+                                       follower_id, current_term_));
+  }
+}
+
+void InsNodeImpl::SendSessionDump(std::string follower_id, int64_t term) {
+  ::galaxy::ins::SessionSyncRequest request;
+  ::galaxy::ins::SessionSyncResponse response;
+  request.set_term(term);
+  request.set_leader_id(self_id_);
+  CollectSessions(true, &request);
+  LOG(INFO) << "send " << request.sessions_size() << " sessions to "
+            << follower_id;
+  std::unique_ptr<galaxy::ins::InsNode_Stub> stub(GetStub(follower_id));
+  bool ok = rpc_client_.SendRequest(stub.get(), &InsNode_Stub::SessionSync,
+                                    &request, &response, 5, 1);
+  if (!ok || !response.success()) {
+    LOG(WARNING) << "failed to send sessions to " << follower_id;
+  }
+  MutexLock lock(&mu_);
+  replication_window_[follower_id].session_dumping = false;
+}
+
+void InsNodeImpl::SessionSync(::google::protobuf::RpcController* controller,
+                              const ::galaxy::ins::SessionSyncRequest* request,
+                              ::galaxy::ins::SessionSyncResponse* response,
+                              ::google::protobuf::Closure* done) {
+  LOG(INFO) << "recv SessionSync from " << request->leader_id() << ", "
+            << request->sessions_size() << " sessions, full: "
+            << request->full();
+  SampleAccessLog(controller, "SessionSync");
   {
+    MutexLock lock(&mu_);
+    response->set_term(current_term_);
+    if (request->term() < current_term_) {
+      response->set_success(false);
+      done->Run();
+      return;
+    }
+  }
+  const int64_t now_timestamp = ins_common::timer::get_micros();
+  for (int i = 0; i < request->sessions_size(); i++) {
+    const ::galaxy::ins::SessionInfo& info = request->sessions(i);
+    Session session(info.session_id(), info.uuid());
+    session.last_report_time = now_timestamp - info.report_age();
+    sessions_.Merge(session);
+  }
+  if (request->full()) {
     MutexLock lock(&sessions_mu_);
-    SessionIDIndex& id_index = sessions_.get<0>();
-    auto old_it = id_index.find(session_id);
-    if (old_it == sessions_.end()) {
-      expired_session = true;
+    sessions_valid_timestamp_ =
+        std::min(sessions_valid_timestamp_, now_timestamp);
+  }
+  {
+    MutexLock lock(&session_locks_mu_);
+    for (int i = 0; i < request->sessions_size(); i++) {
+      const ::galaxy::ins::SessionInfo& info = request->sessions(i);
+      std::set<std::string>& locks = session_locks_[info.session_id()];
+      locks.clear();
+      locks.insert(info.locks().begin(), info.locks().end());
     }
   }
-  return expired_session;
+  response->set_success(true);
+  done->Run();
 }
 
 bool InsNodeImpl::GetParentKey(const std::string& key,
@@ -1669,13 +2941,14 @@ bool InsNodeImpl::GetParentKey(const std::string& key,
 void InsNodeImpl::TouchParentKey(const std::string& user,
                                  const std::string& key,
                                  const std::string& changed_session,
-                                 const std::string& action) {
+                                 const std::string& action,
+                                 StorageManager::WriteBatch* batch) {
   std::string parent_key;
   if (GetParentKey(key, &parent_key)) {
     std::string type_and_value;
     type_and_value.append(1, kPut);
     type_and_value.append(action + "," + changed_session);
-    data_store_->Put(user, parent_key, type_and_value);
+    batch->Put(user, parent_key, type_and_value);
   }
 }
 
@@ -1832,8 +3105,7 @@ void InsNodeImpl::Watch(::google::protobuf::RpcController* controller,
     RemoveEventBySessionAndKey(watch_event.session_id, watch_event.key);
     watch_events_.insert(watch_event);
   }
-  int64_t tm_now = ins_common::timer::get_micros();
-  if (tm_now - server_start_timestamp_ > FLAGS_session_expire_timeout) {
+  if (SessionsValid()) {
     Status s;
     std::string raw_value;
     s = data_store_->Get(user_manager_->GetUsernameFromUuid(uuid), key,
@@ -1879,6 +3151,15 @@ void InsNodeImpl::UnLock(::google::protobuf::RpcController* controller,
     return;
   }
 
+  // 移交期间不再接受新的写请求，目标节点才能追上
+  if (!transfer_target_.empty()) {
+    LOG(INFO) << "leadership is being transferred, reject unlock";
+    response->set_success(false);
+    response->set_leader_id("");
+    done->Run();
+    return;
+  }
+
   const std::string& uuid = request->uuid();
   if (!uuid.empty() && !user_manager_->IsLoggedIn(uuid)) {
     response->set_success(false);
@@ -1898,16 +3179,10 @@ void InsNodeImpl::UnLock(::google::protobuf::RpcController* controller,
   log_entry.value = session_id;
   log_entry.term = current_term_;
   log_entry.op = kUnLock;
-  binlogger_->AppendEntry(log_entry);
-
-  int64_t cur_index = binlogger_->GetLastLogIndex();
-  ClientAck& ack = client_ack_[cur_index];
+  ClientAck ack;
   ack.done = done;
   ack.unlock_response = response;
-  replication_cond_->Broadcast();
-  if (single_node_mode_) {  // single node cluster
-    UpdateCommitIndex(binlogger_->GetLastLogIndex());
-  }
+  SubmitClientWrite(log_entry, ack);
   return;
 }
 
@@ -1933,6 +3208,15 @@ void InsNodeImpl::Login(::google::protobuf::RpcController* controller,
     return;
   }
 
+  // 移交期间不再接受新的写请求，目标节点才能追上
+  if (!transfer_target_.empty()) {
+    LOG(INFO) << "leadership is being transferred, reject login";
+    response->set_status(kError);
+    response->set_leader_id("");
+    done->Run();
+    return;
+  }
+
   const std::string& username = request->username();
   if (!user_manager_->IsValidUser(username)) {
     response->set_status(kUnknownUser);
@@ -1950,16 +3234,10 @@ void InsNodeImpl::Login(::google::protobuf::RpcController* controller,
   log_entry.value = passwd;
   log_entry.term = current_term_;
   log_entry.op = kLogin;
-  binlogger_->AppendEntry(log_entry);
-
-  int64_t cur_index = binlogger_->GetLastLogIndex();
-  ClientAck& ack = client_ack_[cur_index];
+  ClientAck ack;
   ack.done = done;
   ack.login_response = response;
-  replication_cond_->Broadcast();
-  if (single_node_mode_) {
-    UpdateCommitIndex(binlogger_->GetLastLogIndex());
-  }
+  SubmitClientWrite(log_entry, ack);
   return;
 }
 
@@ -1985,6 +3263,15 @@ void InsNodeImpl::Logout(::google::protobuf::RpcController* controller,
     return;
   }
 
+  // 移交期间不再接受新的写请求，目标节点才能追上
+  if (!transfer_target_.empty()) {
+    LOG(INFO) << "leadership is being transferred, reject logout";
+    response->set_status(kError);
+    response->set_leader_id("");
+    done->Run();
+    return;
+  }
+
   const std::string& uuid = request->uuid();
   if (!uuid.empty() && !user_manager_->IsLoggedIn(uuid)) {
     response->set_status(kUnknownUser);
@@ -1998,16 +3285,10 @@ void InsNodeImpl::Logout(::google::protobuf::RpcController* controller,
   log_entry.user = uuid;
   log_entry.term = current_term_;
   log_entry.op = kLogout;
-  binlogger_->AppendEntry(log_entry);
-
-  int64_t cur_index = binlogger_->GetLastLogIndex();
-  ClientAck& ack = client_ack_[cur_index];
+  ClientAck ack;
   ack.done = done;
   ack.logout_response = response;
-  replication_cond_->Broadcast();
-  if (single_node_mode_) {
-    UpdateCommitIndex(binlogger_->GetLastLogIndex());
-  }
+  SubmitClientWrite(log_entry, ack);
   return;
 }
 
@@ -2031,6 +3312,15 @@ void InsNodeImpl::Register(::google::protobuf::RpcController* controller,
     return;
   }
 
+  // 移交期间不再接受新的写请求，目标节点才能追上
+  if (!transfer_target_.empty()) {
+    LOG(INFO) << "leadership is being transferred, reject register";
+    response->set_status(kError);
+    response->set_leader_id("");
+    done->Run();
+    return;
+  }
+
   const std::string& username = request->username();
   const std::string& password = request->passwd();
   LOG(INFO) << "client wants to register: " << username;
@@ -2039,16 +3329,10 @@ void InsNodeImpl::Register(::google::protobuf::RpcController* controller,
   log_entry.value = password;
   log_entry.term = current_term_;
   log_entry.op = kRegister;
-  binlogger_->AppendEntry(log_entry);
-
-  int64_t cur_index = binlogger_->GetLastLogIndex();
-  ClientAck& ack = client_ack_[cur_index];
+  ClientAck ack;
   ack.done = done;
   ack.register_response = response;
-  replication_cond_->Broadcast();
-  if (single_node_mode_) {
-    UpdateCommitIndex(binlogger_->GetLastLogIndex());
-  }
+  SubmitClientWrite(log_entry, ack);
   return;
 }
 
@@ -2079,6 +3363,154 @@ void InsNodeImpl::CleanBinlog(::google::protobuf::RpcController* /*controller*/,
   done->Run();
 }
 
+void InsNodeImpl::TransferLeader(
+    ::google::protobuf::RpcController* controller,
+    const ::galaxy::ins::TransferLeaderRequest* request,
+    ::galaxy::ins::TransferLeaderResponse* response,
+    ::google::protobuf::Closure* done) {
+  LOG(INFO) << "recv TransferLeader: [" << request->ShortDebugString() << "]";
+  SampleAccessLog(controller, "TransferLeader");
+  MutexLock lock(&mu_);
+  if (status_ != kLeader) {
+    response->set_success(false);
+    response->set_leader_id(status_ == kFollower ? current_leader_ : "");
+    done->Run();
+    return;
+  }
+  const std::string& target_id = request->target_id();
+  if (!transfer_target_.empty() || in_safe_mode_ ||
+      std::find(others_.begin(), others_.end(), target_id) == others_.end()) {
+    LOG(WARNING) << "can't transfer leadership to " << target_id
+                 << ", transferring to: " << transfer_target_
+                 << ", safe mode: " << in_safe_mode_;
+    response->set_success(false);
+    response->set_leader_id(self_id_);
+    done->Run();
+    return;
+  }
+  LOG(INFO) << "start transferring leadership to " << target_id;
+  transfer_target_ = target_id;
+  transfer_deadline_ = ins_common::timer::get_micros() +
+                       FLAGS_transfer_leader_timeout * 1000L;
+  transfer_notified_ = false;
+  transfer_response_ = response;
+  transfer_done_ = done;
+  replication_cond_->Broadcast();
+  leader_crash_checker_.AddTask(
+      std::bind(&InsNodeImpl::CheckLeaderTransfer, this));
+}
+
+void InsNodeImpl::CheckLeaderTransfer() {
+  // 持有log_io_mu_，保证没有正在追加的写请求
+  MutexLock io_lock(&log_io_mu_);
+  MutexLock lock(&mu_);
+  if (transfer_target_.empty()) {
+    return;
+  }
+  if (stop_) {
+    FinishLeaderTransfer(false);
+    return;
+  }
+  const bool timeout = ins_common::timer::get_micros() > transfer_deadline_;
+  if (status_ != kLeader) {
+    // 卸任后等知道了新leader再结束，当选的不一定是目标节点
+    if (!current_leader_.empty() || timeout) {
+      FinishLeaderTransfer(current_leader_ == transfer_target_);
+      return;
+    }
+  } else if (timeout) {
+    LOG(WARNING) << "transfer leadership to " << transfer_target_
+                 << " timeout, continue to serve";
+    FinishLeaderTransfer(false);
+    return;
+  }
+  if (status_ == kLeader && !transfer_notified_ &&
+      match_index_[transfer_target_] >= binlogger_->GetLength() - 1) {
+    LOG(INFO) << transfer_target_ << " has caught up at "
+              << match_index_[transfer_target_] << ", send TimeoutNow";
+    std::unique_ptr<galaxy::ins::InsNode_Stub> stub(GetStub(transfer_target_));
+    auto request = new ::galaxy::ins::TimeoutNowRequest();
+    auto response = new ::galaxy::ins::TimeoutNowResponse();
+    request->set_term(current_term_);
+    request->set_leader_id(self_id_);
+    boost::function<void(const ::galaxy::ins::TimeoutNowRequest*,
+                         ::galaxy::ins::TimeoutNowResponse*, bool, int)>
+        callback = boost::bind(&InsNodeImpl::TimeoutNowCallback, this, _1, _2,
+                               _3, _4);
+    rpc_client_.AsyncRequest(stub.get(), &InsNode_Stub::TimeoutNow, request,
+                             response, callback, 2, 1);
+    transfer_notified_ = true;
+    // 收到TimeoutNow的节点发起的选举不受lease限制，lease从此作废
+    lease_expire_timestamp_ = 0;
+    heartbeat_ack_timestamp_.clear();
+    lease_resume_timestamp_ = std::numeric_limits<int64_t>::max();
+  }
+  // 一直检查到卸任或者超时，目标节点没能当选时恢复写入
+  leader_crash_checker_.DelayTask(
+      5, std::bind(&InsNodeImpl::CheckLeaderTransfer, this));
+}
+
+void InsNodeImpl::TimeoutNowCallback(
+    const ::galaxy::ins::TimeoutNowRequest* request,
+    ::galaxy::ins::TimeoutNowResponse* response, bool failed, int /*error*/) {
+  MutexLock lock(&mu_);
+  std::unique_ptr<const galaxy::ins::TimeoutNowRequest> request_ptr(request);
+  std::unique_ptr<galaxy::ins::TimeoutNowResponse> response_ptr(response);
+  if (transfer_target_.empty() || request->term() != current_term_) {
+    return;
+  }
+  if (failed || !response->success()) {
+    LOG(WARNING) << "TimeoutNow to " << transfer_target_ << " failed";
+    FinishLeaderTransfer(false);
+  }
+}
+
+void InsNodeImpl::FinishLeaderTransfer(bool success) {
+  mu_.AssertHeld();
+  LOG(INFO) << "transfer leadership to " << transfer_target_
+            << (success ? " done" : " failed");
+  if (transfer_notified_) {
+    // 即使TimeoutNow的回复失败，目标节点也可能已经发起了选举，
+    // 等这一轮选举结束后才能用新的心跳确认重建lease
+    lease_expire_timestamp_ = 0;
+    heartbeat_ack_timestamp_.clear();
+    lease_resume_timestamp_ = ins_common::timer::get_micros() +
+                              FLAGS_elect_timeout_max * 1000L;
+  }
+  if (transfer_done_ != NULL) {
+    transfer_response_->set_success(success);
+    transfer_response_->set_leader_id(
+        success ? transfer_target_
+                : (status_ == kLeader ? self_id_ : current_leader_));
+    transfer_done_->Run();
+    transfer_response_ = NULL;
+    transfer_done_ = NULL;
+  }
+  transfer_target_.clear();
+  transfer_notified_ = false;
+}
+
+void InsNodeImpl::TimeoutNow(::google::protobuf::RpcController* controller,
+                             const ::galaxy::ins::TimeoutNowRequest* request,
+                             ::galaxy::ins::TimeoutNowResponse* response,
+                             ::google::protobuf::Closure* done) {
+  LOG(INFO) << "recv TimeoutNow: [" << request->ShortDebugString() << "]";
+  SampleAccessLog(controller, "TimeoutNow");
+  MutexLock lock(&mu_);
+  if (request->term() != current_term_ || status_ == kLeader) {
+    response->set_term(current_term_);
+    response->set_success(false);
+    done->Run();
+    return;
+  }
+  LOG(INFO) << "leader " << request->leader_id()
+            << " hands over leadership, start election now";
+  StartElection(true);
+  response->set_term(current_term_);
+  response->set_success(true);
+  done->Run();
+}
+
 void InsNodeImpl::RpcStat(::google::protobuf::RpcController* /*controller*/,
                           const ::galaxy::ins::RpcStatRequest* request,
                           ::galaxy::ins::RpcStatResponse* response,
@@ -2139,21 +3571,60 @@ void InsNodeImpl::RpcStat(::google::protobuf::RpcController* /*controller*/,
   done->Run();
 }
 
+void InsNodeImpl::ReadIndex(::google::protobuf::RpcController* controller,
+                            const ::galaxy::ins::ReadIndexRequest* request,
+                            ::galaxy::ins::ReadIndexResponse* response,
+                            ::google::protobuf::Closure* done) {
+  SampleAccessLog(controller, "ReadIndex");
+  MutexLock lock(&mu_);
+  if (status_ != kLeader || in_safe_mode_) {
+    LOG(INFO) << "refuse ReadIndex from " << request->follower_id()
+              << ", status: " << NodeStatus_Name(status_)
+              << ", safe mode: " << in_safe_mode_;
+    response->set_success(false);
+    response->set_leader_id(status_ == kFollower ? current_leader_ : "");
+    done->Run();
+    return;
+  }
+  if (members_.size() == 1 || InLeaderLease()) {
+    response->set_success(true);
+    response->set_read_index(commit_index_);
+    response->set_leader_id("");
+    done->Run();
+    return;
+  }
+  // 和本地的Get一起合并到ReadIndex轮次里确认leader身份
+  auto context = std::make_shared<ClientReadAck>();
+  context->index_response = response;
+  context->done = done;
+  pending_reads_.push_back(context);
+  if (!read_batch_inflight_) {
+    StartReadIndexRound();
+  }
+}
+
+// 多数派都已经apply的日志之前再保留一段给落后的follower，更早的日志
+// 不再等最慢的节点，落后太多的follower通过InstallSnapshot追赶
 void InsNodeImpl::GarbageClean() {
   std::vector<std::string> all_members;
   bool is_leader = false;
+  int64_t self_applied_index = -1;
   {
     MutexLock lock(&mu_);
     if (status_ == kLeader) {
       is_leader = true;
     }
+    self_applied_index = last_applied_index_;
     std::copy(members_.begin(), members_.end(),
               std::back_inserter(all_members));
   }
   if (is_leader) {
-    int64_t min_applied_index = std::numeric_limits<int64_t>::max();
-    bool ret_all = true;
+    std::vector<int64_t> applied_indexes;
     for (auto& server : all_members) {
+      if (server == self_id_) {
+        applied_indexes.push_back(self_applied_index);
+        continue;
+      }
       std::unique_ptr<galaxy::ins::InsNode_Stub> stub(GetStub(server));
       ::galaxy::ins::ShowStatusRequest request;
       ::galaxy::ins::ShowStatusResponse response;
@@ -2161,23 +3632,32 @@ void InsNodeImpl::GarbageClean() {
                                         &request, &response, 2, 1);
       if (!ok) {
         LOG(INFO) << "faild to get last_applied_index from " << server;
-        ret_all = false;
-        break;
-      } else {
-        min_applied_index =
-            std::min(min_applied_index, response.last_applied());
+        continue;
       }
-    }
-    if (ret_all) {
-      int64_t safe_clean_index = min_applied_index - 1;
+      applied_indexes.push_back(response.last_applied());
+    }
+    const size_t quorum = all_members.size() / 2 + 1;
+    if (applied_indexes.size() >= quorum) {
+      std::sort(applied_indexes.begin(), applied_indexes.end(),
+                std::greater<int64_t>());
+      int64_t majority_applied_index = applied_indexes[quorum - 1];
+      int64_t safe_clean_index = GetRetainStartIndex(majority_applied_index);
+      if (applied_indexes.size() == all_members.size()) {
+        // 所有节点都在线时不需要为谁保留
+        safe_clean_index =
+            std::max(safe_clean_index, applied_indexes.back() - 1);
+      }
+      // leader发送快照时还要读取自己last applied位置的term
+      safe_clean_index = std::min(safe_clean_index, self_applied_index);
       int64_t old_index;
       {
         MutexLock lock(&mu_);
         old_index = last_safe_clean_index_;
-        last_safe_clean_index_ = safe_clean_index;
+        last_safe_clean_index_ = std::max(old_index, safe_clean_index);
       }
-      if (old_index != safe_clean_index) {
-        LOG(INFO) << "[gc] safe clean index is: " << safe_clean_index;
+      if (safe_clean_index > old_index) {
+        LOG(INFO) << "[gc] safe clean index is: " << safe_clean_index
+                  << ", majority applied index: " << majority_applied_index;
         for (auto& server : all_members) {
           std::unique_ptr<galaxy::ins::InsNode_Stub> stub(GetStub(server));
           ::galaxy::ins::CleanBinlogRequest request;
@@ -2191,13 +3671,333 @@ void InsNodeImpl::GarbageClean() {
           }
         }
       }
-    }  // end-if, got min_applied_index
+    }  // end-if, got applied index from majority
   }    // end-if, this node is leader
 
   binlog_cleaner_.DelayTask(FLAGS_ins_gc_interval * 1000,
                             std::bind(&InsNodeImpl::GarbageClean, this));
 }
 
+// 从applied_index往前保留ins_binlog_retain_entries条或者
+// ins_binlog_retain_size大小的日志，先达到哪个就保留到哪里。
+// 保留窗口内每条日志的大小记在retain_sizes_中，每轮只读取上一轮之后
+// 新apply的日志，而不是把整个窗口重新读一遍
+int64_t InsNodeImpl::GetRetainStartIndex(int64_t applied_index) {
+  const int64_t max_bytes = FLAGS_ins_binlog_retain_size * 1024L * 1024;
+  const int64_t first_index = binlogger_->GetFirstIndex();
+  int64_t end_index = retain_start_index_ + retain_sizes_.size();
+  // 多数派的applied index可能回退(换了一组节点)
+  while (end_index > applied_index && !retain_sizes_.empty()) {
+    retain_bytes_ -= retain_sizes_.back();
+    retain_sizes_.pop_back();
+    end_index--;
+  }
+  if (end_index > applied_index || end_index < first_index ||
+      applied_index - end_index > FLAGS_ins_binlog_retain_entries) {
+    // 第一次统计、安装了快照或者落后太多，窗口从头开始
+    retain_sizes_.clear();
+    retain_bytes_ = 0;
+    end_index = std::max(first_index,
+                         applied_index - FLAGS_ins_binlog_retain_entries);
+    retain_start_index_ = end_index;
+  }
+  for (; end_index < applied_index; end_index++) {
+    LogEntry log_entry;
+    if (!binlogger_->ReadSlot(end_index, &log_entry)) {
+      retain_sizes_.clear();
+      retain_bytes_ = 0;
+      retain_start_index_ = end_index + 1;
+      continue;
+    }
+    int64_t size = log_entry.user.size() + log_entry.key.size() +
+                   log_entry.value.size();
+    retain_sizes_.push_back(size);
+    retain_bytes_ += size;
+  }
+  // 去掉多出来的最老的日志，最老的一条要让保留的大小达到上限
+  while (!retain_sizes_.empty() &&
+         (retain_start_index_ < first_index ||
+          static_cast<int64_t>(retain_sizes_.size()) >
+              FLAGS_ins_binlog_retain_entries ||
+          retain_bytes_ - retain_sizes_.front() >= max_bytes)) {
+    retain_bytes_ -= retain_sizes_.front();
+    retain_sizes_.pop_front();
+    retain_start_index_++;
+  }
+  return retain_sizes_.empty() ? applied_index : retain_start_index_;
+}
+
+// 把数据库在某个apply边界上的快照分块发给follower，发送速度受
+// ins_snapshot_rate_limit限制，避免挤占客户端请求的带宽
+bool InsNodeImpl::SendSnapshot(const std::string& follower_id, int64_t term,
+                               int64_t* snapshot_index) {
+  std::unique_ptr<StorageManager::Snapshot> snapshot(
+      data_store_->NewSnapshot());
+  std::string tag_value;
+  if (snapshot->Get(StorageManager::anonymous_user, tag_last_applied_index,
+                    &tag_value) != kOk) {
+    LOG(WARNING) << "[snapshot] nothing applied, can't send snapshot to "
+                 << follower_id;
+    return false;
+  }
+  const int64_t last_included_index = BinLogger::StringToInt(tag_value);
+  LogEntry last_included_entry;
+  if (!binlogger_->ReadSlot(last_included_index, &last_included_entry)) {
+    LOG(WARNING) << "[snapshot] bad slot [" << last_included_index
+                 << "], can't send snapshot to " << follower_id;
+    return false;
+  }
+  std::vector<UserInfo> users;
+  user_manager_->GetAllUsers(&users);
+  // 登录信息可能比快照新，follower重放之后的kLogin/kLogout结果一样
+  std::map<std::string, std::string> logged_users;
+  user_manager_->GetLoggedUsers(&logged_users);
+  LOG(INFO) << "[snapshot] send snapshot to " << follower_id
+            << ", last included index: " << last_included_index
+            << ", term: " << last_included_entry.term;
+
+  const int64_t start_timestamp = ins_common::timer::get_micros();
+  const int64_t chunk_size = FLAGS_ins_snapshot_chunk_size * 1024L;
+  const std::vector<std::string>& names = snapshot->Names();
+  size_t name_idx = 0;
+  std::unique_ptr<StorageManager::Iterator> it;
+  int64_t chunk_seq = 0;
+  int64_t sent_bytes = 0;
+  bool done = false;
+  std::unique_ptr<galaxy::ins::InsNode_Stub> stub(GetStub(follower_id));
+  while (!done) {
+    ::galaxy::ins::InstallSnapshotRequest request;
+    ::galaxy::ins::InstallSnapshotResponse response;
+    request.set_term(term);
+    request.set_leader_id(self_id_);
+    request.set_last_included_index(last_included_index);
+    request.set_last_included_term(last_included_entry.term);
+    request.set_snapshot_id(start_timestamp);
+    request.set_chunk_seq(chunk_seq);
+    if (chunk_seq == 0) {
+      for (auto& user : users) {
+        request.add_users()->CopyFrom(user);
+      }
+      for (auto& logged : logged_users) {
+        ::galaxy::ins::LoggedUser* user = request.add_logged_users();
+        user->set_uuid(logged.first);
+        user->set_username(logged.second);
+      }
+      request.set_with_logged_users(true);
+    }
+    int64_t chunk_bytes = 0;
+    while (!done && chunk_bytes < chunk_size) {
+      if (!it) {
+        if (name_idx >= names.size()) {
+          done = true;
+          break;
+        }
+        it.reset(snapshot->NewIterator(names[name_idx]));
+        it->Seek("");
+      }
+      if (!it->Valid()) {
+        if (it->status() != kOk) {
+          LOG(WARNING) << "[snapshot] iterate database " << names[name_idx]
+                       << " fail";
+          return false;
+        }
+        it.reset();
+        name_idx++;
+        continue;
+      }
+      ::galaxy::ins::SnapshotItem* item = request.add_items();
+      item->set_user(names[name_idx]);
+      item->set_key(it->key());
+      item->set_value(it->value());
+      chunk_bytes += item->key().size() + item->value().size();
+      it->Next();
+    }
+    request.set_done(done);
+    bool ok = rpc_client_.SendRequest(stub.get(),
+                                      &InsNode_Stub::InstallSnapshot,
+                                      &request, &response, 60, 1);
+    MutexLock lock(&mu_);
+    if (ok && response.term() > current_term_) {
+      TransToFollower("InsNodeImpl::SendSnapshot", response.term());
+    }
+    if (stop_ || status_ != kLeader || current_term_ != term) {
+      LOG(INFO) << "[snapshot] stop sending snapshot, no longger leader";
+      return false;
+    }
+    if (!ok || !response.success()) {
+      LOG(WARNING) << "[snapshot] failed to send chunk " << chunk_seq << " to "
+                   << follower_id;
+      return false;
+    }
+    mu_.Unlock();
+    chunk_seq++;
+    sent_bytes += chunk_bytes;
+    if (FLAGS_ins_snapshot_rate_limit > 0 && !done) {
+      int64_t expect_elapsed =
+          sent_bytes * 1000000L / (FLAGS_ins_snapshot_rate_limit * 1048576L);
+      int64_t elapsed = ins_common::timer::get_micros() - start_timestamp;
+      if (expect_elapsed > elapsed) {
+        ins_common::ThisThread::Sleep((expect_elapsed - elapsed) / 1000);
+      }
+    }
+    mu_.Lock();
+  }
+  LOG(INFO) << "[snapshot] sent snapshot to " << follower_id << ", chunks: "
+            << chunk_seq << ", bytes: " << sent_bytes << ", cost: "
+            << (ins_common::timer::get_micros() - start_timestamp) / 1000
+            << " ms";
+  *snapshot_index = last_included_index;
+  return true;
+}
+
+void InsNodeImpl::InstallSnapshot(
+    ::google::protobuf::RpcController* controller,
+    const ::galaxy::ins::InstallSnapshotRequest* request,
+    ::galaxy::ins::InstallSnapshotResponse* response,
+    ::google::protobuf::Closure* done) {
+  SampleAccessLog(controller, "InstallSnapshot");
+  // 和带entries的AppendEntries在同一个线程中按到达顺序处理
+  follower_appender_.AddTask(std::bind(&InsNodeImpl::DoInstallSnapshot, this,
+                                       request, response, done));
+}
+
+void InsNodeImpl::DoInstallSnapshot(
+    const ::galaxy::ins::InstallSnapshotRequest* request,
+    ::galaxy::ins::InstallSnapshotResponse* response,
+    ::google::protobuf::Closure* done) {
+  LOG(INFO) << "recv InstallSnapshot, id: " << request->snapshot_id()
+            << ", chunk: " << request->chunk_seq()
+            << ", items: " << request->items_size()
+            << ", done: " << request->done();
+  {
+    MutexLock lock(&mu_);
+    if (request->term() < current_term_) {
+      LOG(INFO) << "[InstallSnapshot] term is outdated";
+      response->set_term(current_term_);
+      response->set_success(false);
+      done->Run();
+      return;
+    }
+    if (status_ != kFollower) {
+      LOG(INFO) << "Update current status from " << NodeStatus_Name(status_)
+                << " to " << NodeStatus_Name(kFollower);
+      StepDown();
+    }
+    if (request->term() > current_term_) {
+      LOG(INFO) << "Update current term from " << current_term_ << " to "
+                << request->term();
+      current_term_ = request->term();
+      verified_log_index_ = -1;
+      meta_->WriteCurrentTerm(request->term());
+    }
+    current_leader_ = request->leader_id();
+    leader_contact_timestamp_ = ins_common::timer::get_micros();
+    ++heartbeat_count_;
+    response->set_term(current_term_);
+  }
+
+  if (request->chunk_seq() == 0) {
+    // 新的一次传输，丢弃之前没有完成的
+    delete snapshot_store_;
+    StorageManager::DestroyDatabases(snapshot_dir_);
+    snapshot_store_ = new StorageManager(snapshot_dir_);
+    snapshot_id_ = request->snapshot_id();
+    snapshot_next_chunk_ = 0;
+    snapshot_users_.assign(request->users().begin(), request->users().end());
+    snapshot_logged_users_.clear();
+    for (int i = 0; i < request->logged_users_size(); i++) {
+      const ::galaxy::ins::LoggedUser& user = request->logged_users(i);
+      snapshot_logged_users_[user.uuid()] = user.username();
+    }
+    snapshot_with_logged_users_ = request->with_logged_users();
+  }
+  if (snapshot_store_ == NULL || request->snapshot_id() != snapshot_id_ ||
+      request->chunk_seq() != snapshot_next_chunk_) {
+    LOG(WARNING) << "[InstallSnapshot] unexpected chunk " << request->chunk_seq()
+                 << " of " << request->snapshot_id() << ", expect "
+                 << snapshot_next_chunk_ << " of " << snapshot_id_;
+    response->set_success(false);
+    done->Run();
+    return;
+  }
+  StorageManager::WriteBatch batch;
+  for (int i = 0; i < request->items_size(); i++) {
+    const ::galaxy::ins::SnapshotItem& item = request->items(i);
+    batch.Put(item.user(), item.key(), item.value());
+  }
+  bool ok = (snapshot_store_->Write(&batch) == kOk);
+  snapshot_next_chunk_++;
+  if (ok && request->done()) {
+    delete snapshot_store_;
+    snapshot_store_ = NULL;
+    ok = ApplySnapshot(request);
+    StorageManager::DestroyDatabases(snapshot_dir_);
+  }
+  response->set_success(ok);
+  done->Run();
+}
+
+// 用接收完成的快照替换本地数据；快照最后一条日志和本地日志一致时保留
+// 之后的日志，否则清空binlog
+bool InsNodeImpl::ApplySnapshot(
+    const ::galaxy::ins::InstallSnapshotRequest* request) {
+  const int64_t snapshot_index = request->last_included_index();
+  const int64_t snapshot_term = request->last_included_term();
+  MutexLock apply_lock(&apply_mu_);
+  MutexLock io_lock(&log_io_mu_);
+  {
+    MutexLock lock(&mu_);
+    if (request->term() != current_term_) {
+      LOG(INFO) << "[InstallSnapshot] term changed, drop snapshot";
+      return false;
+    }
+    if (snapshot_index <= last_applied_index_) {
+      LOG(INFO) << "[InstallSnapshot] snapshot " << snapshot_index
+                << " is older than last_applied_index: "
+                << last_applied_index_;
+      return true;
+    }
+  }
+  if (!data_store_->Restore(snapshot_dir_)) {
+    LOG(FATAL) << "[InstallSnapshot] failed to restore data from "
+               << snapshot_dir_;
+  }
+  if (!user_manager_->ResetUsers(snapshot_users_,
+                                 snapshot_with_logged_users_
+                                     ? &snapshot_logged_users_
+                                     : NULL)) {
+    LOG(FATAL) << "[InstallSnapshot] failed to restore users";
+  }
+  snapshot_users_.clear();
+  snapshot_logged_users_.clear();
+  LogEntry log_entry;
+  bool keep_log = binlogger_->GetLength() > snapshot_index &&
+                  binlogger_->ReadSlot(snapshot_index, &log_entry) &&
+                  log_entry.term == snapshot_term;
+  if (!keep_log) {
+    binlogger_->Reset(snapshot_index, snapshot_term);
+  }
+
+  std::vector<std::shared_ptr<ClientReadAck> > ready_reads;
+  {
+    MutexLock lock(&mu_);
+    last_applied_index_ = snapshot_index;
+    commit_index_ = std::max(commit_index_, snapshot_index);
+    if (!keep_log) {
+      verified_log_index_ = -1;
+    }
+    if (request->term() == current_term_) {
+      verified_log_index_ = std::max(verified_log_index_, snapshot_index);
+    }
+    CollectAppliedReads(&ready_reads);
+  }
+  ReplyReads(ready_reads, true);
+  LOG(INFO) << "[InstallSnapshot] installed snapshot, last included index: "
+            << snapshot_index << ", term: " << snapshot_term
+            << ", keep log: " << keep_log;
+  return true;
+}
+
 void InsNodeImpl::SampleAccessLog(
     const ::google::protobuf::RpcController* controller, const char* action) {
   const sofa::pbrpc::RpcController* sofa_controller =
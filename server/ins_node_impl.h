@@ -8,17 +8,21 @@
 #include <boost/multi_index/member.hpp>
 #include <boost/multi_index/ordered_index.hpp>
 #include <boost/multi_index_container.hpp>
+#include <deque>
 #include <memory>
 #include <map>
 #include <unordered_map>
 #include <set>
 #include <string>
 #include <vector>
+#include "common/mpsc_queue.h"
 #include "common/mutex.h"
 #include "common/thread_pool.h"
 #include "rpc/rpc_client.h"
 #include "server/performance_center.h"
+#include "server/session_table.h"
 #include "server/user_manage.h"
+#include "storage/binlog.h"
 #include "storage/storage_manage.h"
 
 using namespace boost::multi_index;
@@ -27,7 +31,6 @@ namespace galaxy {
 namespace ins {
 
 class Meta;
-class BinLogger;
 
 struct ClientAck {
   galaxy::ins::PutResponse* response;
@@ -49,41 +52,92 @@ struct ClientAck {
         done(NULL) {}
 };
 
+// 阻塞在Lock上的请求，每个key按到达顺序排队
+struct LockWaiter {
+  std::string user;
+  std::string key;
+  std::string session_id;
+  galaxy::ins::LockResponse* response;
+  google::protobuf::Closure* done;
+  int64_t deadline;
+  LockWaiter() : response(NULL), done(NULL), deadline(0) {}
+};
+
+// 排队等待log writer批量落盘的写请求，ack.done为NULL表示内部日志
+struct PendingWrite {
+  LogEntry log_entry;
+  ClientAck ack;
+};
+
 struct ClientReadAck {
   const galaxy::ins::GetRequest* request;
   galaxy::ins::GetResponse* response;
+  const galaxy::ins::ScanRequest* scan_request;
+  galaxy::ins::ScanResponse* scan_response;
+  galaxy::ins::ReadIndexResponse* index_response;
   google::protobuf::Closure* done;
-  uint32_t succ_count;
-  uint32_t err_count;
-  bool triggered;
+  std::string leader_id;  // set when served by a follower
   ClientReadAck()
       : request(NULL),
         response(NULL),
-        done(NULL),
-        succ_count(0),
-        err_count(0),
-        triggered(false) {}
+        scan_request(NULL),
+        scan_response(NULL),
+        index_response(NULL),
+        done(NULL) {}
 };
 
-struct Session {
-  std::string session_id;
-  std::string uuid;
-  int64_t last_report_time;
-  Session() : last_report_time(0) {}
-  Session(const std::string& sid, const std::string& uid)
-      : session_id(sid), uuid(uid), last_report_time(0) {}
+// 一轮读确认(ReadIndex)，期间到达的读请求合并到下一轮
+struct ReadIndexBatch {
+  int64_t read_index;
+  uint32_t succ_count;
+  uint32_t err_count;
+  bool triggered;
+  std::vector<std::shared_ptr<ClientReadAck> > reads;
+  ReadIndexBatch()
+      : read_index(-1), succ_count(0), err_count(0), triggered(false) {}
 };
 
-typedef multi_index_container<
-    Session,
-    indexed_by<
-        hashed_unique<member<Session, std::string, &Session::session_id> >,
-        ordered_non_unique<
-            member<Session, int64_t, &Session::last_report_time> > > >
-    SessionContainer;
+// 每个follower的复制窗口，记录在途的AppendEntries请求
+struct ReplicationWindow {
+  int32_t inflight;         // number of outstanding AppendEntries
+  int64_t seq;              // bumped on rollback, stale responses are ignored
+  int64_t retry_timestamp;  // do not send before this time (micros)
+  int64_t batch_limit;      // adaptive max entries per batch
+  int64_t rtt_micros;       // smoothed AppendEntries rtt, 0 if no sample
+  int64_t credit_limit;     // follower accepts entries below it, -1 unknown
+  int64_t stall_timestamp;  // when we started waiting for credit, 0 if not
+  int64_t stall_micros;     // total time spent waiting for credit
+  bool accept_compressed;   // follower understands compressed_entries
+  bool accept_raw;          // follower understands raw_entries
+  int64_t compress_failed_term;  // follower failed to decode a batch
+  bool session_dumping;     // a full session dump is on its way
+  int64_t send_timestamp;     // last AppendEntries of any kind (micros)
+  int64_t sent_commit_index;  // leader commit index carried by it
+  ReplicationWindow()
+      : inflight(0),
+        seq(0),
+        retry_timestamp(0),
+        batch_limit(1),
+        rtt_micros(0),
+        credit_limit(-1),
+        stall_timestamp(0),
+        stall_micros(0),
+        accept_compressed(false),
+        accept_raw(false),
+        compress_failed_term(-1),
+        session_dumping(false),
+        send_timestamp(0),
+        sent_commit_index(-1) {}
+};
 
-typedef SessionContainer::nth_index<0>::type SessionIDIndex;
-typedef SessionContainer::nth_index<1>::type SessionTimeIndex;
+// 从binlog读出的一段编码好的日志，位置相同的follower共享同一份
+struct ReplicationBatch {
+  int64_t start_index;
+  std::vector<std::string> raw_entries;
+  std::vector<int64_t> terms;  // term of each raw entry
+  bool over_size;              // cut short by log_rep_batch_size
+  ReplicationBatch() : start_index(-1), over_size(false) {}
+};
 
 struct WatchAck {
   WatchResponse* response;
@@ -182,6 +236,26 @@ class InsNodeImpl : public InsNode {
                const ::galaxy::ins::RpcStatRequest* request,
                ::galaxy::ins::RpcStatResponse* response,
                ::google::protobuf::Closure* done);
+  void ReadIndex(::google::protobuf::RpcController* controller,
+                 const ::galaxy::ins::ReadIndexRequest* request,
+                 ::galaxy::ins::ReadIndexResponse* response,
+                 ::google::protobuf::Closure* done);
+  void InstallSnapshot(::google::protobuf::RpcController* controller,
+                       const ::galaxy::ins::InstallSnapshotRequest* request,
+                       ::galaxy::ins::InstallSnapshotResponse* response,
+                       ::google::protobuf::Closure* done);
+  void TransferLeader(::google::protobuf::RpcController* controller,
+                      const ::galaxy::ins::TransferLeaderRequest* request,
+                      ::galaxy::ins::TransferLeaderResponse* response,
+                      ::google::protobuf::Closure* done);
+  void TimeoutNow(::google::protobuf::RpcController* controller,
+                  const ::galaxy::ins::TimeoutNowRequest* request,
+                  ::galaxy::ins::TimeoutNowResponse* response,
+                  ::google::protobuf::Closure* done);
+  void SessionSync(::google::protobuf::RpcController* controller,
+                   const ::galaxy::ins::SessionSyncRequest* request,
+                   ::galaxy::ins::SessionSyncResponse* response,
+                   ::google::protobuf::Closure* done);
 
  private:
   void Init();
@@ -197,32 +271,93 @@ class InsNodeImpl : public InsNode {
   void VoteCallback(const ::galaxy::ins::VoteRequest* request,
                     ::galaxy::ins::VoteResponse* response, bool failed,
                     int error);
+  void PreVoteCallback(const ::galaxy::ins::VoteRequest* request,
+                       ::galaxy::ins::VoteResponse* response, bool failed,
+                       int error);
   void HeartbeatCallback(const ::galaxy::ins::AppendEntriesRequest* request,
                          ::galaxy::ins::AppendEntriesResponse* response,
-                         bool failed, int error);
+                         bool failed, int error, std::string follower_id,
+                         int64_t send_timestamp);
   void HeartbeatForReadCallback(
       const ::galaxy::ins::AppendEntriesRequest* request,
       ::galaxy::ins::AppendEntriesResponse* response, bool failed, int error,
-      std::shared_ptr<ClientReadAck> context);
-  void ForwardKeepAliveCallback(const ::galaxy::ins::KeepAliveRequest* request,
-                                ::galaxy::ins::KeepAliveResponse* response,
-                                bool failed, int error);
+      std::shared_ptr<ReadIndexBatch> batch);
+  void ReadIndexCallback(const ::galaxy::ins::ReadIndexRequest* request,
+                         ::galaxy::ins::ReadIndexResponse* response,
+                         bool failed, int error,
+                         std::shared_ptr<ReadIndexBatch> batch);
+  void ReplicateLogCallback(const ::galaxy::ins::AppendEntriesRequest* request,
+                            ::galaxy::ins::AppendEntriesResponse* response,
+                            bool failed, int error, std::string follower_id,
+                            int64_t seq, int64_t max_term,
+                            int64_t send_timestamp);
+  void SessionSyncCallback(const ::galaxy::ins::SessionSyncRequest* request,
+                           ::galaxy::ins::SessionSyncResponse* response,
+                           bool failed, int error, std::string follower_id);
 
   void BroadCastHeartbeat();
+  void StartReadIndexRound();
+  bool CanServeFollowerRead();
+  void FinishReadIndexRound(std::shared_ptr<ReadIndexBatch> batch,
+                            bool confirmed,
+                            std::vector<std::shared_ptr<ClientReadAck> >* ready);
+  void CollectAppliedReads(std::vector<std::shared_ptr<ClientReadAck> >* reads);
+  void ReplyReads(const std::vector<std::shared_ptr<ClientReadAck> >& reads,
+                  bool success);
+  void ReadFromStore(const ::galaxy::ins::GetRequest* request,
+                     ::galaxy::ins::GetResponse* response);
+  void ScanFromStore(const ::galaxy::ins::ScanRequest* request,
+                     ::galaxy::ins::ScanResponse* response);
+  void ExtendLeaderLease(const std::string& follower_id,
+                         int64_t send_timestamp);
+  bool InLeaderLease();
+  void SetFollowerProgress(::galaxy::ins::AppendEntriesResponse* response);
+  void UpdateFollowerProgress(
+      const std::string& follower_id,
+      const ::galaxy::ins::AppendEntriesResponse* response);
+  void SubmitClientWrite(const LogEntry& log_entry, const ClientAck& ack);
+  void LogWriterLoop();
+  void FailClientAck(ClientAck& ack);
   void CheckLeaderCrash();
   void TryToBeLeader();
+  void StartPreVote();
+  void StartElection(bool leader_transfer);
+  void CheckLeaderTransfer();
+  void FinishLeaderTransfer(bool success);
+  void TimeoutNowCallback(const ::galaxy::ins::TimeoutNowRequest* request,
+                          ::galaxy::ins::TimeoutNowResponse* response,
+                          bool failed, int error);
+  void PreVote(const ::galaxy::ins::VoteRequest* request,
+               ::galaxy::ins::VoteResponse* response);
   int32_t GetRandomTimeout();
   void TransToFollower(const char* msg, int64_t new_term);
+  void StepDown();
   void ReplicateLog(std::string follower_id);
   void StartReplicateLog();
+  bool ReplicateSnapshot(const std::string& follower_id, int64_t term);
+  void AdjustBatchLimit(ReplicationWindow* window, int64_t batch_span,
+                        int64_t rtt_micros);
+  std::shared_ptr<const ReplicationBatch> FindReplicationBatch(
+      int64_t start_index, int64_t length);
+  void CacheReplicationBatch(
+      const std::shared_ptr<const ReplicationBatch>& batch);
   void GetLastLogIndexAndTerm(int64_t* last_log_index, int64_t* last_log_term);
-  void UpdateCommitIndex(int64_t a_index);
+  void UpdateCommitIndex();
+  void SyncBinlog();
   void CommitIndexObserv();
+  void ReplyClientAck(ClientAck& ack, Status log_status,
+                      const std::string& new_uuid);
   void TransToLeader();
   void RemoveExpiredSessions();
   void ParseValue(const std::string& value, LogOperation& op,
                   std::string& real_value);
   bool IsExpiredSession(const std::string& session_id);
+  // session表完整时才能判断lock的持有者是否已经过期
+  bool SessionsValid();
+  void InvalidateSessions();
+  void CollectSessions(bool full, ::galaxy::ins::SessionSyncRequest* request);
+  void SyncSessions();
+  void SendSessionDump(std::string follower_id, int64_t term);
   std::string BindKeyAndUser(const std::string& user, const std::string& key);
   std::string GetKeyFromEvent(const std::string& event_key);
   void RemoveEventBySession(const std::string& session_id);
@@ -238,16 +373,30 @@ class InsNodeImpl : public InsNode {
   void DelBinlog(int64_t index);
   bool LockIsAvailable(const std::string& user, const std::string& key,
                        const std::string& session_id);
-  void ForwardKeepAlive(const ::galaxy::ins::KeepAliveRequest* request,
-                        ::galaxy::ins::KeepAliveResponse* response);
+  void GrantLock(const std::string& user, const std::string& key,
+                 const std::string& session_id,
+                 ::galaxy::ins::LockResponse* response,
+                 ::google::protobuf::Closure* done);
+  // 锁被释放后按顺序把锁交给排队的请求
+  void WakeLockWaiters(const std::string& user, const std::string& key);
+  void ExpireLockWaiters();
+  void FailLockWaiters();
   void GarbageClean();
+  int64_t GetRetainStartIndex(int64_t applied_index);
+  bool SendSnapshot(const std::string& follower_id, int64_t term,
+                    int64_t* snapshot_index);
+  void DoInstallSnapshot(const ::galaxy::ins::InstallSnapshotRequest* request,
+                         ::galaxy::ins::InstallSnapshotResponse* response,
+                         ::google::protobuf::Closure* done);
+  bool ApplySnapshot(const ::galaxy::ins::InstallSnapshotRequest* request);
   void DoAppendEntries(const ::galaxy::ins::AppendEntriesRequest* request,
                        ::galaxy::ins::AppendEntriesResponse* response,
                        ::google::protobuf::Closure* done);
   bool GetParentKey(const std::string& key, std::string* parent_key);
   void TouchParentKey(const std::string& user, const std::string& key,
                       const std::string& changed_session,
-                      const std::string& action);
+                      const std::string& action,
+                      StorageManager::WriteBatch* batch);
   void SampleAccessLog(const ::google::protobuf::RpcController* controller,
                        const char* action);
 
@@ -261,6 +410,8 @@ class InsNodeImpl : public InsNode {
   int64_t current_term_;
   std::map<int64_t, std::string> voted_for_;
   std::map<int64_t, uint32_t> vote_grant_;
+  int64_t pre_vote_term_;  // term of the ongoing PreVote round, -1 if none
+  uint32_t pre_vote_grant_;
   std::vector<galaxy::ins::Entry> binlog_;
   galaxy::ins::RpcClient rpc_client_;
   NodeStatus status_;
@@ -280,29 +431,78 @@ class InsNodeImpl : public InsNode {
   ThreadPool committer_;
   std::map<std::string, int64_t> next_index_;
   std::map<std::string, int64_t> match_index_;
+  std::map<std::string, ReplicationWindow> replication_window_;
+  // keyed by (start index, length)
+  std::map<std::pair<int64_t, int64_t>,
+           std::shared_ptr<const ReplicationBatch> > replication_batches_;
   CondVar* replication_cond_;
   std::unordered_map<int64_t, ClientAck> client_ack_;
+  MpscQueue<PendingWrite> write_queue_;
+  Mutex write_mu_;       // only for sleeping/waking the log writer
+  CondVar* write_cond_;
+  bool writer_stop_;
+  Mutex log_io_mu_;      // serializes binlog appends, taken before mu_
+  ThreadPool log_writer_;
+  ThreadPool binlog_syncer_;
   std::set<std::string> replicating_;
   int64_t heartbeat_read_timestamp_;
+  std::shared_ptr<ReadIndexBatch> read_batch_inflight_;
+  std::vector<std::shared_ptr<ClientReadAck> > pending_reads_;
+  std::multimap<int64_t, std::shared_ptr<ClientReadAck> > read_waiters_;
+  std::map<std::string, int64_t> heartbeat_ack_timestamp_;
+  int64_t lease_expire_timestamp_;
+  // 发送时间早于它的心跳确认不能用来延长lease，TimeoutNow之后对端可能
+  // 绕过lease检查投票，移交结束后要等这轮选举结束才重建lease
+  int64_t lease_resume_timestamp_;
+  // leader移交期间不接受写请求，也不使用lease
+  std::string transfer_target_;
+  int64_t transfer_deadline_;
+  bool transfer_notified_;  // TimeoutNow has been sent
+  ::galaxy::ins::TransferLeaderResponse* transfer_response_;
+  ::google::protobuf::Closure* transfer_done_;
   bool in_safe_mode_;
   int64_t server_start_timestamp_;
   ThreadPool event_trigger_;
 
   // for all servers
-  SessionContainer sessions_;
+  SessionTable sessions_;
   Mutex sessions_mu_;
+  // session表从这个时刻起是完整的，由sessions_mu_保护
+  int64_t sessions_valid_timestamp_;
   ThreadPool session_checker_;
   int64_t commit_index_;
   int64_t last_applied_index_;
   CondVar* commit_cond_;
+  Mutex apply_mu_;  // applying entries or a snapshot, taken before log_io_mu_
+  // 正在接收的快照，只在follower_appender_线程中访问
+  StorageManager* snapshot_store_;
+  std::string snapshot_dir_;
+  int64_t snapshot_id_;
+  int64_t snapshot_next_chunk_;
+  std::vector<UserInfo> snapshot_users_;
+  std::map<std::string, std::string> snapshot_logged_users_;
+  bool snapshot_with_logged_users_;
   WatchEventContainer watch_events_;
   Mutex watch_mu_;
   std::unordered_map<std::string, std::set<std::string> > session_locks_;
   Mutex session_locks_mu_;
+  // user::key -> 等待的Lock请求，只在leader上有，由mu_保护
+  std::map<std::string, std::deque<LockWaiter> > lock_waiters_;
   ThreadPool binlog_cleaner_;
   ThreadPool follower_worker_;
+  ThreadPool follower_appender_;
+  int64_t verified_log_index_;
+  int64_t leader_contact_timestamp_;
+  // 最近一次确认session表是最新的时间：收到leader的消息或者自己是leader
+  int64_t session_contact_timestamp_;
   bool single_node_mode_;
   int64_t last_safe_clean_index_;
+  // GetRetainStartIndex统计的保留窗口中每条日志的大小，覆盖
+  // [retain_start_index_, retain_start_index_ + retain_sizes_.size())，
+  // 只在binlog_cleaner_线程中访问
+  int64_t retain_start_index_;
+  std::deque<int64_t> retain_sizes_;
+  int64_t retain_bytes_;
   PerformanceCenter perform_;
 };
 
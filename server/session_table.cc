@@ -0,0 +1,125 @@
+#include "server/session_table.h"
+#include <functional>
+#include "common/timer.h"
+
+namespace galaxy {
+namespace ins {
+
+SessionTable::SessionTable(int64_t expire_timeout, int64_t tick)
+    : expire_timeout_(expire_timeout),
+      wheel_(tick, ins_common::timer::get_micros()) {}
+
+SessionTable::~SessionTable() {}
+
+SessionTable::Shard* SessionTable::GetShard(const std::string& session_id) {
+  return &shards_[std::hash<std::string>()(session_id) % kShardNum];
+}
+
+void SessionTable::Refresh(const Session& session, bool mark_dirty) {
+  Upsert(session, false, mark_dirty);
+}
+
+void SessionTable::Merge(const Session& session) {
+  Upsert(session, true, false);
+}
+
+void SessionTable::Upsert(const Session& session, bool newer_only,
+                          bool mark_dirty) {
+  Shard* shard = GetShard(session.session_id);
+  {
+    MutexLock lock(&shard->mu);
+    if (mark_dirty) {
+      shard->dirty.insert(session.session_id);
+    }
+    auto it = shard->sessions.find(session.session_id);
+    if (it != shard->sessions.end()) {
+      // 时间轮里已经有这个session，到期时会重新检查
+      if (!newer_only ||
+          it->second.last_report_time < session.last_report_time) {
+        it->second = session;
+      }
+      return;
+    }
+    shard->sessions[session.session_id] = session;
+  }
+  MutexLock lock(&wheel_mu_);
+  wheel_.Add(session.session_id, session.last_report_time + expire_timeout_);
+}
+
+bool SessionTable::Find(const std::string& session_id, Session* session) {
+  Shard* shard = GetShard(session_id);
+  MutexLock lock(&shard->mu);
+  auto it = shard->sessions.find(session_id);
+  if (it == shard->sessions.end()) {
+    return false;
+  }
+  if (session) {
+    *session = it->second;
+  }
+  return true;
+}
+
+void SessionTable::Dump(std::vector<Session>* sessions) {
+  for (int i = 0; i < kShardNum; i++) {
+    MutexLock lock(&shards_[i].mu);
+    for (auto& item : shards_[i].sessions) {
+      sessions->push_back(item.second);
+    }
+  }
+}
+
+void SessionTable::TakeDirty(std::vector<Session>* sessions) {
+  for (int i = 0; i < kShardNum; i++) {
+    MutexLock lock(&shards_[i].mu);
+    for (auto& session_id : shards_[i].dirty) {
+      auto it = shards_[i].sessions.find(session_id);
+      if (it != shards_[i].sessions.end()) {  // not expired yet
+        sessions->push_back(it->second);
+      }
+    }
+    shards_[i].dirty.clear();
+  }
+}
+
+void SessionTable::RemoveExpired(int64_t now, std::vector<Session>* expired) {
+  std::vector<std::string> due;
+  {
+    MutexLock lock(&wheel_mu_);
+    wheel_.Advance(now, &due);
+  }
+  if (due.empty()) {
+    return;
+  }
+  std::vector<std::pair<std::string, int64_t> > renewed;
+  for (size_t i = 0; i < due.size(); i++) {
+    Shard* shard = GetShard(due[i]);
+    MutexLock lock(&shard->mu);
+    auto it = shard->sessions.find(due[i]);
+    if (it == shard->sessions.end()) {
+      continue;
+    }
+    int64_t deadline = it->second.last_report_time + expire_timeout_;
+    if (deadline <= now) {
+      expired->push_back(it->second);
+      shard->sessions.erase(it);
+    } else {
+      renewed.push_back(std::make_pair(due[i], deadline));
+    }
+  }
+  MutexLock lock(&wheel_mu_);
+  for (size_t i = 0; i < renewed.size(); i++) {
+    wheel_.Add(renewed[i].first, renewed[i].second);
+  }
+}
+
+int64_t SessionTable::Size() {
+  int64_t size = 0;
+  for (int i = 0; i < kShardNum; i++) {
+    MutexLock lock(&shards_[i].mu);
+    size += shards_[i].sessions.size();
+  }
+  return size;
+}
+
+}  // namespace ins
+}  // namespace galaxy
@@ -0,0 +1,68 @@
+#ifndef _GALAXY_INS_SESSION_TABLE_H_
+#define _GALAXY_INS_SESSION_TABLE_H_
+
+#include <stdint.h>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "common/mutex.h"
+#include "common/timer_wheel.h"
+
+namespace galaxy {
+namespace ins {
+
+struct Session {
+  std::string session_id;
+  std::string uuid;
+  int64_t last_report_time;
+  Session() : last_report_time(0) {}
+  Session(const std::string& sid, const std::string& uid)
+      : session_id(sid), uuid(uid), last_report_time(0) {}
+};
+
+// 按session_id分片的session表，刷新已有session只锁一个分片；
+// 过期时间由时间轮管理，每个session在时间轮里只有一项，到期时
+// 再检查last_report_time，被刷新过的重新放回时间轮
+class SessionTable {
+ public:
+  // expire_timeout和tick的单位都是微秒
+  SessionTable(int64_t expire_timeout, int64_t tick);
+  ~SessionTable();
+
+  // KeepAlive，mark_dirty表示需要同步给follower
+  void Refresh(const Session& session, bool mark_dirty);
+  // SessionSync，只接受更新的汇报时间
+  void Merge(const Session& session);
+  bool Find(const std::string& session_id, Session* session);
+  void Dump(std::vector<Session>* sessions);
+  // 取出并清空自上次调用以来被标记的session
+  void TakeDirty(std::vector<Session>* sessions);
+  // 把now时已经过期的session从表中删除并返回
+  void RemoveExpired(int64_t now, std::vector<Session>* expired);
+  int64_t Size();
+
+ private:
+  struct Shard {
+    Mutex mu;
+    std::unordered_map<std::string, Session> sessions;
+    std::set<std::string> dirty;
+  };
+
+  Shard* GetShard(const std::string& session_id);
+  void Upsert(const Session& session, bool newer_only, bool mark_dirty);
+
+  static const int kShardNum = 64;
+  int64_t expire_timeout_;
+  Shard shards_[kShardNum];
+  Mutex wheel_mu_;
+  TimerWheel<std::string> wheel_;
+
+  SessionTable(const SessionTable&);
+  void operator=(const SessionTable&);
+};
+
+}  // namespace ins
+}  // namespace galaxy
+
+#endif
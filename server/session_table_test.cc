@@ -0,0 +1,90 @@
+#include "server/session_table.h"
+#include <gtest/gtest.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include "common/timer.h"
+#include "common/timer_wheel.h"
+
+using namespace galaxy::ins;
+
+TEST(TimerWheelTest, AdvanceAcrossLevels) {
+  TimerWheel<int> wheel(1, 0);
+  // 覆盖每一层，以及超出最高层范围的定时器
+  const int64_t deadlines[] = {1, 63, 64, 65, 4095, 4096, 300000, 20000000};
+  const int count = sizeof(deadlines) / sizeof(deadlines[0]);
+  for (int i = 0; i < count; i++) {
+    wheel.Add(i, deadlines[i]);
+  }
+  EXPECT_EQ(wheel.Size(), count);
+  std::vector<int> due;
+  wheel.Advance(0, &due);
+  EXPECT_TRUE(due.empty());
+  for (int i = 0; i < count - 1; i++) {
+    wheel.Advance(deadlines[i] - 1, &due);
+    EXPECT_EQ(due.size(), static_cast<size_t>(i));
+    wheel.Advance(deadlines[i], &due);
+    ASSERT_EQ(due.size(), static_cast<size_t>(i + 1));
+    EXPECT_EQ(due.back(), i);
+  }
+  // 超出范围的提前返回，但不会早于最高层的跨度
+  wheel.Advance(20000000, &due);
+  EXPECT_EQ(due.size(), static_cast<size_t>(count));
+  EXPECT_EQ(wheel.Size(), 0);
+  // 已经过期的在下一个tick返回
+  due.clear();
+  wheel.Add(100, 5);
+  wheel.Advance(20000001, &due);
+  ASSERT_EQ(due.size(), 1u);
+  EXPECT_EQ(due[0], 100);
+}
+
+TEST(SessionTableTest, RefreshAndExpire) {
+  const int64_t timeout = 1000000;
+  SessionTable table(timeout, 100000);
+  int64_t now = ins_common::timer::get_micros();
+  Session s1("s1", "u1");
+  s1.last_report_time = now;
+  Session s2("s2", "u2");
+  s2.last_report_time = now;
+  table.Refresh(s1, true);
+  table.Refresh(s2, false);
+  EXPECT_EQ(table.Size(), 2);
+
+  std::vector<Session> dirty;
+  table.TakeDirty(&dirty);
+  ASSERT_EQ(dirty.size(), 1u);
+  EXPECT_EQ(dirty[0].session_id, "s1");
+  dirty.clear();
+  table.TakeDirty(&dirty);
+  EXPECT_TRUE(dirty.empty());
+
+  // s1刷新过，到期时重新放回时间轮
+  s1.last_report_time = now + timeout / 2;
+  table.Refresh(s1, false);
+  std::vector<Session> expired;
+  table.RemoveExpired(now + timeout + 200000, &expired);
+  ASSERT_EQ(expired.size(), 1u);
+  EXPECT_EQ(expired[0].session_id, "s2");
+  EXPECT_TRUE(table.Find("s1", NULL));
+  EXPECT_FALSE(table.Find("s2", NULL));
+
+  // 汇报时间较旧的Merge不覆盖
+  Session old_s1("s1", "u1");
+  old_s1.last_report_time = now;
+  table.Merge(old_s1);
+  Session found;
+  EXPECT_TRUE(table.Find("s1", &found));
+  EXPECT_EQ(found.last_report_time, now + timeout / 2);
+
+  expired.clear();
+  table.RemoveExpired(now + timeout + timeout / 2 + 200000, &expired);
+  ASSERT_EQ(expired.size(), 1u);
+  EXPECT_EQ(expired[0].session_id, "s1");
+  EXPECT_EQ(table.Size(), 0);
+}
+
+int main(int argc, char* argv[]) {
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
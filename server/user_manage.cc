@@ -233,6 +233,59 @@ std::string UserManager::GetUsernameFromUuid(const std::string& uuid) {
   return "";
 }
 
+void UserManager::GetAllUsers(std::vector<UserInfo>* users) {
+  MutexLock lock(&mu_);
+  for (auto it = user_list_.begin(); it != user_list_.end(); ++it) {
+    users->push_back(it->second);
+  }
+}
+
+void UserManager::GetLoggedUsers(
+    std::map<std::string, std::string>* logged_users) {
+  MutexLock lock(&mu_);
+  *logged_users = logged_users_;
+}
+
+bool UserManager::ResetUsers(
+    const std::vector<UserInfo>& users,
+    const std::map<std::string, std::string>* logged_users) {
+  leveldb::WriteBatch batch;
+  leveldb::Iterator* it = user_db_->NewIterator(leveldb::ReadOptions());
+  for (it->SeekToFirst(); it->Valid(); it->Next()) {
+    batch.Delete(it->key().ToString());
+  }
+  bool iter_ok = it->status().ok();
+  delete it;
+  if (!iter_ok) {
+    return false;
+  }
+  for (auto& user : users) {
+    batch.Put(user.username(), user.passwd());
+  }
+  leveldb::Status status = user_db_->Write(leveldb::WriteOptions(), &batch);
+  if (!status.ok()) {
+    return false;
+  }
+  MutexLock lock(&mu_);
+  user_list_.clear();
+  for (auto& user : users) {
+    user_list_[user.username()] = user;
+  }
+  if (logged_users != NULL) {
+    logged_users_ = *logged_users;
+  }
+  // 已经不存在的用户强制下线
+  auto online_it = logged_users_.begin();
+  while (online_it != logged_users_.end()) {
+    if (user_list_.find(online_it->second) == user_list_.end()) {
+      logged_users_.erase(online_it++);
+    } else {
+      ++online_it;
+    }
+  }
+  return true;
+}
+
 bool UserManager::WriteToDatabase(const UserInfo& user) {
   if (!user.has_username() || !user.has_passwd()) {
     return false;
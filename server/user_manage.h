@@ -3,6 +3,7 @@
 
 #include <map>
 #include <string>
+#include <vector>
 #include "common/mutex.h"
 #include "leveldb/db.h"
 #include "proto/ins_node.pb.h"
@@ -32,6 +33,13 @@ class UserManager {
 
   std::string GetUsernameFromUuid(const std::string& uuid);
 
+  // for InstallSnapshot, dump or replace all registered users and
+  // logged in uuids, keep the current logins if logged_users is NULL
+  void GetAllUsers(std::vector<UserInfo>* users);
+  void GetLoggedUsers(std::map<std::string, std::string>* logged_users);
+  bool ResetUsers(const std::vector<UserInfo>& users,
+                  const std::map<std::string, std::string>* logged_users);
+
   static std::string CalcUuid(const std::string& name);
 
  private:
@@ -1,6 +1,8 @@
 #include "server/user_manage.h"
 #include <gtest/gtest.h>
+#include <map>
 #include <string>
+#include <vector>
 #include "proto/ins_node.pb.h"
 
 using namespace galaxy::ins;
@@ -169,6 +171,38 @@ TEST(UserManageTest, ToolFunctionTest) {
   EXPECT_TRUE(!user_manager.IsValidUser("user3"));
 }
 
+TEST(UserManageTest, ResetUsersTest) {
+  UserInfo root;
+  root.set_username("root");
+  root.set_passwd("rootpassword");
+  UserManager user_manager("/tmp/user_test4", root);
+  EXPECT_EQ(user_manager.Register("user1", "123456"), kOk);
+  std::string uuid1 = UserManager::CalcUuid("user1");
+  EXPECT_EQ(user_manager.Login("user1", "123456", uuid1), kOk);
+
+  // A snapshot replaces both the users and the logins
+  std::vector<UserInfo> users;
+  user_manager.GetAllUsers(&users);
+  UserInfo user2;
+  user2.set_username("user2");
+  user2.set_passwd("123456");
+  users.push_back(user2);
+  std::map<std::string, std::string> logged_users;
+  logged_users["uuid2"] = "user2";
+  logged_users["uuid3"] = "user3";  // not a registered user
+  EXPECT_TRUE(user_manager.ResetUsers(users, &logged_users));
+  EXPECT_TRUE(!user_manager.IsLoggedIn(uuid1));
+  EXPECT_TRUE(user_manager.IsLoggedIn("uuid2"));
+  EXPECT_EQ(user_manager.GetUsernameFromUuid("uuid2"), "user2");
+  EXPECT_TRUE(!user_manager.IsLoggedIn("uuid3"));
+
+  // Without logins the current ones are kept
+  users.pop_back();
+  EXPECT_TRUE(user_manager.ResetUsers(users, NULL));
+  EXPECT_TRUE(!user_manager.IsValidUser("user2"));
+  EXPECT_TRUE(!user_manager.IsLoggedIn("uuid2"));
+}
+
 int main(int argc, char *argv[]) {
   testing::InitGoogleTest(&argc, argv);
   return RUN_ALL_TESTS();
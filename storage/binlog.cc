@@ -1,9 +1,12 @@
 #include "binlog.h"
 
 #include <assert.h>
+#include <algorithm>
+#include <snappy.h>
 #include "glog/logging.h"
 #include "common/asm_atomic.h"
 #include "leveldb/write_batch.h"
+#include "segment_log.h"
 #include "utils.h"
 
 namespace galaxy {
@@ -12,6 +15,13 @@ namespace ins {
 const std::string log_dbname = "#binlog";
 // 一个cursor，用于记录binlog的总长度，所以最后一个index是length - 1
 const std::string length_tag = "#BINLOG_LEN#";
+// gc之后的第一个slot，之前的slot都已经删除
+const std::string first_index_tag = "#BINLOG_FIRST#";
+const std::string segment_dirname = "#binlog_segments";
+// 迁移到segment后端时每次写入的记录数
+const size_t migrate_batch_size = 1024;
+// gc时每个leveldb batch删除的slot数
+const int64_t gc_batch_size = 4096;
 
 int32_t LogEntry::Dump(std::string* buf) const {
   assert(buf);
@@ -47,6 +57,14 @@ int32_t LogEntry::Dump(std::string* buf) const {
   return total_len;
 }
 
+int64_t LogEntry::LoadTerm(const std::string& buf) {
+  int64_t term = -1;
+  assert(buf.size() >= sizeof(int64_t));
+  memcpy(static_cast<void*>(&term), buf.data() + buf.size() - sizeof(int64_t),
+         sizeof(int64_t));
+  return term;
+}
+
 void LogEntry::Load(const std::string& buf) {
   const char* p = buf.data();
   int32_t user_size = 0;
@@ -85,8 +103,20 @@ void LogEntry::Load(const std::string& buf) {
 }
 
 BinLogger::BinLogger(const std::string& data_dir, bool compress,
-                     int32_t block_size, int32_t write_buffer_size)
-    : db_(NULL), length_(0), last_log_term_(-1) {
+                     int32_t block_size, int32_t write_buffer_size,
+                     int64_t cache_size, BinLogBackend backend,
+                     int64_t segment_size)
+    : db_(NULL),
+      segment_log_(NULL),
+      length_(0),
+      first_index_(0),
+      last_log_term_(-1),
+      sync_mode_(kSyncNone),
+      durable_length_(0),
+      truncate_epoch_(0),
+      cache_start_(0),
+      cache_bytes_(0),
+      cache_capacity_(cache_size) {
   bool ok = ins_common::Mkdirs(data_dir.c_str());
   if (!ok) {
     LOG(FATAL) << "failed to create dir: " << data_dir;
@@ -102,7 +132,29 @@ BinLogger::BinLogger(const std::string& data_dir, bool compress,
   options.block_size = block_size;
   LOG(INFO) << "[binlog]: " << full_name
             << ", configed: block_size: " << options.block_size
-            << ", writer_buffer_size: " << options.write_buffer_size;
+            << ", writer_buffer_size: " << options.write_buffer_size
+            << ", cache_size: " << cache_capacity_;
+  if (backend == kSegmentBinLog) {
+    segment_log_ =
+        new SegmentLog(data_dir + "/" + segment_dirname, segment_size);
+    if (!segment_log_->Open()) {
+      LOG(FATAL) << "open segment binlog in " << data_dir << " fail";
+    }
+    MigrateFromLevelDB(full_name, options);
+    length_ = segment_log_->Length();
+    if (length_ > 0) {
+      LogEntry log_entry;
+      bool slot_ok = ReadSlot(length_ - 1, &log_entry);
+      assert(slot_ok);
+      last_log_term_ = log_entry.term;
+    }
+    LOG(INFO) << "[binlog]: segment backend, first index: "
+              << segment_log_->FirstIndex() << ", length: " << length_
+              << ", last log term: " << last_log_term_;
+    cache_start_ = length_;
+    durable_length_ = length_;
+    return;
+  }
   auto status = leveldb::DB::Open(options, full_name, &db_);
   if (!status.ok()) {
     LOG(FATAL) << "open db " << full_name << "fail, " << status.ToString();
@@ -113,6 +165,7 @@ BinLogger::BinLogger(const std::string& data_dir, bool compress,
   status = db_->Get(leveldb::ReadOptions(), length_tag, &value);
   if (status.ok() && !value.empty()) {
     length_ = StringToInt(value);
+    first_index_ = ScanFirstSlot(db_, length_);
     if (length_ > 0) {
       LogEntry log_entry;
       bool slot_ok = ReadSlot(length_ - 1, &log_entry);
@@ -122,15 +175,169 @@ BinLogger::BinLogger(const std::string& data_dir, bool compress,
                 << ", last log term: " << last_log_term_;
     }
   }
+  cache_start_ = length_;
+  durable_length_ = length_;
+}
+
+BinLogger::~BinLogger() {
+  delete db_;
+  delete segment_log_;
+}
+
+// 已有leveldb格式的#binlog时，把其中的日志原样拷贝到segment中，
+// 完成后把#binlog改名，中途失败则下次启动重新迁移
+void BinLogger::MigrateFromLevelDB(const std::string& db_path,
+                                   const leveldb::Options& options) {
+  if (access((db_path + "/CURRENT").c_str(), F_OK) != 0) {
+    return;
+  }
+  leveldb::DB* db = NULL;
+  leveldb::Options open_options = options;
+  open_options.create_if_missing = false;
+  auto status = leveldb::DB::Open(open_options, db_path, &db);
+  if (!status.ok()) {
+    LOG(FATAL) << "open db " << db_path << " for migration fail, "
+               << status.ToString();
+  }
+  int64_t length = 0;
+  std::string value;
+  status = db->Get(leveldb::ReadOptions(), length_tag, &value);
+  if (status.ok() && !value.empty()) {
+    length = StringToInt(value);
+  }
+  int64_t first_index = ScanFirstSlot(db, length);
+  LOG(INFO) << "[binlog] migrate " << db_path << " to segments, slots: ["
+            << first_index << ", " << length << ")";
+
+  segment_log_->Truncate(segment_log_->FirstIndex());
+  segment_log_->SetStartIndex(first_index);
+  std::vector<std::string> records;
+  for (int64_t i = first_index; i < length; i++) {
+    records.push_back(std::string());
+    status = db->Get(leveldb::ReadOptions(), IntToString(i), &records.back());
+    if (!status.ok()) {
+      LOG(FATAL) << "read slot " << i << " for migration fail, "
+                 << status.ToString();
+    }
+    if (records.size() >= migrate_batch_size || i == length - 1) {
+      bool ok = segment_log_->Append(records);
+      assert(ok);
+      records.clear();
+    }
+  }
+  bool ok = segment_log_->Sync();
+  assert(ok);
+  delete db;
+  std::string migrated_path = db_path + ".migrated";
+  if (rename(db_path.c_str(), migrated_path.c_str()) != 0) {
+    LOG(FATAL) << "rename " << db_path << " to " << migrated_path << " fail";
+  }
+  LOG(INFO) << "[binlog] migration done, old binlog kept in " << migrated_path;
+}
+
+// slot key不是按数值有序的，扫描一遍找到gc之后的第一个slot
+int64_t BinLogger::ScanFirstSlot(leveldb::DB* db, int64_t length) {
+  std::string value;
+  leveldb::Status status =
+      db->Get(leveldb::ReadOptions(), first_index_tag, &value);
+  if (status.ok() && !value.empty()) {
+    return StringToInt(value);
+  }
+  int64_t first_index = length;
+  leveldb::Iterator* it = db->NewIterator(leveldb::ReadOptions());
+  for (it->SeekToFirst(); it->Valid(); it->Next()) {
+    if (it->key().size() != sizeof(int64_t) || it->key() == length_tag ||
+        it->key() == first_index_tag) {
+      continue;
+    }
+    int64_t slot_index = StringToInt(it->key().ToString());
+    if (slot_index < length) {
+      first_index = std::min(first_index, slot_index);
+    }
+  }
+  delete it;
+  return first_index;
+}
+
+void BinLogger::WriteSlots(int64_t first_index,
+                           const std::vector<std::string>& bufs, bool sync) {
+  if (segment_log_) {
+    assert(segment_log_->Length() == first_index);
+    bool ok = segment_log_->Append(bufs);
+    if (ok && sync) {
+      ok = segment_log_->Sync();
+    }
+    assert(ok);
+    return;
+  }
+  leveldb::WriteBatch batch;
+  int64_t cur_index = first_index;
+  for (auto& buf : bufs) {
+    batch.Put(IntToString(cur_index++), buf);
+  }
+  batch.Put(length_tag, IntToString(cur_index));
+  leveldb::WriteOptions write_options;
+  write_options.sync = sync;
+  leveldb::Status status = db_->Write(write_options, &batch);
+  assert(status.ok());
+}
+
+void BinLogger::SetSyncMode(BinLogSyncMode sync_mode) {
+  MutexLock lock(&mu_);
+  sync_mode_ = sync_mode;
 }
 
-BinLogger::~BinLogger() { delete db_; }
+int64_t BinLogger::GetDurableLength() {
+  MutexLock lock(&mu_);
+  return durable_length_;
+}
+
+// 把已写入的日志刷到磁盘，多次写入共享一次sync
+bool BinLogger::Sync() {
+  int64_t length = 0;
+  int64_t epoch = 0;
+  {
+    MutexLock lock(&mu_);
+    if (durable_length_ == length_) {
+      return true;
+    }
+    length = length_;
+    epoch = truncate_epoch_;
+  }
+  bool ok = false;
+  if (segment_log_) {
+    ok = segment_log_->Sync();
+  } else {
+    // 空的WriteBatch不改数据，只把leveldb的log刷盘
+    leveldb::WriteOptions write_options;
+    write_options.sync = true;
+    leveldb::WriteBatch batch;
+    ok = db_->Write(write_options, &batch).ok();
+  }
+  if (!ok) {
+    LOG(WARNING) << "sync binlog fail";
+    return false;
+  }
+  MutexLock lock(&mu_);
+  if (epoch == truncate_epoch_) {
+    durable_length_ = std::max(durable_length_, std::min(length, length_));
+  }
+  return true;
+}
 
 int64_t BinLogger::GetLength() {
   MutexLock lock(&mu_);
   return length_;
 }
 
+int64_t BinLogger::GetFirstIndex() {
+  if (segment_log_) {
+    return segment_log_->FirstIndex();
+  }
+  MutexLock lock(&mu_);
+  return first_index_;
+}
+
 int64_t BinLogger::GetLastLogIndex() {
   MutexLock lock(&mu_);
   return length_ - 1;
@@ -144,6 +351,22 @@ void BinLogger::GetLastLogIndexAndTerm(int64_t* last_log_index,
   *last_log_term = last_log_term_;
 }
 
+int64_t BinLogger::FindFirstIndexOfTerm(int64_t term, int64_t end) {
+  int64_t low = GetFirstIndex();
+  int64_t high = std::min(end, GetLength());
+  while (low < high) {
+    int64_t mid = low + (high - low) / 2;
+    LogEntry log_entry;
+    // 读不到的slot已经被gc，当作更老的日志
+    if (ReadSlot(mid, &log_entry) && log_entry.term >= term) {
+      high = mid;
+    } else {
+      low = mid + 1;
+    }
+  }
+  return (low < std::min(end, GetLength())) ? low : end;
+}
+
 std::string BinLogger::IntToString(int64_t num) {
   std::string key;
   key.resize(sizeof(int64_t));
@@ -159,6 +382,14 @@ int64_t BinLogger::StringToInt(const std::string& s) {
 }
 
 bool BinLogger::RemoveSlot(int64_t slot_index) {
+  {
+    MutexLock lock(&mu_);
+    RemoveFromCacheBefore(slot_index + 1);
+  }
+  if (segment_log_) {  // 只能整段删除
+    segment_log_->RemoveBefore(slot_index + 1);
+    return true;
+  }
   auto status = db_->Delete(leveldb::WriteOptions(), IntToString(slot_index));
   if (status.ok()) {
     return true;
@@ -168,16 +399,75 @@ bool BinLogger::RemoveSlot(int64_t slot_index) {
 }
 
 bool BinLogger::RemoveSlotBefore(int64_t slot_gc_index) {
-  db_->SetNexusGCKey(slot_gc_index);
+  {
+    MutexLock lock(&mu_);
+    RemoveFromCacheBefore(slot_gc_index);
+  }
+  if (segment_log_) {
+    segment_log_->RemoveBefore(slot_gc_index);
+    return true;
+  }
+  int64_t first_index = 0;
+  {
+    MutexLock lock(&mu_);
+    first_index = first_index_;
+    slot_gc_index = std::min(slot_gc_index, length_);
+  }
+  // 只删除新增的一段，交给leveldb正常compaction回收空间
+  DeleteSlots(first_index, slot_gc_index);
   return true;
 }
 
+void BinLogger::DeleteSlots(int64_t from, int64_t to) {
+  while (from < to) {
+    int64_t end = std::min(to, from + gc_batch_size);
+    leveldb::WriteBatch batch;
+    for (int64_t i = from; i < end; i++) {
+      batch.Delete(IntToString(i));
+    }
+    {
+      MutexLock lock(&mu_);
+      if (end > first_index_) {
+        batch.Put(first_index_tag, IntToString(end));
+      }
+    }
+    leveldb::Status status = db_->Write(leveldb::WriteOptions(), &batch);
+    if (!status.ok()) {
+      LOG(WARNING) << "remove slots [" << from << ", " << end << ") fail, "
+                   << status.ToString();
+      return;
+    }
+    MutexLock lock(&mu_);
+    first_index_ = std::max(first_index_, end);
+    from = end;
+  }
+}
+
 bool BinLogger::ReadSlot(int64_t slot_index, LogEntry* log_entry) {
-  std::string value;
-  auto status =
-      db_->Get(leveldb::ReadOptions(), IntToString(slot_index), &value);
+  std::string buf;
+  if (!ReadSlotRaw(slot_index, &buf)) {
+    return false;
+  }
+  log_entry->Load(buf);
+  return true;
+}
+
+bool BinLogger::ReadSlotRaw(int64_t slot_index, std::string* buf) {
+  {
+    MutexLock lock(&mu_);
+    if (ReadSlotFromCache(slot_index, buf)) {
+      return true;
+    }
+  }
+  return ReadSlotFromDB(slot_index, buf);
+}
+
+bool BinLogger::ReadSlotFromDB(int64_t slot_index, std::string* buf) {
+  if (segment_log_) {
+    return segment_log_->Read(slot_index, buf);
+  }
+  auto status = db_->Get(leveldb::ReadOptions(), IntToString(slot_index), buf);
   if (status.ok()) {
-    log_entry->Load(value);
     return true;
   } else if (status.IsNotFound()) {
     return false;
@@ -187,36 +477,105 @@ bool BinLogger::ReadSlot(int64_t slot_index, LogEntry* log_entry) {
   }
 }
 
+// 写盘和sync期间不持有mu_，GetLength等只读接口不会被磁盘IO阻塞；
+// 调用方保证同一时刻只有一个写者，写完后再发布length_和缓存
+void BinLogger::AppendSlots(std::vector<std::string>* bufs) {
+  int64_t first_index = 0;
+  bool sync = false;
+  {
+    MutexLock lock(&mu_);
+    first_index = length_;
+    sync = (sync_mode_ == kSyncBatch);
+  }
+  WriteSlots(first_index, *bufs, sync);
+  MutexLock lock(&mu_);
+  assert(length_ == first_index);
+  last_log_term_ = LogEntry::LoadTerm(bufs->back());
+  for (auto& buf : *bufs) {
+    AppendToCache(length_++, &buf);
+  }
+  if (sync_mode_ != kSyncTimed) {
+    durable_length_ = length_;
+  }
+}
+
 void BinLogger::AppendEntryList(const ::google::protobuf::RepeatedPtrField<
     ::galaxy::ins::Entry>& entries) {
-  leveldb::WriteBatch batch;
-  MutexLock lock(&mu_);
-  int64_t cur_index = length_;
-  std::string buf;
-  for (auto entry : entries) {
-    LogEntry log_entry(entry);
-    log_entry.Dump(&buf);
-    last_log_term_ = log_entry.term;
-    batch.Put(IntToString(cur_index++), buf);
+  if (entries.size() == 0) {
+    return;
   }
-  batch.Put(length_tag, IntToString(cur_index));
-  leveldb::Status status = db_->Write(leveldb::WriteOptions(), &batch);
-  assert(status.ok());
-  length_ += entries.size();
+  std::vector<std::string> bufs(entries.size());
+  for (int i = 0; i < entries.size(); i++) {
+    LogEntry(entries.Get(i)).Dump(&bufs[i]);
+  }
+  AppendSlots(&bufs);
 }
 
-void BinLogger::AppendEntry(const LogEntry& log_entry) {
-  std::string buf;
-  log_entry.Dump(&buf);
-  leveldb::WriteBatch batch;
-  MutexLock lock(&mu_);
-  batch.Put(IntToString(length_), buf);
-  batch.Put(length_tag, IntToString(length_ + 1));
-  auto status = db_->Write(leveldb::WriteOptions(), &batch);
-  assert(status.ok());
+void BinLogger::AppendEntryList(const std::vector<LogEntry>& entries) {
+  if (entries.empty()) {
+    return;
+  }
+  std::vector<std::string> bufs(entries.size());
+  for (size_t i = 0; i < entries.size(); i++) {
+    entries[i].Dump(&bufs[i]);
+  }
+  AppendSlots(&bufs);
+}
 
-  ++length_;
-  last_log_term_ = log_entry.term;
+void BinLogger::AppendRawEntryList(
+    const ::google::protobuf::RepeatedPtrField<std::string>& raw_entries,
+    int32_t offset) {
+  if (offset >= raw_entries.size()) {
+    return;
+  }
+  std::vector<std::string> bufs(raw_entries.begin() + offset,
+                                raw_entries.end());
+  AppendSlots(&bufs);
+}
+
+void BinLogger::CompressRawEntries(
+    const ::google::protobuf::RepeatedPtrField<std::string>& raw_entries,
+    std::string* compressed) {
+  // 打包格式为连续的 [len:4][data:len]
+  std::string packed;
+  for (int i = 0; i < raw_entries.size(); i++) {
+    const std::string& raw_entry = raw_entries.Get(i);
+    int32_t len = raw_entry.size();
+    packed.append(reinterpret_cast<const char*>(&len), sizeof(len));
+    packed.append(raw_entry);
+  }
+  snappy::Compress(packed.data(), packed.size(), compressed);
+}
+
+bool BinLogger::UncompressRawEntries(
+    const std::string& compressed,
+    ::google::protobuf::RepeatedPtrField<std::string>* raw_entries) {
+  std::string packed;
+  if (!snappy::Uncompress(compressed.data(), compressed.size(), &packed)) {
+    LOG(WARNING) << "bad compressed entries, size: " << compressed.size();
+    return false;
+  }
+  size_t pos = 0;
+  while (pos < packed.size()) {
+    int32_t len = 0;
+    if (packed.size() - pos < sizeof(len)) {
+      return false;
+    }
+    memcpy(&len, packed.data() + pos, sizeof(len));
+    pos += sizeof(len);
+    if (len < 0 || packed.size() - pos < static_cast<size_t>(len)) {
+      return false;
+    }
+    raw_entries->Add()->assign(packed.data() + pos, len);
+    pos += len;
+  }
+  return true;
+}
+
+void BinLogger::AppendEntry(const LogEntry& log_entry) {
+  std::vector<std::string> bufs(1);
+  log_entry.Dump(&bufs[0]);
+  AppendSlots(&bufs);
 }
 
 void BinLogger::Truncate(int64_t trunk_slot_index) {
@@ -226,14 +585,139 @@ void BinLogger::Truncate(int64_t trunk_slot_index) {
 
   MutexLock lock(&mu_);
   length_ = trunk_slot_index + 1;
-  auto status =
-      db_->Put(leveldb::WriteOptions(), length_tag, IntToString(length_));
-  assert(status.ok());
+  if (segment_log_) {
+    bool ok = segment_log_->Truncate(length_);
+    if (ok && sync_mode_ == kSyncBatch) {
+      ok = segment_log_->Sync();
+    }
+    assert(ok);
+  } else {
+    leveldb::WriteOptions write_options;
+    write_options.sync = (sync_mode_ == kSyncBatch);
+    auto status = db_->Put(write_options, length_tag, IntToString(length_));
+    assert(status.ok());
+  }
+  ++truncate_epoch_;
+  durable_length_ = std::min(durable_length_, length_);
+  TruncateCache(length_);
   if (length_ > 0) {
-    LogEntry log_entry;
-    bool slot_ok = ReadSlot(length_ - 1, &log_entry);
+    std::string buf;
+    bool slot_ok = ReadSlotFromCache(length_ - 1, &buf) ||
+                   ReadSlotFromDB(length_ - 1, &buf);
     assert(slot_ok);
-    last_log_term_ = log_entry.term;
+    last_log_term_ = LogEntry::LoadTerm(buf);
+  }
+}
+
+void BinLogger::Reset(int64_t snapshot_index, int64_t snapshot_term) {
+  LogEntry log_entry;
+  log_entry.op = kNop;
+  log_entry.term = snapshot_term;
+  std::vector<std::string> bufs(1);
+  log_entry.Dump(&bufs[0]);
+
+  int64_t old_first_index = 0;
+  int64_t old_length = 0;
+  {
+    MutexLock lock(&mu_);
+    old_first_index = first_index_;
+    old_length = length_;
+    if (segment_log_) {
+      bool ok = segment_log_->Truncate(segment_log_->FirstIndex());
+      assert(ok);
+      segment_log_->SetStartIndex(snapshot_index);
+      ok = segment_log_->Append(bufs) && segment_log_->Sync();
+      assert(ok);
+    } else {
+      leveldb::WriteBatch batch;
+      batch.Put(IntToString(snapshot_index), bufs[0]);
+      batch.Put(length_tag, IntToString(snapshot_index + 1));
+      batch.Put(first_index_tag, IntToString(snapshot_index));
+      leveldb::WriteOptions write_options;
+      write_options.sync = true;
+      leveldb::Status status = db_->Write(write_options, &batch);
+      assert(status.ok());
+    }
+    length_ = snapshot_index + 1;
+    first_index_ = snapshot_index;
+    last_log_term_ = snapshot_term;
+    ++truncate_epoch_;
+    durable_length_ = length_;
+    cache_.clear();
+    cache_bytes_ = 0;
+    cache_start_ = snapshot_index;
+    AppendToCache(snapshot_index, &bufs[0]);
+  }
+  if (!segment_log_) {
+    // 快照之前的旧日志已经不可见，再分批删掉
+    DeleteSlots(old_first_index, std::min(old_length, snapshot_index));
+  }
+  LOG(INFO) << "[binlog] reset to snapshot, index: " << snapshot_index
+            << ", term: " << snapshot_term;
+}
+
+void BinLogger::DumpLogEntry(const LogEntry& log_entry, std::string* buf) {
+  log_entry.Dump(buf);
+}
+
+void BinLogger::LoadLogEntry(const std::string& buf, LogEntry* log_entry) {
+  log_entry->Load(buf);
+}
+
+int64_t BinLogger::EntryMemSize(const std::string& buf) {
+  return sizeof(std::string) + buf.size();
+}
+
+bool BinLogger::ReadSlotFromCache(int64_t slot_index, std::string* buf) {
+  mu_.AssertHeld();
+  if (slot_index < cache_start_ ||
+      slot_index >= cache_start_ + static_cast<int64_t>(cache_.size())) {
+    return false;
+  }
+  *buf = cache_[slot_index - cache_start_];
+  return true;
+}
+
+void BinLogger::AppendToCache(int64_t slot_index, std::string* buf) {
+  mu_.AssertHeld();
+  if (cache_capacity_ <= 0) {
+    return;
+  }
+  if (cache_start_ + static_cast<int64_t>(cache_.size()) != slot_index) {
+    cache_.clear();
+    cache_bytes_ = 0;
+    cache_start_ = slot_index;
+  }
+  cache_.push_back(std::string());
+  cache_.back().swap(*buf);
+  cache_bytes_ += EntryMemSize(cache_.back());
+  // 超出内存预算时从最老的entry开始淘汰
+  while (cache_bytes_ > cache_capacity_ && !cache_.empty()) {
+    cache_bytes_ -= EntryMemSize(cache_.front());
+    cache_.pop_front();
+    ++cache_start_;
+  }
+}
+
+void BinLogger::TruncateCache(int64_t length) {
+  mu_.AssertHeld();
+  while (!cache_.empty() &&
+         cache_start_ + static_cast<int64_t>(cache_.size()) > length) {
+    cache_bytes_ -= EntryMemSize(cache_.back());
+    cache_.pop_back();
+  }
+  if (cache_.empty()) {
+    cache_bytes_ = 0;
+    cache_start_ = length;
+  }
+}
+
+void BinLogger::RemoveFromCacheBefore(int64_t slot_index) {
+  mu_.AssertHeld();
+  while (!cache_.empty() && cache_start_ < slot_index) {
+    cache_bytes_ -= EntryMemSize(cache_.front());
+    cache_.pop_front();
+    ++cache_start_;
   }
 }
 
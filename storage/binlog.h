@@ -3,7 +3,9 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <deque>
 #include <string>
+#include <vector>
 #include "common/mutex.h"
 #include "leveldb/db.h"
 #include "proto/ins_node.pb.h"
@@ -11,6 +13,22 @@
 namespace galaxy {
 namespace ins {
 
+class SegmentLog;
+
+// binlog的存储后端
+enum BinLogBackend {
+  kLevelDBBinLog = 0,  // 每个slot一个leveldb key
+  kSegmentBinLog = 1,  // 预分配的分段追加写文件，见segment_log.h
+};
+
+// binlog的落盘策略，durable length之前的日志才能计入follower的应答和
+// leader的commit
+enum BinLogSyncMode {
+  kSyncNone = 0,   // 不主动sync，写入即视为durable
+  kSyncBatch = 1,  // 每次批量写入都sync
+  kSyncTimed = 2,  // 由调用方定期调用Sync()
+};
+
 struct LogEntry {
   LogOperation op;
   std::string user;
@@ -27,33 +45,91 @@ struct LogEntry {
         term(entry.term()) {}
   int32_t Dump(std::string* buf) const;
   void Load(const std::string& buf);
+  // 不解码整条entry，只取出Dump结果末尾的term
+  static int64_t LoadTerm(const std::string& buf);
 };
 
 class BinLogger {
  public:
   BinLogger(const std::string& data_dir, bool compress = false,
-            int32_t block_size = 32748, int32_t write_buffer_size = 33554432);
+            int32_t block_size = 32748, int32_t write_buffer_size = 33554432,
+            int64_t cache_size = 0, BinLogBackend backend = kLevelDBBinLog,
+            int64_t segment_size = 67108864);
   ~BinLogger();
   int64_t GetLength();
+  // 第一条没有被gc的日志
+  int64_t GetFirstIndex();
   int64_t GetLastLogIndex();
   bool ReadSlot(int64_t slot_index, LogEntry* log_entry);
+  // 读出LogEntry::Dump编码的原始数据，复制日志时原样发送
+  bool ReadSlotRaw(int64_t slot_index, std::string* buf);
   void AppendEntry(const LogEntry& log_entry);
   void Truncate(int64_t trunc_slot_index);
+  // 安装快照后丢弃全部日志，只在snapshot_index的位置保留一条记录了
+  // snapshot_term的kNop，供后续AppendEntries检查prev log
+  void Reset(int64_t snapshot_index, int64_t snapshot_term);
   void DumpLogEntry(const LogEntry& log_entry, std::string* buf);
   void LoadLogEntry(const std::string& buf, LogEntry* log_entry);
   void AppendEntryList(const ::google::protobuf::RepeatedPtrField<
       ::galaxy::ins::Entry>& entries);
+  void AppendEntryList(const std::vector<LogEntry>& entries);
+  // 追加raw_entries[offset:]，每一项都是LogEntry::Dump的结果
+  void AppendRawEntryList(
+      const ::google::protobuf::RepeatedPtrField<std::string>& raw_entries,
+      int32_t offset);
+  // 把一批raw entry打包后用snappy压缩，追赶日志时整批发送
+  static void CompressRawEntries(
+      const ::google::protobuf::RepeatedPtrField<std::string>& raw_entries,
+      std::string* compressed);
+  static bool UncompressRawEntries(
+      const std::string& compressed,
+      ::google::protobuf::RepeatedPtrField<std::string>* raw_entries);
   bool RemoveSlot(int64_t slot_index);
   bool RemoveSlotBefore(int64_t slot_gc_index);
   static std::string IntToString(int64_t num);
   static int64_t StringToInt(const std::string& s);
   void GetLastLogIndexAndTerm(int64_t* last_log_index, int64_t* last_log_term);
+  // 日志的term单调不减，二分查找[GetFirstIndex(), end)中第一个term不小于
+  // term的slot，没有则返回end
+  int64_t FindFirstIndexOfTerm(int64_t term, int64_t end);
+  void SetSyncMode(BinLogSyncMode sync_mode);
+  int64_t GetDurableLength();
+  bool Sync();
+
+ private:
+  bool ReadSlotFromDB(int64_t slot_index, std::string* buf);
+  void WriteSlots(int64_t first_index, const std::vector<std::string>& bufs,
+                  bool sync);
+  // 追加写入的接口不能并发调用(InsNodeImpl中由log_io_mu_串行化)
+  void AppendSlots(std::vector<std::string>* bufs);
+  void MigrateFromLevelDB(const std::string& db_path,
+                          const leveldb::Options& options);
+  int64_t ScanFirstSlot(leveldb::DB* db, int64_t length);
+  // 分批删除leveldb后端[from, to)的slot，并记录新的first index
+  void DeleteSlots(int64_t from, int64_t to);
+  // 以下函数要求持有mu_
+  bool ReadSlotFromCache(int64_t slot_index, std::string* buf);
+  // 把*buf的内容交换进缓存
+  void AppendToCache(int64_t slot_index, std::string* buf);
+  void TruncateCache(int64_t length);
+  void RemoveFromCacheBefore(int64_t slot_index);
+  static int64_t EntryMemSize(const std::string& buf);
 
  private:
   leveldb::DB* db_;
+  SegmentLog* segment_log_;  // not NULL when using kSegmentBinLog
   int64_t length_;
+  int64_t first_index_;  // slots before it have been removed
   int64_t last_log_term_;
+  BinLogSyncMode sync_mode_;
+  int64_t durable_length_;
+  int64_t truncate_epoch_;  // bumped on Truncate, invalidates inflight Sync
   Mutex mu_;
+  // 最近写入的日志(编码后)，覆盖[cache_start_, cache_start_ + cache_.size())
+  std::deque<std::string> cache_;
+  int64_t cache_start_;
+  int64_t cache_bytes_;
+  int64_t cache_capacity_;
 };
 
 }  // namespace ins
@@ -81,6 +81,212 @@ TEST(BinLogTest, SlotTruncate) {
   EXPECT_EQ(bin_logger.GetLength(), 0);
 }
 
+TEST(BinLogTest, CacheReadAfterTruncate) {
+  // 缓存只能放下一部分entry，读取会同时走缓存和leveldb
+  BinLogger bin_logger("/tmp/binlog_cache_test", false, 32768, 33554432, 4096);
+  bin_logger.Truncate(-1);
+  char key_buf[1024] = {'\0'};
+  for (int i = 0; i < 100; i++) {
+    LogEntry log_entry;
+    snprintf(key_buf, sizeof(key_buf), "key_%d", i);
+    log_entry.key = key_buf;
+    log_entry.value = "old";
+    log_entry.term = 1;
+    log_entry.op = kPut;
+    bin_logger.AppendEntry(log_entry);
+  }
+  for (int i = 0; i < 100; i++) {
+    LogEntry log_entry;
+    EXPECT_TRUE(bin_logger.ReadSlot(i, &log_entry));
+    snprintf(key_buf, sizeof(key_buf), "key_%d", i);
+    EXPECT_EQ(log_entry.key, std::string(key_buf));
+    EXPECT_EQ(log_entry.value, "old");
+  }
+
+  // 截断后被覆盖的entry不能再从缓存读到
+  bin_logger.Truncate(89);
+  std::vector<LogEntry> entries;
+  for (int i = 90; i < 100; i++) {
+    LogEntry log_entry;
+    snprintf(key_buf, sizeof(key_buf), "key_%d", i);
+    log_entry.key = key_buf;
+    log_entry.value = "new";
+    log_entry.term = 2;
+    log_entry.op = kPut;
+    entries.push_back(log_entry);
+  }
+  bin_logger.AppendEntryList(entries);
+  EXPECT_EQ(bin_logger.GetLength(), 100);
+  for (int i = 80; i < 100; i++) {
+    LogEntry log_entry;
+    EXPECT_TRUE(bin_logger.ReadSlot(i, &log_entry));
+    EXPECT_EQ(log_entry.value, i < 90 ? "old" : "new");
+    EXPECT_EQ(log_entry.term, i < 90 ? 1 : 2);
+  }
+}
+
+TEST(BinLogTest, TimedSyncDurableLength) {
+  BinLogger bin_logger("/tmp/binlog_sync_test");
+  bin_logger.Truncate(-1);
+  bin_logger.SetSyncMode(kSyncTimed);
+  LogEntry log_entry;
+  log_entry.key = "key";
+  log_entry.term = 1;
+  log_entry.op = kPut;
+  for (int i = 0; i < 10; i++) {
+    bin_logger.AppendEntry(log_entry);
+  }
+  // 没有sync之前写入的日志都不算durable
+  EXPECT_EQ(bin_logger.GetLength(), 10);
+  EXPECT_EQ(bin_logger.GetDurableLength(), 0);
+  EXPECT_TRUE(bin_logger.Sync());
+  EXPECT_EQ(bin_logger.GetDurableLength(), 10);
+  bin_logger.Truncate(4);
+  EXPECT_EQ(bin_logger.GetDurableLength(), 5);
+
+  bin_logger.SetSyncMode(kSyncBatch);
+  bin_logger.AppendEntry(log_entry);
+  EXPECT_EQ(bin_logger.GetDurableLength(), 6);
+}
+
+TEST(BinLogTest, RemoveSlotBefore) {
+  {
+    BinLogger bin_logger("/tmp/binlog_gc_test");
+    bin_logger.Truncate(-1);
+    LogEntry log_entry;
+    log_entry.key = "key";
+    log_entry.term = 1;
+    log_entry.op = kPut;
+    for (int i = 0; i < 10000; i++) {
+      bin_logger.AppendEntry(log_entry);
+    }
+    EXPECT_EQ(bin_logger.GetFirstIndex(), 0);
+    EXPECT_TRUE(bin_logger.RemoveSlotBefore(5000));
+    EXPECT_EQ(bin_logger.GetFirstIndex(), 5000);
+    EXPECT_FALSE(bin_logger.ReadSlot(4999, &log_entry));
+    EXPECT_TRUE(bin_logger.ReadSlot(5000, &log_entry));
+    // 只删除新增的一段
+    EXPECT_TRUE(bin_logger.RemoveSlotBefore(6000));
+    EXPECT_EQ(bin_logger.GetFirstIndex(), 6000);
+  }
+  BinLogger bin_logger("/tmp/binlog_gc_test");
+  EXPECT_EQ(bin_logger.GetFirstIndex(), 6000);
+  EXPECT_EQ(bin_logger.GetLength(), 10000);
+  LogEntry log_entry;
+  EXPECT_FALSE(bin_logger.ReadSlot(5999, &log_entry));
+  EXPECT_TRUE(bin_logger.ReadSlot(6000, &log_entry));
+}
+
+TEST(BinLogTest, FindFirstIndexOfTerm) {
+  BinLogger bin_logger("/tmp/binlog_term_test");
+  bin_logger.Truncate(-1);
+  // term: 0 0 0 2 2 2 2 5 5 5
+  int64_t terms[] = {0, 0, 0, 2, 2, 2, 2, 5, 5, 5};
+  for (int i = 0; i < 10; i++) {
+    LogEntry log_entry;
+    log_entry.key = "key";
+    log_entry.term = terms[i];
+    log_entry.op = kPut;
+    bin_logger.AppendEntry(log_entry);
+  }
+  EXPECT_EQ(bin_logger.FindFirstIndexOfTerm(0, 10), 0);
+  EXPECT_EQ(bin_logger.FindFirstIndexOfTerm(2, 10), 3);
+  EXPECT_EQ(bin_logger.FindFirstIndexOfTerm(3, 10), 7);
+  EXPECT_EQ(bin_logger.FindFirstIndexOfTerm(5, 10), 7);
+  EXPECT_EQ(bin_logger.FindFirstIndexOfTerm(6, 10), 10);
+  EXPECT_EQ(bin_logger.FindFirstIndexOfTerm(5, 6), 6);
+}
+
+TEST(BinLogTest, RawEntryReplication) {
+  BinLogger leader("/tmp/binlog_raw_test/leader", false, 32768, 33554432,
+                   1024 * 1024);
+  BinLogger follower("/tmp/binlog_raw_test/follower");
+  leader.Truncate(-1);
+  follower.Truncate(-1);
+  for (int i = 0; i < 10; i++) {
+    LogEntry log_entry;
+    log_entry.user = "user";
+    log_entry.key = "key_" + BinLogger::IntToString(i);
+    log_entry.value = "value";
+    log_entry.term = i / 4;
+    log_entry.op = kPut;
+    leader.AppendEntry(log_entry);
+  }
+  ::google::protobuf::RepeatedPtrField<std::string> raw_entries;
+  for (int i = 0; i < 10; i++) {
+    EXPECT_TRUE(leader.ReadSlotRaw(i, raw_entries.Add()));
+    EXPECT_EQ(LogEntry::LoadTerm(raw_entries.Get(i)), i / 4);
+  }
+  // 截断后只追加follower缺少的部分
+  follower.AppendRawEntryList(raw_entries, 0);
+  follower.Truncate(2);
+  follower.AppendRawEntryList(raw_entries, 3);
+  EXPECT_EQ(follower.GetLength(), 10);
+  int64_t last_log_index = -1;
+  int64_t last_log_term = -1;
+  follower.GetLastLogIndexAndTerm(&last_log_index, &last_log_term);
+  EXPECT_EQ(last_log_term, 2);
+  for (int i = 0; i < 10; i++) {
+    LogEntry expect, actual;
+    EXPECT_TRUE(leader.ReadSlot(i, &expect));
+    EXPECT_TRUE(follower.ReadSlot(i, &actual));
+    EXPECT_EQ(expect.key, actual.key);
+    EXPECT_EQ(expect.user, actual.user);
+    EXPECT_EQ(expect.term, actual.term);
+  }
+}
+
+TEST(BinLogTest, CompressRawEntries) {
+  ::google::protobuf::RepeatedPtrField<std::string> raw_entries;
+  for (int i = 0; i < 100; i++) {
+    LogEntry log_entry;
+    log_entry.key = "key_" + BinLogger::IntToString(i);
+    log_entry.value = std::string(i, 'v');
+    log_entry.term = i;
+    log_entry.Dump(raw_entries.Add());
+  }
+  std::string compressed;
+  BinLogger::CompressRawEntries(raw_entries, &compressed);
+  ::google::protobuf::RepeatedPtrField<std::string> uncompressed;
+  EXPECT_TRUE(BinLogger::UncompressRawEntries(compressed, &uncompressed));
+  ASSERT_EQ(uncompressed.size(), 100);
+  for (int i = 0; i < 100; i++) {
+    EXPECT_EQ(uncompressed.Get(i), raw_entries.Get(i));
+    EXPECT_EQ(LogEntry::LoadTerm(uncompressed.Get(i)), i);
+  }
+  uncompressed.Clear();
+  EXPECT_FALSE(BinLogger::UncompressRawEntries("bad data", &uncompressed));
+}
+
+TEST(BinLogTest, ResetToSnapshot) {
+  BinLogger bin_logger("/tmp/binlog_reset_test");
+  bin_logger.Truncate(-1);
+  LogEntry log_entry;
+  log_entry.key = "key";
+  log_entry.term = 1;
+  log_entry.op = kPut;
+  for (int i = 0; i < 10; i++) {
+    bin_logger.AppendEntry(log_entry);
+  }
+  bin_logger.Reset(100, 3);
+  EXPECT_EQ(bin_logger.GetLength(), 101);
+  int64_t last_log_index = -1;
+  int64_t last_log_term = -1;
+  bin_logger.GetLastLogIndexAndTerm(&last_log_index, &last_log_term);
+  EXPECT_EQ(last_log_index, 100);
+  EXPECT_EQ(last_log_term, 3);
+  EXPECT_TRUE(bin_logger.ReadSlot(100, &log_entry));
+  EXPECT_EQ(log_entry.op, kNop);
+  EXPECT_EQ(log_entry.term, 3);
+  EXPECT_FALSE(bin_logger.ReadSlot(50, &log_entry));
+  log_entry.term = 4;
+  log_entry.op = kPut;
+  bin_logger.AppendEntry(log_entry);
+  EXPECT_EQ(bin_logger.GetLength(), 102);
+  EXPECT_TRUE(bin_logger.ReadSlot(101, &log_entry));
+  EXPECT_EQ(log_entry.term, 4);
+}
+
 int main(int argc, char* argv[]) {
   testing::InitGoogleTest(&argc, argv);
   return RUN_ALL_TESTS();
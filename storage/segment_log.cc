@@ -0,0 +1,403 @@
+#include "segment_log.h"
+
+#include <assert.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+#include <algorithm>
+#include "glog/logging.h"
+#include "utils.h"
+
+namespace galaxy {
+namespace ins {
+
+const std::string SegmentLog::kSegmentPrefix = "segment_";
+// 记录头: len(4) + crc32(4)
+static const int64_t kRecordHeaderSize = 2 * sizeof(uint32_t);
+
+static uint32_t RecordCrc(const char* data, size_t size) {
+  uLong crc = crc32(0L, Z_NULL, 0);
+  return crc32(crc, reinterpret_cast<const Bytef*>(data), size);
+}
+
+SegmentLog::SegmentLog(const std::string& dir, int64_t segment_size)
+    : dir_(dir),
+      segment_size_(segment_size),
+      start_index_(0),
+      dir_dirty_(false) {}
+
+SegmentLog::~SegmentLog() {
+  MutexLock lock(&mu_);
+  for (auto segment : segments_) {
+    CloseSegment(segment, false);
+  }
+  segments_.clear();
+}
+
+std::string SegmentLog::SegmentPath(int64_t first_index) {
+  char name[64];
+  snprintf(name, sizeof(name), "%s%020ld", kSegmentPrefix.c_str(),
+           static_cast<long>(first_index));
+  return dir_ + "/" + name;
+}
+
+bool SegmentLog::Open() {
+  MutexLock lock(&mu_);
+  if (!ins_common::Mkdirs(dir_.c_str())) {
+    LOG(WARNING) << "failed to create dir: " << dir_;
+    return false;
+  }
+  DIR* dir = opendir(dir_.c_str());
+  if (dir == NULL) {
+    LOG(WARNING) << "failed to open dir: " << dir_;
+    return false;
+  }
+  std::vector<int64_t> first_indexes;
+  struct dirent* entry = NULL;
+  while ((entry = readdir(dir)) != NULL) {
+    std::string name(entry->d_name);
+    if (name.compare(0, kSegmentPrefix.size(), kSegmentPrefix) != 0) {
+      continue;
+    }
+    first_indexes.push_back(
+        strtoll(name.c_str() + kSegmentPrefix.size(), NULL, 10));
+  }
+  closedir(dir);
+  std::sort(first_indexes.begin(), first_indexes.end());
+
+  for (size_t i = 0; i < first_indexes.size(); i++) {
+    Segment* segment = new Segment();
+    segment->first_index = first_indexes[i];
+    segment->path = SegmentPath(first_indexes[i]);
+    bool ok = LoadSegment(segment, i + 1 == first_indexes.size());
+    if (ok && !segments_.empty()) {
+      Segment* prev = segments_.back();
+      int64_t prev_end = prev->first_index + prev->offsets.size();
+      ok = (prev_end == segment->first_index);
+    }
+    if (!ok) {
+      // 已经确认写盘的日志不能丢，不删除任何文件，交给人工处理
+      LOG(WARNING) << "[segment log] failed to load " << segment->path;
+      CloseSegment(segment, false);
+      for (auto loaded : segments_) {
+        CloseSegment(loaded, false);
+      }
+      segments_.clear();
+      return false;
+    }
+    segments_.push_back(segment);
+  }
+  int64_t length = start_index_;
+  if (!segments_.empty()) {
+    start_index_ = segments_.front()->first_index;
+    length = segments_.back()->first_index + segments_.back()->offsets.size();
+  }
+  LOG(INFO) << "[segment log] open " << dir_ << ", segments: "
+            << segments_.size() << ", first index: " << start_index_
+            << ", length: " << length;
+  return true;
+}
+
+bool SegmentLog::MapSegment(Segment* segment) {
+  void* base = mmap(NULL, segment->file_size, PROT_READ, MAP_SHARED,
+                    segment->fd, 0);
+  if (base == MAP_FAILED) {
+    LOG(WARNING) << "mmap " << segment->path << " fail, " << strerror(errno);
+    return false;
+  }
+  segment->base = static_cast<char*>(base);
+  return true;
+}
+
+bool SegmentLog::LoadSegment(Segment* segment, bool last) {
+  segment->fd = open(segment->path.c_str(), O_RDWR);
+  if (segment->fd < 0) {
+    LOG(WARNING) << "open " << segment->path << " fail, " << strerror(errno);
+    return false;
+  }
+  struct stat st;
+  if (fstat(segment->fd, &st) != 0) {
+    LOG(WARNING) << "stat " << segment->path << " fail, " << strerror(errno);
+    return false;
+  }
+  if (st.st_size < kRecordHeaderSize) {
+    // 创建后还没来得及预分配，里面没有记录；下次Append会替换它
+    if (!last) {
+      LOG(WARNING) << "[segment log] bad segment size: " << segment->path;
+      return false;
+    }
+    segment->file_size = st.st_size;
+    segment->write_offset = 0;
+    return true;
+  }
+  segment->file_size = st.st_size;
+  if (!MapSegment(segment)) {
+    return false;
+  }
+  // 顺序扫描记录，遇到结束标记即停止；损坏的记录只允许出现在
+  // 最后一个segment的尾部(写到一半时宕机)
+  int64_t offset = 0;
+  while (offset + kRecordHeaderSize <= segment->file_size) {
+    uint32_t len = 0;
+    uint32_t crc = 0;
+    memcpy(&len, segment->base + offset, sizeof(uint32_t));
+    memcpy(&crc, segment->base + offset + sizeof(uint32_t), sizeof(uint32_t));
+    if (len == 0) {
+      break;
+    }
+    if (offset + kRecordHeaderSize + len > segment->file_size ||
+        RecordCrc(segment->base + offset + kRecordHeaderSize, len) != crc) {
+      LOG(WARNING) << "[segment log] bad record in " << segment->path
+                   << " at offset " << offset;
+      if (!last) {
+        return false;
+      }
+      LOG(WARNING) << "[segment log] truncate torn tail of "
+                   << segment->path;
+      break;
+    }
+    segment->offsets.push_back(offset);
+    offset += kRecordHeaderSize + len;
+  }
+  segment->write_offset = offset;
+  return true;
+}
+
+SegmentLog::Segment* SegmentLog::CreateSegment(int64_t first_index,
+                                               int64_t min_size) {
+  mu_.AssertHeld();
+  Segment* segment = new Segment();
+  segment->first_index = first_index;
+  segment->path = SegmentPath(first_index);
+  segment->file_size = std::max(segment_size_, min_size + kRecordHeaderSize);
+  segment->fd = open(segment->path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (segment->fd < 0) {
+    LOG(FATAL) << "create " << segment->path << " fail, " << strerror(errno);
+  }
+  // 预分配整个segment，追加写时不再修改文件大小
+  if (posix_fallocate(segment->fd, 0, segment->file_size) != 0 &&
+      ftruncate(segment->fd, segment->file_size) != 0) {
+    LOG(FATAL) << "preallocate " << segment->path << " fail, "
+               << strerror(errno);
+  }
+  if (!MapSegment(segment)) {
+    LOG(FATAL) << "map " << segment->path << " fail";
+  }
+  segments_.push_back(segment);
+  dir_dirty_ = true;
+  LOG(INFO) << "[segment log] new segment: " << segment->path;
+  return segment;
+}
+
+void SegmentLog::CloseSegment(Segment* segment, bool remove_file) {
+  if (segment->base) {
+    munmap(segment->base, segment->file_size);
+  }
+  if (segment->fd >= 0) {
+    close(segment->fd);
+  }
+  if (remove_file) {
+    unlink(segment->path.c_str());
+    dir_dirty_ = true;
+  }
+  delete segment;
+}
+
+bool SegmentLog::WriteTo(Segment* segment, int64_t offset, const char* data,
+                         int64_t size) {
+  while (size > 0) {
+    ssize_t n = pwrite(segment->fd, data, size, offset);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      LOG(WARNING) << "write " << segment->path << " fail, "
+                   << strerror(errno);
+      return false;
+    }
+    data += n;
+    offset += n;
+    size -= n;
+  }
+  segment->dirty = true;
+  return true;
+}
+
+void SegmentLog::SetStartIndex(int64_t start_index) {
+  MutexLock lock(&mu_);
+  assert(segments_.empty());
+  start_index_ = start_index;
+}
+
+int64_t SegmentLog::FirstIndex() {
+  MutexLock lock(&mu_);
+  return segments_.empty() ? start_index_ : segments_.front()->first_index;
+}
+
+int64_t SegmentLog::Length() {
+  MutexLock lock(&mu_);
+  if (segments_.empty()) {
+    return start_index_;
+  }
+  Segment* last = segments_.back();
+  return last->first_index + last->offsets.size();
+}
+
+bool SegmentLog::Append(const std::vector<std::string>& records) {
+  MutexLock lock(&mu_);
+  size_t i = 0;
+  while (i < records.size()) {
+    Segment* segment = segments_.empty() ? NULL : segments_.back();
+    int64_t need = kRecordHeaderSize + records[i].size();
+    if (segment == NULL ||
+        segment->write_offset + need > segment->file_size) {
+      int64_t next_index =
+          segment ? segment->first_index + segment->offsets.size()
+                  : start_index_;
+      if (segment && segment->offsets.empty()) {
+        // 空segment放不下这条记录，用更大的segment替换它
+        CloseSegment(segment, true);
+        segments_.pop_back();
+      }
+      segment = CreateSegment(next_index, need);
+    }
+    // 把能放进当前segment的记录拼成一次写入
+    std::string buf;
+    std::vector<int64_t> offsets;
+    int64_t offset = segment->write_offset;
+    for (; i < records.size(); i++) {
+      const std::string& record = records[i];
+      need = kRecordHeaderSize + record.size();
+      if (offset + need > segment->file_size) {
+        break;
+      }
+      uint32_t len = record.size();
+      uint32_t crc = RecordCrc(record.data(), record.size());
+      buf.append(reinterpret_cast<const char*>(&len), sizeof(len));
+      buf.append(reinterpret_cast<const char*>(&crc), sizeof(crc));
+      buf.append(record);
+      offsets.push_back(offset);
+      offset += need;
+    }
+    // 紧跟一个结束标记，截断后残留的旧记录不会在恢复时被读到
+    int64_t data_size = buf.size();
+    if (offset + kRecordHeaderSize <= segment->file_size) {
+      buf.append(kRecordHeaderSize, '\0');
+    }
+    if (!WriteTo(segment, segment->write_offset, buf.data(), buf.size())) {
+      return false;
+    }
+    segment->write_offset += data_size;
+    segment->offsets.insert(segment->offsets.end(), offsets.begin(),
+                            offsets.end());
+  }
+  return true;
+}
+
+SegmentLog::Segment* SegmentLog::FindSegment(int64_t index) {
+  mu_.AssertHeld();
+  if (segments_.empty() || index < segments_.front()->first_index) {
+    return NULL;
+  }
+  // 找到最后一个first_index <= index的segment
+  size_t lo = 0;
+  size_t hi = segments_.size();
+  while (hi - lo > 1) {
+    size_t mid = (lo + hi) / 2;
+    if (segments_[mid]->first_index <= index) {
+      lo = mid;
+    } else {
+      hi = mid;
+    }
+  }
+  Segment* segment = segments_[lo];
+  if (index - segment->first_index >=
+      static_cast<int64_t>(segment->offsets.size())) {
+    return NULL;
+  }
+  return segment;
+}
+
+bool SegmentLog::Read(int64_t index, std::string* record) {
+  MutexLock lock(&mu_);
+  Segment* segment = FindSegment(index);
+  if (segment == NULL) {
+    return false;
+  }
+  int64_t offset = segment->offsets[index - segment->first_index];
+  uint32_t len = 0;
+  memcpy(&len, segment->base + offset, sizeof(uint32_t));
+  record->assign(segment->base + offset + kRecordHeaderSize, len);
+  return true;
+}
+
+bool SegmentLog::Truncate(int64_t length) {
+  MutexLock lock(&mu_);
+  if (length < 0) {
+    length = 0;
+  }
+  while (!segments_.empty() && segments_.back()->first_index >= length) {
+    CloseSegment(segments_.back(), true);
+    segments_.pop_back();
+  }
+  if (segments_.empty()) {
+    start_index_ = length;
+    return true;
+  }
+  Segment* segment = segments_.back();
+  size_t keep = length - segment->first_index;
+  if (keep >= segment->offsets.size()) {
+    return true;
+  }
+  int64_t offset = segment->offsets[keep];
+  char marker[kRecordHeaderSize] = {'\0'};
+  if (!WriteTo(segment, offset, marker, kRecordHeaderSize)) {
+    return false;
+  }
+  segment->offsets.resize(keep);
+  segment->write_offset = offset;
+  return true;
+}
+
+void SegmentLog::RemoveBefore(int64_t index) {
+  MutexLock lock(&mu_);
+  while (segments_.size() > 1 && segments_[1]->first_index <= index) {
+    LOG(INFO) << "[segment log] remove segment: " << segments_.front()->path;
+    CloseSegment(segments_.front(), true);
+    segments_.pop_front();
+  }
+  if (!segments_.empty()) {
+    start_index_ = segments_.front()->first_index;
+  }
+}
+
+bool SegmentLog::Sync() {
+  MutexLock lock(&mu_);
+  for (auto segment : segments_) {
+    if (segment->dirty) {
+      if (fdatasync(segment->fd) != 0) {
+        LOG(WARNING) << "sync " << segment->path << " fail, "
+                     << strerror(errno);
+        return false;
+      }
+      segment->dirty = false;
+    }
+  }
+  if (dir_dirty_) {
+    int fd = open(dir_.c_str(), O_RDONLY);
+    if (fd >= 0) {
+      fsync(fd);
+      close(fd);
+    }
+    dir_dirty_ = false;
+  }
+  return true;
+}
+
+}  // namespace ins
+}  // namespace galaxy
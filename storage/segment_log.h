@@ -0,0 +1,79 @@
+#ifndef GALAXY_INS_SEGMENT_LOG_H_
+#define GALAXY_INS_SEGMENT_LOG_H_
+
+#include <stdint.h>
+#include <deque>
+#include <string>
+#include <vector>
+#include "common/mutex.h"
+
+namespace galaxy {
+namespace ins {
+
+// 分段的追加写日志文件，每个segment文件预分配固定大小，文件名为
+// 第一条记录的index；记录格式为 [len:4][crc32:4][data:len]，
+// len为0表示segment的有效数据到此结束
+class SegmentLog {
+ public:
+  SegmentLog(const std::string& dir, int64_t segment_size);
+  ~SegmentLog();
+
+  // 扫描目录下的segment并校验crc，恢复内存中的offset索引。
+  // 只截掉最后一个segment中写坏的尾部，其他错误返回false且不删除文件
+  bool Open();
+  // 日志为空时，下一条记录的index
+  void SetStartIndex(int64_t start_index);
+  int64_t FirstIndex();
+  int64_t Length();
+  bool Append(const std::vector<std::string>& records);
+  bool Read(int64_t index, std::string* record);
+  // 只保留[FirstIndex, length)，整段删除之后的segment
+  bool Truncate(int64_t length);
+  // 删除所有记录都小于index的segment，当前写入的segment不删除
+  void RemoveBefore(int64_t index);
+  bool Sync();
+
+  static const std::string kSegmentPrefix;
+
+ private:
+  struct Segment {
+    int64_t first_index;
+    std::string path;
+    int fd;
+    char* base;
+    int64_t file_size;
+    int64_t write_offset;
+    bool dirty;                    // written since last Sync
+    std::vector<int64_t> offsets;  // offset of each record in the file
+    Segment()
+        : first_index(0),
+          fd(-1),
+          base(NULL),
+          file_size(0),
+          write_offset(0),
+          dirty(false) {}
+  };
+
+  Segment* CreateSegment(int64_t first_index, int64_t min_size);
+  // last表示是最后一个segment，只有它允许存在写坏的尾部
+  bool LoadSegment(Segment* segment, bool last);
+  bool MapSegment(Segment* segment);
+  void CloseSegment(Segment* segment, bool remove_file);
+  Segment* FindSegment(int64_t index);
+  bool WriteTo(Segment* segment, int64_t offset, const char* data,
+               int64_t size);
+  std::string SegmentPath(int64_t first_index);
+
+ private:
+  std::string dir_;
+  int64_t segment_size_;
+  int64_t start_index_;
+  bool dir_dirty_;
+  std::deque<Segment*> segments_;
+  Mutex mu_;
+};
+
+}  // namespace ins
+}  // namespace galaxy
+
+#endif
@@ -0,0 +1,207 @@
+#include "segment_log.h"
+#include <gtest/gtest.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+#include "binlog.h"
+
+using namespace galaxy::ins;
+
+const std::string test_dir = "/tmp/segment_log_test";
+
+static std::string MakeRecord(int i) {
+  char buf[64] = {'\0'};
+  snprintf(buf, sizeof(buf), "record_%d", i);
+  return std::string(buf);
+}
+
+TEST(SegmentLogTest, AppendReadReopen) {
+  system(("rm -rf " + test_dir).c_str());
+  {
+    // 很小的segment，保证日志跨越多个segment
+    SegmentLog log(test_dir, 256);
+    ASSERT_TRUE(log.Open());
+    EXPECT_EQ(log.Length(), 0);
+    std::vector<std::string> records;
+    for (int i = 0; i < 100; i++) {
+      records.push_back(MakeRecord(i));
+    }
+    EXPECT_TRUE(log.Append(records));
+    EXPECT_EQ(log.Length(), 100);
+    for (int i = 0; i < 100; i++) {
+      std::string record;
+      EXPECT_TRUE(log.Read(i, &record));
+      EXPECT_EQ(record, MakeRecord(i));
+    }
+    std::string record;
+    EXPECT_FALSE(log.Read(100, &record));
+  }
+  SegmentLog log(test_dir, 256);
+  ASSERT_TRUE(log.Open());
+  EXPECT_EQ(log.Length(), 100);
+  std::string record;
+  EXPECT_TRUE(log.Read(57, &record));
+  EXPECT_EQ(record, MakeRecord(57));
+}
+
+TEST(SegmentLogTest, TruncateAndRemove) {
+  system(("rm -rf " + test_dir).c_str());
+  {
+    SegmentLog log(test_dir, 256);
+    ASSERT_TRUE(log.Open());
+    std::vector<std::string> records;
+    for (int i = 0; i < 100; i++) {
+      records.push_back(MakeRecord(i));
+    }
+    EXPECT_TRUE(log.Append(records));
+    EXPECT_TRUE(log.Truncate(50));
+    EXPECT_EQ(log.Length(), 50);
+    // 截断后追加较短的记录，重启后不能读到截断前残留的数据
+    records.clear();
+    records.push_back("x");
+    EXPECT_TRUE(log.Append(records));
+    EXPECT_EQ(log.Length(), 51);
+
+    log.RemoveBefore(30);
+    EXPECT_GT(log.FirstIndex(), 0);
+    EXPECT_LE(log.FirstIndex(), 30);
+    std::string record;
+    EXPECT_TRUE(log.Read(30, &record));
+    EXPECT_EQ(record, MakeRecord(30));
+  }
+  SegmentLog log(test_dir, 256);
+  ASSERT_TRUE(log.Open());
+  EXPECT_EQ(log.Length(), 51);
+  std::string record;
+  EXPECT_TRUE(log.Read(50, &record));
+  EXPECT_EQ(record, "x");
+  EXPECT_TRUE(log.Read(49, &record));
+  EXPECT_EQ(record, MakeRecord(49));
+}
+
+static void CorruptByte(const std::string& path, long offset) {
+  FILE* fp = fopen(path.c_str(), "r+");
+  ASSERT_TRUE(fp != NULL);
+  fseek(fp, offset, SEEK_SET);
+  int c = fgetc(fp);
+  fseek(fp, offset, SEEK_SET);
+  fputc(c ^ 0xff, fp);
+  fclose(fp);
+}
+
+TEST(SegmentLogTest, CorruptedSegment) {
+  system(("rm -rf " + test_dir).c_str());
+  std::vector<std::string> records;
+  for (int i = 0; i < 10; i++) {
+    records.push_back(MakeRecord(i));
+  }
+  const std::string first_segment =
+      test_dir + "/" + SegmentLog::kSegmentPrefix + "00000000000000000000";
+  {
+    SegmentLog log(test_dir, 4096);
+    ASSERT_TRUE(log.Open());
+    EXPECT_TRUE(log.Append(records));
+  }
+  // 最后一个segment写坏的尾部被截掉，之后可以继续追加
+  CorruptByte(first_segment, 10 * 16 - 1);
+  {
+    SegmentLog log(test_dir, 4096);
+    ASSERT_TRUE(log.Open());
+    EXPECT_EQ(log.Length(), 9);
+    std::vector<std::string> tail(1, "x");
+    EXPECT_TRUE(log.Append(tail));
+  }
+  {
+    SegmentLog log(test_dir, 4096);
+    ASSERT_TRUE(log.Open());
+    EXPECT_EQ(log.Length(), 10);
+    std::string record;
+    EXPECT_TRUE(log.Read(9, &record));
+    EXPECT_EQ(record, "x");
+  }
+
+  // 中间的segment损坏时打开失败，文件都保留
+  system(("rm -rf " + test_dir).c_str());
+  {
+    SegmentLog log(test_dir, 256);
+    ASSERT_TRUE(log.Open());
+    for (int i = 0; i < 10; i++) {
+      EXPECT_TRUE(log.Append(records));
+    }
+  }
+  CorruptByte(first_segment, 12);
+  SegmentLog log(test_dir, 256);
+  EXPECT_FALSE(log.Open());
+  EXPECT_EQ(access(first_segment.c_str(), F_OK), 0);
+  CorruptByte(first_segment, 12);
+  SegmentLog reopened(test_dir, 256);
+  ASSERT_TRUE(reopened.Open());
+  EXPECT_EQ(reopened.Length(), 100);
+}
+
+TEST(SegmentLogTest, BinLoggerMigration) {
+  const std::string binlog_dir = test_dir + "_binlog";
+  system(("rm -rf " + binlog_dir).c_str());
+  {
+    BinLogger bin_logger(binlog_dir);
+    for (int i = 0; i < 20; i++) {
+      LogEntry log_entry;
+      log_entry.key = MakeRecord(i);
+      log_entry.term = i / 10;
+      log_entry.op = kPut;
+      bin_logger.AppendEntry(log_entry);
+    }
+  }
+  BinLogger bin_logger(binlog_dir, false, 32768, 33554432, 0, kSegmentBinLog,
+                       4096);
+  EXPECT_EQ(bin_logger.GetLength(), 20);
+  int64_t last_log_index = -1;
+  int64_t last_log_term = -1;
+  bin_logger.GetLastLogIndexAndTerm(&last_log_index, &last_log_term);
+  EXPECT_EQ(last_log_index, 19);
+  EXPECT_EQ(last_log_term, 1);
+  for (int i = 0; i < 20; i++) {
+    LogEntry log_entry;
+    EXPECT_TRUE(bin_logger.ReadSlot(i, &log_entry));
+    EXPECT_EQ(log_entry.key, MakeRecord(i));
+  }
+  bin_logger.Truncate(9);
+  EXPECT_EQ(bin_logger.GetLength(), 10);
+  bin_logger.GetLastLogIndexAndTerm(&last_log_index, &last_log_term);
+  EXPECT_EQ(last_log_term, 0);
+}
+
+TEST(SegmentLogTest, BinLoggerReset) {
+  const std::string binlog_dir = test_dir + "_reset";
+  system(("rm -rf " + binlog_dir).c_str());
+  {
+    BinLogger bin_logger(binlog_dir, false, 32768, 33554432, 0,
+                         kSegmentBinLog, 4096);
+    LogEntry log_entry;
+    log_entry.term = 1;
+    log_entry.op = kPut;
+    for (int i = 0; i < 20; i++) {
+      log_entry.key = MakeRecord(i);
+      bin_logger.AppendEntry(log_entry);
+    }
+    bin_logger.Reset(1000, 5);
+  }
+  // 重启后从快照位置的segment恢复
+  BinLogger bin_logger(binlog_dir, false, 32768, 33554432, 0, kSegmentBinLog,
+                       4096);
+  EXPECT_EQ(bin_logger.GetLength(), 1001);
+  int64_t last_log_index = -1;
+  int64_t last_log_term = -1;
+  bin_logger.GetLastLogIndexAndTerm(&last_log_index, &last_log_term);
+  EXPECT_EQ(last_log_index, 1000);
+  EXPECT_EQ(last_log_term, 5);
+  LogEntry log_entry;
+  EXPECT_FALSE(bin_logger.ReadSlot(10, &log_entry));
+}
+
+int main(int argc, char* argv[]) {
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -1,8 +1,11 @@
 #include "storage_manage.h"
 
 #include <assert.h>
+#include <dirent.h>
+#include <stdio.h>
 #include <gflags/gflags.h>
 #include <glog/logging.h>
+#include <vector>
 #include "leveldb/db.h"
 #include "utils.h"
 
@@ -14,27 +17,43 @@ namespace galaxy {
 namespace ins {
 
 const std::string StorageManager::anonymous_user = "";
+const std::string db_suffix = "@db";
 
-StorageManager::StorageManager(const std::string& data_dir)
-    : data_dir_(data_dir) {
-  bool ok = ins_common::Mkdirs(data_dir.c_str());
-  if (!ok) {
-    LOG(FATAL) << "failed to create dir: " << data_dir;
-  }
-  // Create default database for shared namespace, i.e. anonymous user
-  std::string full_name = data_dir + "/@db";
+static leveldb::Options GetDBOptions() {
   leveldb::Options options;
   options.create_if_missing = true;
   if (FLAGS_ins_data_compress) {
     options.compression = leveldb::kSnappyCompression;
-    LOG(INFO) << "enable snappy compress for data storage " << full_name;
   }
   options.write_buffer_size = FLAGS_ins_data_write_buffer_size * 1024 * 1024;
   options.block_size = FLAGS_ins_data_block_size * 1024;
+  return options;
+}
+
+static leveldb::Status OpenDB(const std::string& full_name, leveldb::DB** db) {
+  leveldb::Options options = GetDBOptions();
+  if (FLAGS_ins_data_compress) {
+    LOG(INFO) << "enable snappy compress for data storage " << full_name;
+  }
   LOG(INFO) << "[data]: block_size: " << options.block_size
              << ", writer_buffer_size: " << options.write_buffer_size;
+  return leveldb::DB::Open(options, full_name, db);
+}
+
+StorageManager::StorageManager(const std::string& data_dir)
+    : snapshot_cond_(&mu_),
+      live_snapshots_(0),
+      active_users_(0),
+      restoring_(false),
+      data_dir_(data_dir) {
+  bool ok = ins_common::Mkdirs(data_dir.c_str());
+  if (!ok) {
+    LOG(FATAL) << "failed to create dir: " << data_dir;
+  }
+  // Create default database for shared namespace, i.e. anonymous user
+  std::string full_name = data_dir + "/" + db_suffix;
   leveldb::DB* default_db = NULL;
-  leveldb::Status status = leveldb::DB::Open(options, full_name, &default_db);
+  leveldb::Status status = OpenDB(full_name, &default_db);
   assert(status.ok());
   dbs_[anonymous_user] = default_db;
 }
@@ -54,19 +73,9 @@ bool StorageManager::OpenDatabase(const std::string& name) {
       return true;
     }
   }
-  std::string full_name = data_dir_ + "/" + name + "@db";
-  leveldb::Options options;
-  options.create_if_missing = true;
-  if (FLAGS_ins_data_compress) {
-    options.compression = leveldb::kSnappyCompression;
-    LOG(INFO) << "enable snappy compress for data storage " << full_name;
-  }
-  options.write_buffer_size = FLAGS_ins_data_write_buffer_size * 1024 * 1024;
-  options.block_size = FLAGS_ins_data_block_size * 1024;
-  LOG(INFO) << "[data]: block_size: " << options.block_size
-             << ", writer_buffer_size: " << options.write_buffer_size;
+  std::string full_name = data_dir_ + "/" + name + db_suffix;
   leveldb::DB* current_db = NULL;
-  leveldb::Status status = leveldb::DB::Open(options, full_name, &current_db);
+  leveldb::Status status = OpenDB(full_name, &current_db);
   {
     MutexLock lock(&mu_);
     dbs_[name] = current_db;
@@ -88,6 +97,9 @@ Status StorageManager::FindDB(const std::string& name, leveldb::DB** ret) {
   leveldb::DB* db_ptr = NULL;
   {
     MutexLock lock(&mu_);
+    while (restoring_) {
+      snapshot_cond_.Wait();
+    }
     auto dbs_it = dbs_.find(name);
     if (dbs_it == dbs_.end()) {
       LOG(WARNING) << "Not exist or unlogged user: " << name;
@@ -98,11 +110,19 @@ Status StorageManager::FindDB(const std::string& name, leveldb::DB** ret) {
       LOG(WARNING) << "Try to access a closing database: " << name;
       return kError;
     }
+    ++active_users_;
   }
   *ret = db_ptr;
   return kOk;
 }
 
+void StorageManager::ReleaseDB() {
+  MutexLock lock(&mu_);
+  if (--active_users_ == 0) {
+    snapshot_cond_.Broadcast();
+  }
+}
+
 Status StorageManager::Get(const std::string& name, const std::string& key,
                            std::string* value) {
   if (value == NULL) {
@@ -114,6 +134,7 @@ Status StorageManager::Get(const std::string& name, const std::string& key,
     return s;
   }
   leveldb::Status status = db_ptr->Get(leveldb::ReadOptions(), key, value);
+  ReleaseDB();
   return (status.ok()) ? kOk : ((status.IsNotFound()) ? kNotFound : kError);
 }
 
@@ -125,6 +146,7 @@ Status StorageManager::Put(const std::string& name, const std::string& key,
     return s;
   }
   leveldb::Status status = db_ptr->Put(leveldb::WriteOptions(), key, value);
+  ReleaseDB();
   return (status.ok()) ? kOk : kError;
 }
 
@@ -135,16 +157,226 @@ Status StorageManager::Delete(const std::string& name, const std::string& key) {
     return s;
   }
   leveldb::Status status = db_ptr->Delete(leveldb::WriteOptions(), key);
+  ReleaseDB();
   // Note: leveldb returns kOk even if the key is inexist
   return (status.ok()) ? kOk : kError;
 }
 
+Status StorageManager::Get(const std::string& name, const std::string& key,
+                           std::string* value, const WriteBatch& batch) {
+  Status s = kOk;
+  if (batch.Get(name, key, &s, value)) {
+    return s;
+  }
+  return Get(name, key, value);
+}
+
+Status StorageManager::Write(WriteBatch* batch) {
+  MutexLock write_lock(&write_mu_);
+  std::vector<std::string> names;
+  for (auto it = batch->batches_.begin(); it != batch->batches_.end(); ++it) {
+    if (it->first != anonymous_user) {
+      names.push_back(it->first);
+    }
+  }
+  if (batch->batches_.find(anonymous_user) != batch->batches_.end()) {
+    names.push_back(anonymous_user);
+  }
+  for (auto& name : names) {
+    leveldb::DB* db_ptr = NULL;
+    Status s = FindDB(name, &db_ptr);
+    if (s == kUnknownUser && OpenDatabase(name)) {
+      s = FindDB(name, &db_ptr);
+    }
+    if (s != kOk) {
+      LOG(WARNING) << "failed to write batch to database: " << name;
+      return s;
+    }
+    leveldb::Status status =
+        db_ptr->Write(leveldb::WriteOptions(), &batch->batches_[name]);
+    ReleaseDB();
+    if (!status.ok()) {
+      return kError;
+    }
+  }
+  batch->Clear();
+  return kOk;
+}
+
+StorageManager::Snapshot* StorageManager::NewSnapshot() {
+  MutexLock write_lock(&write_mu_);
+  MutexLock lock(&mu_);
+  Snapshot* snapshot = new Snapshot(this);
+  for (auto it = dbs_.begin(); it != dbs_.end(); ++it) {
+    if (it->second == NULL) {
+      continue;
+    }
+    snapshot->names_.push_back(it->first);
+    snapshot->dbs_[it->first] =
+        std::make_pair(it->second, it->second->GetSnapshot());
+  }
+  ++live_snapshots_;
+  return snapshot;
+}
+
+// 先关闭并删除现有的数据库，再把snapshot_dir下的数据库移过来；
+// 只处理以@db结尾的目录，同一目录下的userdb由UserManager负责
+bool StorageManager::Restore(const std::string& snapshot_dir) {
+  MutexLock write_lock(&write_mu_);
+  MutexLock lock(&mu_);
+  // 挡住新的读写，等待已经拿到数据库指针的读写结束
+  restoring_ = true;
+  while (live_snapshots_ > 0 || active_users_ > 0) {
+    snapshot_cond_.Wait();
+  }
+  std::vector<std::string> open_names;
+  for (auto it = dbs_.begin(); it != dbs_.end(); ++it) {
+    open_names.push_back(it->first);
+    delete it->second;
+  }
+  dbs_.clear();
+  if (!DestroyDatabases(data_dir_)) {
+    LOG(FATAL) << "failed to remove databases in " << data_dir_;
+  }
+  std::vector<std::string> new_dbs;
+  ListDatabases(snapshot_dir, &new_dbs);
+  bool ok = true;
+  for (auto& name : new_dbs) {
+    std::string from = snapshot_dir + "/" + name + db_suffix;
+    std::string to = data_dir_ + "/" + name + db_suffix;
+    if (rename(from.c_str(), to.c_str()) != 0) {
+      LOG(WARNING) << "failed to move " << from << " to " << to;
+      ok = false;
+    }
+  }
+  // 重新打开之前已经打开的数据库，保证已登录用户的访问不受影响
+  for (auto& name : open_names) {
+    leveldb::DB* db_ptr = NULL;
+    leveldb::Status status = OpenDB(data_dir_ + "/" + name + db_suffix, &db_ptr);
+    if (!status.ok()) {
+      LOG(FATAL) << "failed to reopen database: " << name << ", "
+                 << status.ToString();
+    }
+    dbs_[name] = db_ptr;
+  }
+  restoring_ = false;
+  snapshot_cond_.Broadcast();
+  LOG(INFO) << "[data] restored " << new_dbs.size() << " databases from "
+            << snapshot_dir;
+  return ok;
+}
+
+bool StorageManager::DestroyDatabases(const std::string& dir) {
+  std::vector<std::string> names;
+  ListDatabases(dir, &names);
+  for (auto& name : names) {
+    std::string full_name = dir + "/" + name + db_suffix;
+    leveldb::Status status = leveldb::DestroyDB(full_name, GetDBOptions());
+    if (!status.ok()) {
+      LOG(WARNING) << "failed to remove database: " << full_name << ", "
+                   << status.ToString();
+      return false;
+    }
+  }
+  return true;
+}
+
+void StorageManager::ListDatabases(const std::string& dir,
+                                   std::vector<std::string>* names) {
+  DIR* dp = opendir(dir.c_str());
+  if (dp == NULL) {
+    return;
+  }
+  struct dirent* entry = NULL;
+  while ((entry = readdir(dp)) != NULL) {
+    std::string file_name(entry->d_name);
+    if (file_name.size() >= db_suffix.size() &&
+        file_name.compare(file_name.size() - db_suffix.size(),
+                          db_suffix.size(), db_suffix) == 0) {
+      names->push_back(
+          file_name.substr(0, file_name.size() - db_suffix.size()));
+    }
+  }
+  closedir(dp);
+}
+
+StorageManager::Snapshot::~Snapshot() {
+  for (auto it = dbs_.begin(); it != dbs_.end(); ++it) {
+    it->second.first->ReleaseSnapshot(it->second.second);
+  }
+  MutexLock lock(&manager_->mu_);
+  --manager_->live_snapshots_;
+  manager_->snapshot_cond_.Broadcast();
+}
+
+Status StorageManager::Snapshot::Get(const std::string& name,
+                                     const std::string& key,
+                                     std::string* value) const {
+  auto it = dbs_.find(name);
+  if (it == dbs_.end()) {
+    return kUnknownUser;
+  }
+  leveldb::ReadOptions options;
+  options.snapshot = it->second.second;
+  leveldb::Status status = it->second.first->Get(options, key, value);
+  return (status.ok()) ? kOk : ((status.IsNotFound()) ? kNotFound : kError);
+}
+
+StorageManager::Iterator* StorageManager::Snapshot::NewIterator(
+    const std::string& name) const {
+  auto it = dbs_.find(name);
+  if (it == dbs_.end()) {
+    return NULL;
+  }
+  leveldb::ReadOptions options;
+  options.snapshot = it->second.second;
+  return new StorageManager::Iterator(it->second.first, options);
+}
+
+void StorageManager::WriteBatch::Put(const std::string& name,
+                                     const std::string& key,
+                                     const std::string& value) {
+  batches_[name].Put(key, value);
+  overlay_[name][key] = std::make_pair(false, value);
+}
+
+void StorageManager::WriteBatch::Delete(const std::string& name,
+                                        const std::string& key) {
+  batches_[name].Delete(key);
+  overlay_[name][key] = std::make_pair(true, std::string());
+}
+
+bool StorageManager::WriteBatch::Get(const std::string& name,
+                                     const std::string& key, Status* status,
+                                     std::string* value) const {
+  auto db_it = overlay_.find(name);
+  if (db_it == overlay_.end()) {
+    return false;
+  }
+  auto it = db_it->second.find(key);
+  if (it == db_it->second.end()) {
+    return false;
+  }
+  if (it->second.first) {
+    *status = kNotFound;
+  } else {
+    *status = kOk;
+    *value = it->second.second;
+  }
+  return true;
+}
+
+void StorageManager::WriteBatch::Clear() {
+  batches_.clear();
+  overlay_.clear();
+}
+
 StorageManager::Iterator* StorageManager::NewIterator(const std::string& name) {
   leveldb::DB* db_ptr = NULL;
   if (FindDB(name, &db_ptr) != kOk) {
     return NULL;
   }
-  return new StorageManager::Iterator(db_ptr, leveldb::ReadOptions());
+  return new StorageManager::Iterator(db_ptr, leveldb::ReadOptions(), this);
 }
 
 std::string StorageManager::Iterator::key() const {
@@ -3,8 +3,10 @@
 
 #include <map>
 #include <string>
+#include <vector>
 #include "common/mutex.h"
 #include "leveldb/db.h"
+#include "leveldb/write_batch.h"
 #include "proto/ins_node.pb.h"
 
 namespace galaxy {
@@ -12,6 +14,9 @@ namespace ins {
 
 class StorageManager {
  public:
+  class WriteBatch;
+  class Snapshot;
+
   StorageManager(const std::string& data_dir);
   ~StorageManager();
 
@@ -23,18 +28,37 @@ class StorageManager {
   Status Put(const std::string& name, const std::string& key,
              const std::string& value);
   Status Delete(const std::string& name, const std::string& key);
+  // 先查batch中还没有提交的修改，再查数据库
+  Status Get(const std::string& name, const std::string& key,
+             std::string* value, const WriteBatch& batch);
+  // 每个用户数据库一次leveldb写，匿名用户的数据库最后写
+  Status Write(WriteBatch* batch);
+  // 所有数据库在两次Write之间的一致快照，用完后delete
+  Snapshot* NewSnapshot();
+  // 用snapshot_dir下的数据库替换当前全部数据库，会等待所有Snapshot和
+  // 正在进行的读写(包括未释放的Iterator)结束，期间新的读写会阻塞
+  bool Restore(const std::string& snapshot_dir);
+  // 删除dir下的全部数据库，调用时不能有StorageManager打开这个目录
+  static bool DestroyDatabases(const std::string& dir);
 
   // All user field in proto set default value to anonymous_user, which is ""
   static const std::string anonymous_user;
 
  private:
+  // 成功时登记一个使用者，用完数据库后要调用ReleaseDB
   Status FindDB(const std::string& name, leveldb::DB** ret);
+  void ReleaseDB();
+  static void ListDatabases(const std::string& dir,
+                            std::vector<std::string>* names);
 
  public:
   class Iterator {
    public:
-    Iterator() : it_(NULL) {}
-    Iterator(leveldb::DB* db, const leveldb::ReadOptions& option) {
+    Iterator() : it_(NULL), manager_(NULL) {}
+    // manager不为NULL时，析构时释放FindDB登记的使用者
+    Iterator(leveldb::DB* db, const leveldb::ReadOptions& option,
+             StorageManager* manager = NULL)
+        : manager_(manager) {
       it_ = db->NewIterator(option);
     }
     ~Iterator() {
@@ -42,6 +66,9 @@ class StorageManager {
         delete it_;
         it_ = NULL;
       }
+      if (manager_ != NULL) {
+        manager_->ReleaseDB();
+      }
     }
 
     std::string key() const;
@@ -55,12 +82,56 @@ class StorageManager {
 
    private:
     leveldb::Iterator* it_;
+    StorageManager* manager_;
   };
 
   Iterator* NewIterator(const std::string& name);
 
+  class Snapshot {
+   public:
+    ~Snapshot();
+    const std::vector<std::string>& Names() const { return names_; }
+    Status Get(const std::string& name, const std::string& key,
+               std::string* value) const;
+    // 返回的Iterator不能比Snapshot活得更久
+    Iterator* NewIterator(const std::string& name) const;
+
+   private:
+    friend class StorageManager;
+    explicit Snapshot(StorageManager* manager) : manager_(manager) {}
+    StorageManager* manager_;
+    std::vector<std::string> names_;
+    std::map<std::string, std::pair<leveldb::DB*, const leveldb::Snapshot*> >
+        dbs_;
+  };
+
+  // 跨多个用户数据库的批量修改，提交前的修改对本batch可见
+  class WriteBatch {
+   public:
+    void Put(const std::string& name, const std::string& key,
+             const std::string& value);
+    void Delete(const std::string& name, const std::string& key);
+    // 返回false表示batch中没有修改过这个key
+    bool Get(const std::string& name, const std::string& key, Status* status,
+             std::string* value) const;
+    bool Empty() const { return batches_.empty(); }
+    void Clear();
+
+   private:
+    friend class StorageManager;
+    std::map<std::string, leveldb::WriteBatch> batches_;
+    // name -> key -> (deleted, value)
+    std::map<std::string, std::map<std::string, std::pair<bool, std::string> > >
+        overlay_;
+  };
+
  private:
+  Mutex write_mu_;  // serializes Write/NewSnapshot/Restore, taken before mu_
   Mutex mu_;
+  CondVar snapshot_cond_;
+  int32_t live_snapshots_;
+  int32_t active_users_;  // FindDB拿到的数据库指针还在使用中
+  bool restoring_;
   std::string data_dir_;
   std::map<std::string, leveldb::DB*> dbs_;
 };
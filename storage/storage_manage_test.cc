@@ -1,8 +1,11 @@
 #include "storage/storage_manage.h"
 #include <gtest/gtest.h>
+#include <stdlib.h>
+#include <unistd.h>
 #include <boost/lexical_cast.hpp>
 #include <set>
 #include <string>
+#include "common/thread.h"
 #include "proto/ins_node.pb.h"
 
 using namespace galaxy::ins;
@@ -113,6 +116,112 @@ TEST(StorageManageTest, IteratorTest) {
   storage_manager.CloseDatabase("user1");
 }
 
+TEST(StorageManageTest, WriteBatchTest) {
+  StorageManager storage_manager("/tmp/storage_test4");
+  Status ret = storage_manager.Put("", "Old", "Value");
+  EXPECT_EQ(ret, kOk);
+  StorageManager::WriteBatch batch;
+  batch.Put("", "Hello", "World");
+  batch.Delete("", "Old");
+  // user2 is not opened yet, Write should open it
+  batch.Put("user2", "Name", "User2");
+  // Uncommitted changes are visible through the batch only
+  std::string value;
+  ret = storage_manager.Get("", "Hello", &value, batch);
+  EXPECT_EQ(ret, kOk);
+  EXPECT_EQ(value, "World");
+  ret = storage_manager.Get("", "Old", &value, batch);
+  EXPECT_EQ(ret, kNotFound);
+  ret = storage_manager.Get("", "Old", &value);
+  EXPECT_EQ(ret, kOk);
+  ret = storage_manager.Get("", "Hello", &value);
+  EXPECT_EQ(ret, kNotFound);
+
+  ret = storage_manager.Write(&batch);
+  EXPECT_EQ(ret, kOk);
+  EXPECT_TRUE(batch.Empty());
+  ret = storage_manager.Get("", "Hello", &value);
+  EXPECT_EQ(ret, kOk);
+  EXPECT_EQ(value, "World");
+  ret = storage_manager.Get("", "Old", &value);
+  EXPECT_EQ(ret, kNotFound);
+  ret = storage_manager.Get("user2", "Name", &value);
+  EXPECT_EQ(ret, kOk);
+  EXPECT_EQ(value, "User2");
+}
+
+TEST(StorageManageTest, SnapshotRestoreTest) {
+  system("rm -rf /tmp/storage_test5 /tmp/storage_test5_snapshot");
+  StorageManager storage_manager("/tmp/storage_test5");
+  EXPECT_EQ(storage_manager.Put("", "Key", "Old"), kOk);
+  EXPECT_TRUE(storage_manager.OpenDatabase("user1"));
+  EXPECT_EQ(storage_manager.Put("user1", "Key", "User1"), kOk);
+
+  // Changes after the snapshot is taken are invisible to it
+  StorageManager::Snapshot* snapshot = storage_manager.NewSnapshot();
+  EXPECT_EQ(storage_manager.Put("", "Key", "New"), kOk);
+  std::string value;
+  EXPECT_EQ(snapshot->Get("", "Key", &value), kOk);
+  EXPECT_EQ(value, "Old");
+  EXPECT_EQ(snapshot->Names().size(), 2u);
+
+  // Copy the snapshot into another directory, as a follower does
+  {
+    StorageManager target("/tmp/storage_test5_snapshot");
+    StorageManager::WriteBatch batch;
+    for (auto& name : snapshot->Names()) {
+      StorageManager::Iterator* it = snapshot->NewIterator(name);
+      for (it->Seek(""); it->Valid(); it->Next()) {
+        batch.Put(name, it->key(), it->value());
+      }
+      delete it;
+    }
+    EXPECT_EQ(target.Write(&batch), kOk);
+  }
+  delete snapshot;
+
+  EXPECT_TRUE(storage_manager.OpenDatabase("user2"));
+  EXPECT_EQ(storage_manager.Put("user2", "Key", "User2"), kOk);
+  EXPECT_TRUE(storage_manager.Restore("/tmp/storage_test5_snapshot"));
+  EXPECT_EQ(storage_manager.Get("", "Key", &value), kOk);
+  EXPECT_EQ(value, "Old");
+  EXPECT_EQ(storage_manager.Get("user1", "Key", &value), kOk);
+  EXPECT_EQ(value, "User1");
+  // user2 is not in the snapshot, its data is dropped
+  EXPECT_EQ(storage_manager.Get("user2", "Key", &value), kNotFound);
+}
+
+TEST(StorageManageTest, RestoreWaitsForReadersTest) {
+  system("rm -rf /tmp/storage_test6 /tmp/storage_test6_snapshot");
+  StorageManager storage_manager("/tmp/storage_test6");
+  EXPECT_EQ(storage_manager.Put("", "Key", "Old"), kOk);
+  {
+    StorageManager target("/tmp/storage_test6_snapshot");
+    EXPECT_EQ(target.Put("", "Key", "New"), kOk);
+  }
+
+  // An open iterator keeps the database alive until it is deleted
+  StorageManager::Iterator* it = storage_manager.NewIterator("");
+  ASSERT_TRUE(it != NULL);
+  volatile bool restored = false;
+  ins_common::Thread restore_thread;
+  restore_thread.Start([&]() {
+    EXPECT_TRUE(storage_manager.Restore("/tmp/storage_test6_snapshot"));
+    restored = true;
+  });
+  usleep(200000);
+  EXPECT_FALSE(restored);
+  it->Seek("");
+  ASSERT_TRUE(it->Valid());
+  EXPECT_EQ(it->value(), "Old");
+  delete it;
+  restore_thread.Join();
+  EXPECT_TRUE(restored);
+  std::string value;
+  EXPECT_EQ(storage_manager.Get("", "Key", &value), kOk);
+  EXPECT_EQ(value, "New");
+}
+
 int main(int argc, char* argv[]) {
   testing::InitGoogleTest(&argc, argv);
   return RUN_ALL_TESTS();